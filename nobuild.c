@@ -1,16 +1,743 @@
+#define _DEFAULT_SOURCE
 #define NOBUILD_IMPLEMENTATION
 #include "./nobuild.h"
 #define CFLAGS "-Wall", "-Wextra", "-std=c11", "-pedantic", "-ggdb"
 
+#ifndef _WIN32
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// A synthetic sheet of the benchmark corpus. The same description always
+// produces the same file, byte for byte.
+typedef struct {
+	const char *name;
+	uint64_t seed;
+	size_t rows;
+	size_t cols;
+	// percent of the cells holding a formula, the rest is split between
+	// text and numbers
+	int formulas;
+	int texts;
+	// cells read by a formula, or rows summed by a range
+	size_t fan_in;
+	// formulas read from the last `locality` rows, 0 is any row above
+	size_t locality;
+	// when non-zero formulas only read the first `hot` rows, which are
+	// all numbers, so few cells fan out to the whole sheet
+	size_t hot;
+	// when non-zero the first operand of a formula is the cell right above
+	// it, so chains of formulas run `chain` rows deep
+	size_t chain;
+	// formulas are SUM(...) over `fan_in` rows of a column
+	bool ranges;
+	// every column is either numbers or the same formula shifted down one
+	// row per cell, like a column filled down in a spreadsheet
+	bool shifted;
+} Bench_Sheet;
+
+static const Bench_Sheet bench_sheets[] = {
+	{.name = "numbers", .seed = 1, .rows = 200000, .cols = 10},
+	{.name = "text",    .seed = 2, .rows = 100000, .cols = 10, .formulas = 20, .texts = 40, .fan_in = 2, .locality = 16},
+	{.name = "local",   .seed = 3, .rows = 100000, .cols = 10, .formulas = 50, .fan_in = 4, .locality = 8},
+	{.name = "far",     .seed = 4, .rows = 100000, .cols = 10, .formulas = 50, .fan_in = 4},
+	{.name = "chain",   .seed = 5, .rows = 200000, .cols = 4,  .formulas = 100, .fan_in = 2, .locality = 4, .chain = 200000},
+	{.name = "fanin",   .seed = 6, .rows = 50000,  .cols = 10, .formulas = 50, .fan_in = 16, .locality = 64},
+	{.name = "fanout",  .seed = 7, .rows = 100000, .cols = 10, .formulas = 80, .fan_in = 2, .hot = 4},
+	{.name = "shifted", .seed = 8, .rows = 100000, .cols = 10, .formulas = 50, .fan_in = 3, .locality = 4, .shifted = true},
+	{.name = "ranges",  .seed = 9, .rows = 50000,  .cols = 8,  .formulas = 25, .fan_in = 32, .locality = 64, .ranges = true},
+};
+
+#define BENCH_SHEETS_COUNT (sizeof(bench_sheets) / sizeof(bench_sheets[0]))
+
+// Runs of every sheet, the fastest one is reported
+#define BENCH_RUNS 3
+
+typedef enum {
+	BENCH_NUMBER = 0,
+	BENCH_TEXT,
+	BENCH_FORMULA,
+} Bench_Kind;
+
+// splitmix64, the whole sheet is a function of (seed, row, col) so the
+// kind of any cell can be looked up again while writing formulas
+uint64_t bench_hash(uint64_t x){
+	x += 0x9e3779b97f4a7c15;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+	return x ^ (x >> 31);
+}
+
+uint64_t bench_cell_hash(const Bench_Sheet *sheet, size_t row, size_t col, uint64_t salt){
+	return bench_hash(bench_hash(bench_hash(sheet->seed ^ salt) ^ row) ^ col);
+}
+
+Bench_Kind bench_kind(const Bench_Sheet *sheet, size_t row, size_t col){
+	if(sheet->shifted){
+		if(row < sheet->locality){
+			return BENCH_NUMBER;
+		}
+		return bench_cell_hash(sheet, 0, col, 1) % 100 < (uint64_t) sheet->formulas ? BENCH_FORMULA : BENCH_NUMBER;
+	}
+	if(row == 0 || row < sheet->hot){
+		return BENCH_NUMBER;
+	}
+	uint64_t roll = bench_cell_hash(sheet, row, col, 1) % 100;
+	if(roll < (uint64_t) sheet->formulas){
+		return BENCH_FORMULA;
+	}
+	if(roll < (uint64_t) (sheet->formulas + sheet->texts)){
+		return BENCH_TEXT;
+	}
+	return BENCH_NUMBER;
+}
+
+// Picks a cell above `row` for the i-th operand of a formula, false when
+// only text was found there
+bool bench_pick_operand(const Bench_Sheet *sheet, size_t row, size_t col, size_t i, size_t *ref_row, size_t *ref_col){
+	if(sheet->chain > 0 && i == 0 && row % sheet->chain != 0){
+		*ref_row = row - 1;
+		*ref_col = col;
+		return bench_kind(sheet, *ref_row, *ref_col) != BENCH_TEXT;
+	}
+	for(uint64_t attempt = 0; attempt < 8; ++attempt){
+		// shifted columns pick their offsets once for the whole column
+		uint64_t h = sheet->shifted
+			? bench_cell_hash(sheet, i, col, 2 + attempt)
+			: bench_cell_hash(sheet, row, col, 2 + i * 8 + attempt);
+		if(sheet->hot > 0){
+			*ref_row = h % sheet->hot;
+		} else {
+			size_t span = sheet->locality > 0 && sheet->locality < row ? sheet->locality : row;
+			*ref_row = row - 1 - (h % span);
+		}
+		*ref_col = (h >> 32) % sheet->cols;
+		if(bench_kind(sheet, *ref_row, *ref_col) != BENCH_TEXT){
+			return true;
+		}
+	}
+	return false;
+}
+
+void bench_write_formula(FILE *f, const Bench_Sheet *sheet, size_t row, size_t col){
+	fputc('=', f);
+	if(sheet->ranges){
+		size_t ref_row = 0;
+		size_t ref_col = 0;
+		bench_pick_operand(sheet, row, col, 0, &ref_row, &ref_col);
+		size_t first = ref_row + 1 > sheet->fan_in ? ref_row + 1 - sheet->fan_in : 0;
+		fprintf(f, "SUM(%c%zu:%c%zu)", (char) ('A' + ref_col), first, (char) ('A' + ref_col), ref_row);
+		return;
+	}
+	for(size_t i = 0; i < sheet->fan_in; ++i){
+		if(i > 0){
+			fputc('+', f);
+		}
+		size_t ref_row = 0;
+		size_t ref_col = 0;
+		if(bench_pick_operand(sheet, row, col, i, &ref_row, &ref_col)){
+			fprintf(f, "%c%zu", (char) ('A' + ref_col), ref_row);
+		} else {
+			fprintf(f, "%zu", (size_t) (bench_cell_hash(sheet, row, col, 100 + i) % 100));
+		}
+	}
+}
+
+static const char *bench_words[] = {"apple", "total", "n/a", "x y", "hello world", "Q3 2021"};
+
+void bench_generate(const Bench_Sheet *sheet, Cstr path){
+	assert(sheet->cols <= 26 && "columns are single letters");
+	FILE *f = fopen(path, "wb");
+	if(f == NULL){
+		PANIC("could not open file %s: %s", path, strerror(errno));
+	}
+	for(size_t row = 0; row < sheet->rows; ++row){
+		for(size_t col = 0; col < sheet->cols; ++col){
+			if(col > 0){
+				fputc('|', f);
+			}
+			switch(bench_kind(sheet, row, col)){
+			case BENCH_NUMBER: {
+				uint64_t h = bench_cell_hash(sheet, row, col, 3);
+				fprintf(f, "%d.%02d", (int) (h % 2000) - 1000, (int) ((h >> 32) % 100));
+			} break;
+			case BENCH_TEXT:
+				fputs(bench_words[bench_cell_hash(sheet, row, col, 4) % (sizeof(bench_words) / sizeof(bench_words[0]))], f);
+				break;
+			case BENCH_FORMULA:
+				bench_write_formula(f, sheet, row, col);
+				break;
+			}
+		}
+		fputc('\n', f);
+	}
+	if(fclose(f) != 0){
+		PANIC("could not write file %s: %s", path, strerror(errno));
+	}
+}
+
+typedef struct {
+	double wall;
+	double cpu;
+	// kilobytes
+	long max_rss;
+	// the report of --stats-json, minicel's own timing of its phases
+	char stats[4096];
+} Bench_Run;
+
+double bench_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// Runs the command with the output thrown away and its stderr, where
+// --stats-json goes, saved into the run
+Bench_Run bench_run(Cmd cmd){
+	Cstr stats_path = PATH("bench", "stats.json");
+	Fd devnull = fd_open_for_write("/dev/null");
+	Fd stats_fd = fd_open_for_write(stats_path);
+	int saved_stderr = dup(STDERR_FILENO);
+	dup2(stats_fd, STDERR_FILENO);
+	double start = bench_now();
+	Pid pid = cmd_run_async(cmd, NULL, &devnull);
+	dup2(saved_stderr, STDERR_FILENO);
+	close(saved_stderr);
+	int wstatus = 0;
+	struct rusage usage = {0};
+	if(wait4(pid, &wstatus, 0, &usage) < 0){
+		PANIC("could not wait on command (pid %d): %s", pid, strerror(errno));
+	}
+	double wall = bench_now() - start;
+	fd_close(devnull);
+	fd_close(stats_fd);
+	if(!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0){
+		PANIC("command failed: %s", cmd_show(cmd));
+	}
+
+	Bench_Run run = {
+		.wall = wall,
+		.cpu = (double) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+			+ (double) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6,
+		.max_rss = usage.ru_maxrss,
+	};
+	FILE *f = fopen(stats_path, "rb");
+	if(f == NULL){
+		PANIC("could not open file %s: %s", stats_path, strerror(errno));
+	}
+	size_t n = fread(run.stats, 1, sizeof(run.stats) - 1, f);
+	run.stats[n] = '\0';
+	fclose(f);
+	return run;
+}
+
+Bench_Run bench_best_of(Cmd cmd){
+	Bench_Run best = bench_run(cmd);
+	for(int i = 1; i < BENCH_RUNS; ++i){
+		Bench_Run run = bench_run(cmd);
+		if(run.wall < best.wall){
+			best = run;
+		}
+	}
+	return best;
+}
+
+void bench_report(const char *name, const char *phase, size_t cells, size_t bytes, Bench_Run run){
+	printf("%-8s %-6s %9.1f %9.1f %10.2f %8.1f %8.1f\n",
+		name, phase, run.wall * 1e3, run.cpu * 1e3,
+		(double) cells / run.wall * 1e-6, (double) bytes / run.wall / (1024.0 * 1024.0),
+		(double) run.max_rss / 1024.0);
+
+	// "phases": {"read": {"wall_ms": 0.1, "cpu_ms": 0.1}, ...}
+	const char *p = strstr(run.stats, "\"phases\": {");
+	if(p == NULL){
+		return;
+	}
+	p += strlen("\"phases\": {");
+	printf("%15s", "");
+	for(;;){
+		char phase_name[32];
+		double wall = 0;
+		double cpu = 0;
+		int n = 0;
+		if(sscanf(p, "\"%31[^\"]\": {\"wall_ms\": %lf, \"cpu_ms\": %lf}%n", phase_name, &wall, &cpu, &n) != 3 || n == 0){
+			break;
+		}
+		printf(" %s %.1f", phase_name, wall);
+		p += n;
+		if(strncmp(p, ", ", 2) != 0){
+			break;
+		}
+		p += 2;
+	}
+	printf(" ms\n");
+}
+
+// Generates the corpus in bench/ and times an optimized build on it.
+// `only` picks a single sheet by name.
+void bench(Cstr only){
+	bool found = only == NULL;
+	for(size_t i = 0; i < BENCH_SHEETS_COUNT; ++i){
+		found = found || strcmp(only, bench_sheets[i].name) == 0;
+	}
+	if(!found){
+		PANIC("'%s' IS UNKNOWN SHEET!", only);
+	}
+
+	if(!PATH_EXISTS("bench")){
+		MKDIRS("bench");
+	}
+	Cstr minicel = PATH("bench", "minicel");
+	CMD("gcc", CFLAGS, "-O2", "-o", minicel, "src/main.c", "-pthread");
+
+	printf("%-8s %-6s %9s %9s %10s %8s %8s\n", "sheet", "phase", "wall ms", "cpu ms", "Mcells/s", "MB/s", "RSS MB");
+	for(size_t i = 0; i < BENCH_SHEETS_COUNT; ++i){
+		const Bench_Sheet *sheet = &bench_sheets[i];
+		if(only != NULL && strcmp(only, sheet->name) != 0){
+			continue;
+		}
+		Cstr csv = PATH("bench", CONCAT(sheet->name, ".csv"));
+		Cstr cache = PATH("bench", CONCAT(sheet->name, ".cache"));
+		bench_generate(sheet, csv);
+		struct stat st;
+		if(stat(csv, &st) < 0){
+			PANIC("could not stat %s: %s", csv, strerror(errno));
+		}
+		size_t cells = sheet->rows * sheet->cols;
+		size_t bytes = (size_t) st.st_size;
+
+		Cmd eval = {.line = cstr_array_make(minicel, "--stats-json", csv, NULL)};
+		bench_report(sheet->name, "eval", cells, bytes, bench_best_of(eval));
+		Cmd stream = {.line = cstr_array_make(minicel, "--stats-json", "--stream", csv, NULL)};
+		bench_report(sheet->name, "stream", cells, bytes, bench_best_of(stream));
+		if(PATH_EXISTS(cache)){
+			RM(cache);
+		}
+		Cmd cached = {.line = cstr_array_make(minicel, "--stats-json", "--cache", cache, csv, NULL)};
+		bench_report(sheet->name, "write", cells, bytes, bench_run(cached));
+		bench_report(sheet->name, "cached", cells, bytes, bench_best_of(cached));
+		fflush(stdout);
+	}
+}
+
+// A regression sheet: `write` produces the input and the output minicel
+// has to print for it
+typedef struct {
+	const char *name;
+	void (*write)(FILE *input, FILE *expected);
+} Test_Sheet;
+
+// A large number above a long range must not cancel the small numbers in it
+void test_range_magnitudes(FILE *input, FILE *expected){
+	fprintf(input, "A\n1e17\n");
+	fprintf(expected, "A\n100000000000000000\n");
+	for(int row = 0; row < 100; ++row){
+		fprintf(input, "1\n");
+		fprintf(expected, "1\n");
+	}
+	fprintf(input, "=SUM(A2:A101)\n");
+	fprintf(expected, "100\n");
+}
+
+// Doubles whose shortest digits Grisu alone gets wrong, printed by default
+void test_shortest_digits(FILE *input, FILE *expected){
+	fprintf(input, "A\n5e22\n7e22\n1e23\n33838099952029.438\n=A1+A2\n");
+	fprintf(expected, "A\n5e+22\n7e+22\n1e+23\n33838099952029.438\n1.2e+23\n");
+}
+
+static const Test_Sheet test_sheets[] = {
+	{.name = "range_magnitudes", .write = test_range_magnitudes},
+	{.name = "shortest_digits", .write = test_shortest_digits},
+};
+
+#define TEST_SHEETS_COUNT (sizeof(test_sheets) / sizeof(test_sheets[0]))
+
+bool test_files_equal(Cstr a, Cstr b){
+	FILE *fa = fopen(a, "rb");
+	FILE *fb = fopen(b, "rb");
+	if(fa == NULL || fb == NULL){
+		PANIC("could not open %s or %s: %s", a, b, strerror(errno));
+	}
+	int ca, cb;
+	do {
+		ca = fgetc(fa);
+		cb = fgetc(fb);
+	} while(ca == cb && ca != EOF);
+	fclose(fa);
+	fclose(fb);
+	return ca == cb;
+}
+
+// Runs minicel with its output going to the file output
+void test_minicel(Cmd cmd, Cstr output){
+	Fd fd = fd_open_for_write(output);
+	pid_wait(cmd_run_async(cmd, NULL, &fd));
+	fd_close(fd);
+}
+
+// A running total down column B and prefix sums in column C. The edit
+// changes a number in the middle and appends a row. Sparse sheets keep
+// their columns C on every tenth row only and have a long header.
+void test_incremental_write(Cstr csv, bool sparse, bool edited){
+	FILE *f = fopen(csv, "wb");
+	if(f == NULL){
+		PANIC("could not write %s: %s", csv, strerror(errno));
+	}
+	if(sparse){
+		fprintf(f, "A|B|C|D|E|F|G|H|I|J|K|L|M|N|O|P|Q|R|S|T|U|V|W|X|Y|Z\n");
+	} else {
+		fprintf(f, "A|B|C\n");
+	}
+	int rows = edited ? 201 : 200;
+	for(int row = 1; row <= rows; ++row){
+		fprintf(f, "%d|", edited && row == 50 ? 1000 : row);
+		if(row == 1){
+			fprintf(f, "=A1");
+		} else {
+			fprintf(f, "=A%d+B%d", row, row - 1);
+		}
+		if(!sparse || row % 10 == 0){
+			fprintf(f, "|=SUM(A1:A%d)", row);
+		}
+		fprintf(f, "\n");
+	}
+	fclose(f);
+}
+
+// Runs --incremental on a sheet and again after editing it, the results
+// have to be the ones of a fresh run
+size_t test_incremental(Cstr threads){
+	size_t failed = 0;
+	for(int sparse = 0; sparse < 2; ++sparse){
+		Cstr name = sparse ? "incremental_sparse" : "incremental_dense";
+		Cstr csv = PATH("test", CONCAT(name, ".csv"));
+		Cstr state = PATH("test", CONCAT(name, ".state"));
+		Cstr expected = PATH("test", CONCAT(name, ".expected"));
+		Cstr output = PATH("test", CONCAT(name, ".output"));
+		if(PATH_EXISTS(state)){
+			RM(state);
+		}
+		bool ok = true;
+		for(int edited = 0; edited < 2; ++edited){
+			test_incremental_write(csv, sparse, edited);
+			test_minicel((Cmd) {.line = cstr_array_make("./minicel", "-j", threads, csv, NULL)}, expected);
+			test_minicel((Cmd) {.line = cstr_array_make("./minicel", "-j", threads, "--incremental", state, csv, NULL)}, output);
+			ok = ok && test_files_equal(output, expected);
+		}
+		printf("%-4s %s -j %s\n", ok ? "OK" : "FAIL", name, threads);
+		failed += !ok;
+	}
+	return failed;
+}
+
+// A request of the --serve test and the response it expects
+typedef struct {
+	const char *request;
+	const char *response;
+} Test_Request;
+
+// A1 feeds B1, B2 and C2, A2 feeds B2 and C2. A cycle through B2 and text
+// over A2 have to be refused without touching the table.
+static const Test_Request test_requests[] = {
+	{"get A1:C2", "1|2|hello\n2|4|3\n"},
+	{"set A1 10\nget B1:C2", "11|hello\n13|12\n"},
+	{"set A1 =B2", "ERROR: set A1 =B2: circular dependency\n"},
+	{"set A2 hello", "ERROR: set A2 hello: the cell is used by a formula and can't be text\n"},
+	{"set C1 =A1+A2\nget A1:C2", "10|11|12\n2|13|12\n"},
+	{"set C1 =A1+A2\nget C1", "12\n"},
+	{"get A9", "ERROR: get A9: invalid cell or range\n"},
+};
+
+#define TEST_REQUESTS_COUNT (sizeof(test_requests) / sizeof(test_requests[0]))
+
+void test_write_all(int fd, const void *data, size_t size){
+	const char *bytes = data;
+	while(size > 0){
+		ssize_t n = write(fd, bytes, size);
+		if(n <= 0){
+			PANIC("could not write to the minicel socket: %s", strerror(errno));
+		}
+		bytes += n;
+		size -= (size_t) n;
+	}
+}
+
+void test_read_all(int fd, void *data, size_t size){
+	char *bytes = data;
+	while(size > 0){
+		ssize_t n = read(fd, bytes, size);
+		if(n <= 0){
+			PANIC("could not read from the minicel socket: %s", n < 0 ? strerror(errno) : "closed");
+		}
+		bytes += n;
+		size -= (size_t) n;
+	}
+}
+
+// Starts minicel --serve on a sheet and replays test_requests through a
+// client speaking the framed protocol: a 4 byte big-endian length and the
+// payload both ways. All the requests go out in a single write, so the
+// server has to split them by their lengths.
+size_t test_serve(Cstr threads){
+	Cstr csv = PATH("test", "serve.csv");
+	Cstr socket_path = PATH("test", "serve.sock");
+	FILE *f = fopen(csv, "wb");
+	if(f == NULL){
+		PANIC("could not write %s: %s", csv, strerror(errno));
+	}
+	fprintf(f, "A|B|C\n1|=A1+1|hello\n2|=B1+A2|=SUM(A1:A2)\n");
+	fclose(f);
+	if(PATH_EXISTS(socket_path)){
+		RM(socket_path);
+	}
+
+	Cmd cmd = {.line = cstr_array_make("./minicel", "-j", threads, "--serve", socket_path, csv, NULL)};
+	Pid pid = cmd_run_async(cmd, NULL, NULL);
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	int fd = -1;
+	for(int attempt = 0; fd < 0 && attempt < 500; ++attempt){
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd < 0){
+			PANIC("could not create a socket: %s", strerror(errno));
+		}
+		if(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0){
+			close(fd);
+			fd = -1;
+			nanosleep(&(struct timespec) {.tv_nsec = 10 * 1000 * 1000}, NULL);
+		}
+	}
+	if(fd < 0){
+		PANIC("could not connect to %s", socket_path);
+	}
+
+	size_t frames_size = 0;
+	for(size_t i = 0; i < TEST_REQUESTS_COUNT; ++i){
+		frames_size += sizeof(uint32_t) + strlen(test_requests[i].request);
+	}
+	char *frames = malloc(frames_size);
+	assert(frames != NULL);
+	char *frame = frames;
+	for(size_t i = 0; i < TEST_REQUESTS_COUNT; ++i){
+		size_t size = strlen(test_requests[i].request);
+		uint32_t header = htonl((uint32_t) size);
+		memcpy(frame, &header, sizeof(header));
+		memcpy(frame + sizeof(header), test_requests[i].request, size);
+		frame += sizeof(header) + size;
+	}
+	test_write_all(fd, frames, frames_size);
+	free(frames);
+
+	bool ok = true;
+	for(size_t i = 0; i < TEST_REQUESTS_COUNT; ++i){
+		uint32_t size = 0;
+		test_read_all(fd, &size, sizeof(size));
+		size = ntohl(size);
+		char *response = malloc(size + 1);
+		assert(response != NULL);
+		test_read_all(fd, response, size);
+		response[size] = '\0';
+		if(strcmp(response, test_requests[i].response) != 0){
+			fprintf(stderr, "%s: expected %s, got %s", test_requests[i].request, test_requests[i].response, response);
+			ok = false;
+		}
+		free(response);
+	}
+	close(fd);
+	kill(pid, SIGTERM);
+	pid_wait(pid);
+
+	printf("%-4s serve -j %s\n", ok ? "OK" : "FAIL", threads);
+	return !ok;
+}
+
+// An edit of the --watch test: the new content of the sheet, whether it
+// is saved by renaming a new file over the sheet, and the table printed
+// after it
+typedef struct {
+	const char *content;
+	bool rename;
+	const char *table;
+} Test_Edit;
+
+// A refused cell, a new row and a reload that does not parse, each one
+// followed by an edit that has to go through
+static const Test_Edit test_edits[] = {
+	{"A|B\n1|=A1+1\n2|=B1+A2\n", false, "A|B\n1|2\n2|4\n"},
+	{"A|B\n5|=A1+1\n2|=B1+A2\n", false, "A|B\n5|6\n2|8\n"},
+	{"A|B\n=B2|=A1+1\n2|=B1+A2\n", true, "A|B\n5|6\n2|8\n"},
+	{"A|B\n7|=A1+1\n2|=B1+A2\n", true, "A|B\n7|8\n2|10\n"},
+	{"A|B\n7|=A1+1\n2|=B1+A2\n3|=B2+A3\n", false, "A|B\n7|8\n2|10\n3|13\n"},
+	{"A|B\n7|=A1+1\n2|=B1+A2\n3|=B2+A3\n4|=A1+\n", false, "A|B\n7|8\n2|10\n3|13\n"},
+	{"A|B\n7|=A1+1\n2|=B1+A2\n3|=A3\n4|=A1+A4\n", true, "A|B\n7|8\n2|10\n3|3\n4|11\n"},
+};
+
+#define TEST_EDITS_COUNT (sizeof(test_edits) / sizeof(test_edits[0]))
+
+void test_write_file(Cstr path, const char *content){
+	FILE *f = fopen(path, "wb");
+	if(f == NULL){
+		PANIC("could not write %s: %s", path, strerror(errno));
+	}
+	fputs(content, f);
+	fclose(f);
+}
+
+// Returns the content of the file as a NUL terminated string
+char *test_read_file(Cstr path){
+	FILE *f = fopen(path, "rb");
+	if(f == NULL){
+		PANIC("could not read %s: %s", path, strerror(errno));
+	}
+	size_t count = 0;
+	size_t capacity = 256;
+	char *content = malloc(capacity);
+	assert(content != NULL);
+	size_t n;
+	while((n = fread(content + count, 1, capacity - count - 1, f)) > 0){
+		count += n;
+		if(capacity - count == 1){
+			capacity *= 2;
+			content = realloc(content, capacity);
+			assert(content != NULL);
+		}
+	}
+	fclose(f);
+	content[count] = '\0';
+	return content;
+}
+
+// Starts minicel --watch and saves the edits over its sheet one by one,
+// waiting for the table printed after each of them. The watch is only set
+// up once the first table is out, so an edit nothing answers to is saved
+// again.
+size_t test_watch(Cstr threads){
+	Cstr csv = PATH("test", "watch.csv");
+	Cstr renamed = PATH("test", "watch.csv.new");
+	Cstr output = PATH("test", "watch.output");
+	Cstr errors = PATH("test", "watch.errors");
+	test_write_file(csv, test_edits[0].content);
+
+	// the refused edits are reported on stderr
+	Cmd cmd = {.line = cstr_array_make("./minicel", "-j", threads, "--watch", csv, NULL)};
+	Fd out = fd_open_for_write(output);
+	Fd err = fd_open_for_write(errors);
+	int saved_stderr = dup(STDERR_FILENO);
+	dup2(err, STDERR_FILENO);
+	Pid pid = cmd_run_async(cmd, NULL, &out);
+	dup2(saved_stderr, STDERR_FILENO);
+	close(saved_stderr);
+	fd_close(out);
+	fd_close(err);
+
+	bool ok = true;
+	size_t expected_size = 0;
+	for(size_t i = 0; ok && i < TEST_EDITS_COUNT; ++i){
+		const Test_Edit *edit = &test_edits[i];
+		expected_size += strlen(edit->table);
+		char *printed = NULL;
+		for(int attempt = 0; attempt < 500; ++attempt){
+			if(i > 0 && attempt % 50 == 0){
+				test_write_file(edit->rename ? renamed : csv, edit->content);
+				if(edit->rename && rename(renamed, csv) < 0){
+					PANIC("could not rename %s to %s: %s", renamed, csv, strerror(errno));
+				}
+			}
+			nanosleep(&(struct timespec) {.tv_nsec = 10 * 1000 * 1000}, NULL);
+			free(printed);
+			printed = test_read_file(output);
+			if(strlen(printed) >= expected_size){
+				break;
+			}
+		}
+		size_t size = strlen(printed);
+		ok = size == expected_size && strcmp(printed + size - strlen(edit->table), edit->table) == 0;
+		if(!ok){
+			fprintf(stderr, "edit %zu: expected the table\n%sgot\n%s", i, edit->table, printed);
+		}
+		free(printed);
+	}
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	char *reported = test_read_file(errors);
+	if(ok && (strstr(reported, "ERROR: A1: circular dependency\n") == NULL ||
+			  strstr(reported, "ERROR: B4: invalid formula\n") == NULL)){
+		fprintf(stderr, "the refused edits were not reported:\n%s", reported);
+		ok = false;
+	}
+	free(reported);
+
+	printf("%-4s watch -j %s\n", ok ? "OK" : "FAIL", threads);
+	return !ok;
+}
+
+// Writes the regression sheets to test/ and checks the output of minicel
+// on every one of them, on one and on several threads
+void test(void){
+	if(!PATH_EXISTS("test")){
+		MKDIRS("test");
+	}
+	size_t failed = 0;
+	Cstr threads[] = {"1", "4"};
+	for(size_t i = 0; i < TEST_SHEETS_COUNT; ++i){
+		const Test_Sheet *sheet = &test_sheets[i];
+		Cstr csv = PATH("test", CONCAT(sheet->name, ".csv"));
+		Cstr expected = PATH("test", CONCAT(sheet->name, ".expected"));
+		Cstr output = PATH("test", CONCAT(sheet->name, ".output"));
+		FILE *input_file = fopen(csv, "wb");
+		FILE *expected_file = fopen(expected, "wb");
+		if(input_file == NULL || expected_file == NULL){
+			PANIC("could not write %s or %s: %s", csv, expected, strerror(errno));
+		}
+		sheet->write(input_file, expected_file);
+		fclose(input_file);
+		fclose(expected_file);
+
+		for(size_t j = 0; j < sizeof(threads) / sizeof(threads[0]); ++j){
+			Cmd cmd = {.line = cstr_array_make("./minicel", "-j", threads[j], csv, NULL)};
+			test_minicel(cmd, output);
+			bool ok = test_files_equal(output, expected);
+			printf("%-4s %s -j %s\n", ok ? "OK" : "FAIL", sheet->name, threads[j]);
+			failed += !ok;
+		}
+	}
+	for(size_t j = 0; j < sizeof(threads) / sizeof(threads[0]); ++j){
+		failed += test_incremental(threads[j]);
+		failed += test_serve(threads[j]);
+		failed += test_watch(threads[j]);
+	}
+	if(failed > 0){
+		PANIC("%zu TESTS FAILED!", failed);
+	}
+}
+#endif // _WIN32
+
 int main(int argc, char **argv){
 	GO_REBUILD_URSELF(argc, argv);
 	//CMD("clang", CFLAGS,"-fsanitize=memory", "-o", "minicel", "src/main.c");
-	CMD("gcc", CFLAGS, "-o", "minicel", "src/main.c");
+	CMD("gcc", CFLAGS, "-o", "minicel", "src/main.c", "-pthread");
 		if(argc > 1){
 			if(strcmp(argv[1], "run") == 0){
 				CMD("./minicel", argv[2]);
 			} else if(strcmp(argv[1], "gdb") == 0){
 				CMD("gdb", "./minicel");
+			} else if(strcmp(argv[1], "usdt") == 0){
+				CMD("gcc", CFLAGS, "-DMINICEL_USDT", "-o", "minicel", "src/main.c", "-pthread");
+#ifndef _WIN32
+			} else if(strcmp(argv[1], "bench") == 0){
+				bench(argc > 2 ? argv[2] : NULL);
+			} else if(strcmp(argv[1], "test") == 0){
+				test();
+#endif
 			}else {
 				PANIC("'%s' IS UNKNOWN SUBCOMMAND!", argv[1]);
 			}
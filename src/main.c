@@ -1,18 +1,62 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <signal.h>
 
 #define SV_IMPLEMENTATION
 #include "../sv.h"
 
+#define DA_INIT_CAPACITY 128
+
+// Appends an item to a dynamic array: any struct with `items`, `count`
+// and `capacity` fields
+#define da_append(da, item)                                                          \
+	do {                                                                             \
+		if((da)->count >= (da)->capacity){                                           \
+			(da)->capacity = (da)->capacity == 0 ? DA_INIT_CAPACITY : (da)->capacity * 2; \
+			(da)->items = realloc((da)->items, (da)->capacity * sizeof(*(da)->items)); \
+			assert((da)->items != NULL && "Buy more RAM lol");                      \
+		}                                                                            \
+		(da)->items[(da)->count++] = (item);                                         \
+	} while(0)
+
 typedef enum {
 	EXPR_KIND_NUMBER = 0,
 	EXPR_KIND_CELL,
 	EXPR_KIND_PLUS,
+	EXPR_KIND_SUM,
+	EXPR_KIND_RANGE,
+	EXPR_KIND_AGGREGATE,
 } Expr_Kind;
 
+typedef enum {
+	AGGREGATE_SUM = 0,
+	AGGREGATE_AVG,
+	AGGREGATE_MIN,
+	AGGREGATE_MAX,
+	AGGREGATE_COUNT,
+	COUNT_AGGREGATES,
+} Aggregate_Fn;
+
 typedef struct Expr Expr;
 typedef size_t Expr_Index;
 
@@ -26,10 +70,31 @@ typedef struct {
 	size_t row;
 } Expr_Cell;
 
+// n-ary `+`, the operands are Expr_Buffer.operands[begin..begin + count]
+typedef struct {
+	size_t begin;
+	size_t count;
+} Expr_Sum;
+
+// Rectangle of cells between two CELL nodes, first is the top left corner
+typedef struct {
+	Expr_Index first;
+	Expr_Index last;
+} Expr_Range;
+
+// SUM(A1:B10) and friends over a RANGE node
+typedef struct {
+	Aggregate_Fn fn;
+	Expr_Index range;
+} Expr_Aggregate;
+
 typedef union {
 	double number;
 	Expr_Cell cell;
 	Expr_Plus plus;
+	Expr_Sum sum;
+	Expr_Range range;
+	Expr_Aggregate aggregate;
 } Expr_As;
 
 struct Expr {
@@ -38,33 +103,476 @@ struct Expr {
 };
 
 typedef struct {
+	Expr_Index *items;
 	size_t count;
 	size_t capacity;
-	Expr *items;
-} Expr_Buffer;
+} Expr_Indices;
 
-Expr_Index expr_buffer_alloc(Expr_Buffer *eb){
-	if(eb->count >= eb->capacity){
-		if(eb->capacity == 0){
-			assert(eb->items == NULL);
-			eb->capacity = 128;
+typedef struct {
+	Expr_Cell *items;
+	size_t count;
+	size_t capacity;
+} Expr_Cells;
+
+// An aggregate with its range resolved to cells, for places that don't
+// want to chase the nodes: expr_optimize and the compiled code
+typedef struct {
+	Aggregate_Fn fn;
+	Expr_Cell first;
+	Expr_Cell last;
+} Aggregate_Ref;
+
+typedef struct {
+	Aggregate_Ref *items;
+	size_t count;
+	size_t capacity;
+} Aggregate_Refs;
+
+uint64_t monotonic_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+// Spans recorded by --trace and written out as a Chrome Trace Event file.
+// Every thread gets its own track, numbered in the order the threads
+// first record a span, the thread that starts the trace is 1.
+typedef struct {
+	const char *name;
+	// NULL if the span has no argument
+	const char *arg_name;
+	size_t arg;
+	uint64_t begin;
+	uint64_t end;
+	uint32_t tid;
+} Trace_Event;
+
+typedef struct {
+	Trace_Event *items;
+	size_t count;
+	size_t capacity;
+} Trace_Events;
+
+static bool trace_enabled = false;
+static uint64_t trace_origin = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Trace_Events trace_events = {0};
+static atomic_uint trace_next_tid = 0;
+static _Thread_local uint32_t trace_tid = 0;
+
+void trace_start(void){
+	trace_enabled = true;
+	trace_origin = monotonic_ns();
+	trace_tid = 1;
+	atomic_store(&trace_next_tid, 1);
+}
+
+// Zero when not tracing, so spans cost a branch unless --trace
+static inline uint64_t trace_begin(void){
+	return trace_enabled ? monotonic_ns() : 0;
+}
+
+void trace_end(const char *name, uint64_t begin, const char *arg_name, size_t arg){
+	if(!trace_enabled){
+		return;
+	}
+	if(trace_tid == 0){
+		trace_tid = atomic_fetch_add(&trace_next_tid, 1) + 1;
+	}
+	Trace_Event event = {
+		.name = name,
+		.arg_name = arg_name,
+		.arg = arg,
+		.begin = begin,
+		.end = monotonic_ns(),
+		.tid = trace_tid,
+	};
+	pthread_mutex_lock(&trace_mutex);
+	da_append(&trace_events, event);
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+void trace_save(const char *file_path){
+	FILE *f = fopen(file_path, "wb");
+	if(f == NULL){
+		fprintf(stderr, "ERROR: could not write file %s: %s\n", file_path, strerror(errno));
+		exit(1);
+	}
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	unsigned tids = atomic_load(&trace_next_tid);
+	for(unsigned tid = 1; tid <= tids; ++tid){
+		fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s %u\"}},\n",
+				tid, tid == 1 ? "main" : "worker", tid);
+	}
+	for(size_t i = 0; i < trace_events.count; ++i){
+		const Trace_Event *event = &trace_events.items[i];
+		fprintf(f, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f",
+				event->name, event->tid, (double) (event->begin - trace_origin) * 1e-3, (double) (event->end - event->begin) * 1e-3);
+		if(event->arg_name != NULL){
+			fprintf(f, ", \"args\": {\"%s\": %zu}", event->arg_name, event->arg);
+		}
+		fprintf(f, "}%s\n", i + 1 < trace_events.count ? "," : "");
+	}
+	fprintf(f, "]}\n");
+	if(fclose(f) != 0){
+		fprintf(stderr, "ERROR: could not write file %s: %s\n", file_path, strerror(errno));
+		exit(1);
+	}
+	free(trace_events.items);
+	memset(&trace_events, 0, sizeof(trace_events));
+}
+
+// Static probes for perf and bpftrace, only built in with -DMINICEL_USDT
+// since they need <sys/sdt.h> from systemtap
+#ifdef MINICEL_USDT
+#include <sys/sdt.h>
+#define MINICEL_PROBE1(name, a) DTRACE_PROBE1(minicel, name, a)
+#define MINICEL_PROBE2(name, a, b) DTRACE_PROBE2(minicel, name, a, b)
+#else
+#define MINICEL_PROBE1(name, a)
+#define MINICEL_PROBE2(name, a, b)
+#endif
+
+// Counters of an allocator, see --alloc-stats
+typedef struct {
+	size_t chunks;
+	size_t bytes_used;
+	size_t bytes_reserved;
+} Alloc_Stats;
+
+// Bump allocator for data that lives until the end of the program. The
+// chunks are never moved or reallocated, teardown is one free per chunk.
+#define ARENA_CHUNK_CAPACITY (64 * 1024)
+
+typedef struct Arena_Chunk Arena_Chunk;
+
+struct Arena_Chunk {
+	Arena_Chunk *next;
+	size_t count;
+	size_t capacity;
+	char data[];
+};
+
+typedef struct {
+	Arena_Chunk *first;
+	Arena_Chunk *last;
+	Alloc_Stats stats;
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size){
+	size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	if(arena->last == NULL || arena->last->count + size > arena->last->capacity){
+		size_t capacity = size > ARENA_CHUNK_CAPACITY ? size : ARENA_CHUNK_CAPACITY;
+		Arena_Chunk *chunk = malloc(sizeof(Arena_Chunk) + capacity);
+		if(chunk == NULL){
+			fprintf(stderr, "ERROR: could not allocate memory for the arena\n");
+			exit(1);
+		}
+		chunk->next = NULL;
+		chunk->count = 0;
+		chunk->capacity = capacity;
+		if(arena->last == NULL){
+			arena->first = chunk;
 		} else {
-			eb->capacity *= 2;
+			arena->last->next = chunk;
 		}
-		eb->items = realloc(eb->items, sizeof(Expr) * eb->capacity);
+		arena->last = chunk;
+		arena->stats.chunks += 1;
+		arena->stats.bytes_reserved += capacity;
+	}
+	void *result = arena->last->data + arena->last->count;
+	arena->last->count += size;
+	arena->stats.bytes_used += size;
+	return result;
+}
+
+void arena_free(Arena *arena){
+	Arena_Chunk *chunk = arena->first;
+	while(chunk != NULL){
+		Arena_Chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	memset(arena, 0, sizeof(*arena));
+}
+
+// Expression nodes are allocated in fixed size chunks that never move,
+// so growing the buffer never copies the nodes allocated so far and the
+// pointers returned by expr_buffer_at stay valid
+#define EXPR_CHUNK_BITS 12
+#define EXPR_CHUNK_CAPACITY ((size_t) 1 << EXPR_CHUNK_BITS)
+#define EXPR_CHUNK_MASK (EXPR_CHUNK_CAPACITY - 1)
+
+// Slot of the table of formulas. The low half of the hash is kept next
+// to the index so probing and growing don't have to look at the nodes
+// themselves, and the slot stays as small as a plain index.
+typedef struct {
+	// Expr_Index + 1, zero marks an empty slot
+	uint32_t index;
+	uint32_t hash;
+} Expr_Interned;
+
+typedef struct {
+	size_t count;
+	Expr **chunks;
+	size_t chunks_count;
+	size_t chunks_capacity;
+	Expr_Indices operands;
+	// Roots of the formulas made by expr_optimize, open addressing
+	Expr_Interned *interned;
+	size_t interned_count;
+	size_t interned_capacity;
+	// When few of the first lookups find a formula, the sheet hardly
+	// repeats any and the lookups cost more than they save
+	size_t intern_lookups;
+	size_t intern_hits;
+	bool intern_off;
+	// scratch space of expr_optimize
+	Expr_Indices stack;
+	Expr_Cells cells;
+	Aggregate_Refs aggregates;
+	Expr_Indices leaves;
+} Expr_Buffer;
+
+void expr_buffer_free(Expr_Buffer *eb){
+	for(size_t i = 0; i < eb->chunks_count; ++i){
+		free(eb->chunks[i]);
+	}
+	free(eb->chunks);
+	free(eb->operands.items);
+	free(eb->interned);
+	free(eb->stack.items);
+	free(eb->cells.items);
+	free(eb->aggregates.items);
+	free(eb->leaves.items);
+	memset(eb, 0, sizeof(*eb));
+}
+
+void expr_buffer_add_chunk(Expr_Buffer *eb){
+	if(eb->chunks_count >= eb->chunks_capacity){
+		eb->chunks_capacity = eb->chunks_capacity == 0 ? 16 : eb->chunks_capacity * 2;
+		eb->chunks = realloc(eb->chunks, sizeof(Expr*) * eb->chunks_capacity);
+		assert(eb->chunks != NULL && "Buy more RAM lol");
+	}
+	Expr *chunk = malloc(sizeof(Expr) * EXPR_CHUNK_CAPACITY);
+	if(chunk == NULL){
+		fprintf(stderr, "ERROR: could not allocate memory for the expressions\n");
+		exit(1);
+	}
+	eb->chunks[eb->chunks_count++] = chunk;
+}
+
+// Makes the buffer exactly count nodes long, allocating the missing
+// chunks. The new nodes are left uninitialized.
+void expr_buffer_resize(Expr_Buffer *eb, size_t count){
+	while(eb->chunks_count * EXPR_CHUNK_CAPACITY < count){
+		expr_buffer_add_chunk(eb);
+	}
+	eb->count = count;
+}
+
+Expr_Index expr_buffer_alloc(Expr_Buffer *eb){
+	if(eb->count >= eb->chunks_count * EXPR_CHUNK_CAPACITY){
+		expr_buffer_add_chunk(eb);
 	}
 	return eb->count++;
 }
 
-Expr *expr_buffer_at(Expr_Buffer *eb, Expr_Index index){
+static inline Expr *expr_buffer_at(const Expr_Buffer *eb, Expr_Index index){
 	assert(index < eb->count);
-	return &eb->items[index];
+	return &eb->chunks[index >> EXPR_CHUNK_BITS][index & EXPR_CHUNK_MASK];
+}
+
+Alloc_Stats expr_buffer_stats(const Expr_Buffer *eb){
+	Alloc_Stats stats = {0};
+	stats.chunks = eb->chunks_count;
+	stats.bytes_used = sizeof(Expr) * eb->count;
+	stats.bytes_reserved = sizeof(Expr) * EXPR_CHUNK_CAPACITY * eb->chunks_count;
+	return stats;
+}
+
+// Lookups sampled before expr_optimize decides whether to keep interning,
+// and the hits out of every EXPR_INTERN_SAMPLE it wants for that
+#define EXPR_INTERN_SAMPLE 4096
+#define EXPR_INTERN_MIN_HITS (EXPR_INTERN_SAMPLE / 16)
+
+#define EXPR_HASH_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define EXPR_HASH_MULTIPLIER 0x9e3779b97f4a7c15ULL
+
+// A word at a time, the table is indexed by the low bits so the high
+// bits of the product are folded back into them
+uint64_t expr_hash_mix(uint64_t hash, uint64_t value){
+	hash = (hash ^ value) * EXPR_HASH_MULTIPLIER;
+	return hash ^ (hash >> 32);
+}
+
+// Formulas are hashed leaf by leaf, in the order expr_optimize puts them
+uint64_t expr_hash_number(uint64_t hash, double number){
+	uint64_t bits;
+	memcpy(&bits, &number, sizeof(bits));
+	return expr_hash_mix(expr_hash_mix(hash, EXPR_KIND_NUMBER), bits);
+}
+
+uint64_t expr_hash_cell(uint64_t hash, Expr_Cell cell){
+	return expr_hash_mix(expr_hash_mix(expr_hash_mix(hash, EXPR_KIND_CELL), cell.col), cell.row);
+}
+
+uint64_t expr_hash_aggregate(uint64_t hash, const Aggregate_Ref *ref){
+	hash = expr_hash_mix(expr_hash_mix(hash, EXPR_KIND_AGGREGATE), ref->fn);
+	hash = expr_hash_mix(expr_hash_mix(hash, ref->first.col), ref->first.row);
+	return expr_hash_mix(expr_hash_mix(hash, ref->last.col), ref->last.row);
+}
+
+Aggregate_Ref expr_aggregate_ref(const Expr_Buffer *eb, const Expr *expr){
+	assert(expr->kind == EXPR_KIND_AGGREGATE);
+	const Expr *range = expr_buffer_at(eb, expr->as.aggregate.range);
+	Aggregate_Ref ref = {0};
+	ref.fn = expr->as.aggregate.fn;
+	ref.first = expr_buffer_at(eb, range->as.range.first)->as.cell;
+	ref.last = expr_buffer_at(eb, range->as.range.last)->as.cell;
+	return ref;
+}
+
+bool aggregate_ref_eq(const Aggregate_Ref *a, const Aggregate_Ref *b){
+	return a->fn == b->fn &&
+		a->first.col == b->first.col && a->first.row == b->first.row &&
+		a->last.col == b->last.col && a->last.row == b->last.row;
+}
+
+// The leaves of a formula made by expr_optimize: the operands of its SUM
+// or the root itself
+const Expr_Index *expr_formula_leaves(const Expr_Buffer *eb, const Expr_Index *root, size_t *count){
+	const Expr *expr = expr_buffer_at(eb, *root);
+	if(expr->kind == EXPR_KIND_SUM){
+		*count = expr->as.sum.count;
+		return &eb->operands.items[expr->as.sum.begin];
+	}
+	*count = 1;
+	return root;
+}
+
+uint64_t expr_formula_hash(const Expr_Buffer *eb, Expr_Index root){
+	size_t count = 0;
+	const Expr_Index *leaves = expr_formula_leaves(eb, &root, &count);
+	uint64_t hash = EXPR_HASH_OFFSET_BASIS;
+	for(size_t i = 0; i < count; ++i){
+		const Expr *leaf = expr_buffer_at(eb, leaves[i]);
+		switch(leaf->kind){
+		case EXPR_KIND_NUMBER:
+			hash = expr_hash_number(hash, leaf->as.number);
+			break;
+		case EXPR_KIND_CELL:
+			hash = expr_hash_cell(hash, leaf->as.cell);
+			break;
+		case EXPR_KIND_AGGREGATE: {
+			Aggregate_Ref ref = expr_aggregate_ref(eb, leaf);
+			hash = expr_hash_aggregate(hash, &ref);
+			break;
+		}
+		case EXPR_KIND_PLUS:
+		case EXPR_KIND_SUM:
+		case EXPR_KIND_RANGE:
+			assert(0 && "unreachable: not a leaf of an optimized formula");
+			break;
+		}
+	}
+	return hash;
+}
+
+bool expr_leaf_eq(const Expr_Buffer *eb, const Expr *a, const Expr *b){
+	if(a->kind != b->kind){
+		return false;
+	}
+	switch(a->kind){
+	case EXPR_KIND_NUMBER:
+		return memcmp(&a->as.number, &b->as.number, sizeof(double)) == 0;
+	case EXPR_KIND_CELL:
+		return a->as.cell.col == b->as.cell.col && a->as.cell.row == b->as.cell.row;
+	case EXPR_KIND_AGGREGATE: {
+		Aggregate_Ref x = expr_aggregate_ref(eb, a);
+		Aggregate_Ref y = expr_aggregate_ref(eb, b);
+		return aggregate_ref_eq(&x, &y);
+	}
+	case EXPR_KIND_PLUS:
+	case EXPR_KIND_SUM:
+	case EXPR_KIND_RANGE:
+		break;
+	}
+	return false;
 }
 
-void expr_buffer_dump(FILE *stream, const Expr_Buffer *eb, Expr_Index root){
-	fwrite(&root, sizeof(root), 1, stream);
-	fwrite(&eb->count, sizeof(eb->count), 1, stream);
-	fwrite(eb->items, sizeof(Expr), eb->count,stream);
+// Whether two formulas made by expr_optimize say the same
+bool expr_formula_eq(const Expr_Buffer *eb, Expr_Index a, Expr_Index b){
+	if(a == b){
+		return true;
+	}
+	size_t a_count = 0;
+	size_t b_count = 0;
+	const Expr_Index *a_leaves = expr_formula_leaves(eb, &a, &a_count);
+	const Expr_Index *b_leaves = expr_formula_leaves(eb, &b, &b_count);
+	if(a_count != b_count){
+		return false;
+	}
+	for(size_t i = 0; i < a_count; ++i){
+		if(!expr_leaf_eq(eb, expr_buffer_at(eb, a_leaves[i]), expr_buffer_at(eb, b_leaves[i]))){
+			return false;
+		}
+	}
+	return true;
+}
+
+void expr_buffer_intern_insert(Expr_Buffer *eb, uint32_t hash, Expr_Index index){
+	size_t mask = eb->interned_capacity - 1;
+	size_t slot = hash & mask;
+	while(eb->interned[slot].index != 0){
+		slot = (slot + 1) & mask;
+	}
+	eb->interned[slot].index = (uint32_t) (index + 1);
+	eb->interned[slot].hash = hash;
+	eb->interned_count += 1;
+}
+
+void expr_buffer_intern_grow(Expr_Buffer *eb){
+	Expr_Interned *old = eb->interned;
+	size_t old_capacity = eb->interned_capacity;
+	eb->interned_capacity = old_capacity == 0 ? 1024 : old_capacity * 2;
+	eb->interned = calloc(eb->interned_capacity, sizeof(Expr_Interned));
+	assert(eb->interned != NULL && "Buy more RAM lol");
+	eb->interned_count = 0;
+	for(size_t i = 0; i < old_capacity; ++i){
+		if(old[i].index != 0){
+			expr_buffer_intern_insert(eb, old[i].hash, old[i].index - 1);
+		}
+	}
+	free(old);
+}
+
+// Returns a formula equal to the one at root that is in the table
+// already, or adds root to it
+Expr_Index expr_buffer_intern_formula(Expr_Buffer *eb, Expr_Index root){
+	if((eb->interned_count + 1) * 2 > eb->interned_capacity){
+		expr_buffer_intern_grow(eb);
+	}
+	uint32_t hash = (uint32_t) expr_formula_hash(eb, root);
+	size_t mask = eb->interned_capacity - 1;
+	for(size_t slot = hash & mask; eb->interned[slot].index != 0; slot = (slot + 1) & mask){
+		Expr_Index candidate = eb->interned[slot].index - 1;
+		if(eb->interned[slot].hash == hash && expr_formula_eq(eb, candidate, root)){
+			return candidate;
+		}
+	}
+	expr_buffer_intern_insert(eb, hash, root);
+	return root;
+}
+
+Expr_Index expr_buffer_push(Expr_Buffer *eb, Expr expr){
+	Expr_Index index = expr_buffer_alloc(eb);
+	if(index >= UINT32_MAX){
+		fprintf(stderr, "ERROR: too many expressions\n");
+		exit(1);
+	}
+	*expr_buffer_at(eb, index) = expr;
+	return index;
 }
 
 typedef enum {
@@ -96,25 +604,100 @@ typedef enum {
 
 typedef struct {
 	Expr_Index index;
-	Eval_Status status;
-	double value;
+	// Offset of the compiled expression in the Code_Buffer
+	size_t code;
 } Cell_Expr;
 
-typedef union {
-	String_View text;
-	double number;
-	Cell_Expr expr;
-} Cell_As;
+typedef struct {
+	Cell_Expr *items;
+	size_t count;
+	size_t capacity;
+} Cell_Exprs;
+
+// Position of a text cell relative to Table.text_base, so the texts of a
+// table can be moved around with a single pointer
+typedef struct {
+	size_t offset;
+	size_t count;
+} Cell_Text;
+
+typedef struct {
+	Cell_Text *items;
+	size_t count;
+	size_t capacity;
+} Cell_Texts;
+
+typedef struct {
+	size_t *items;
+	size_t count;
+	size_t capacity;
+} Row_Offsets;
+
+#define STATUS_WORD_BITS 64
+
+// Rows of a column summarized by one leaf of its block tree
+#define COLUMN_BLOCK_ROWS 32
+
+typedef struct {
+	double sum;
+	size_t count;
+	double min;
+	double max;
+} Aggregate_Acc;
 
+// What the aggregates know about a column, built lazily and only for the
+// columns some long range looks at. It covers the rows [0, done) and
+// grows down the column as long as the cells are final: numbers, text
+// and EVALUATED expressions.
+//
+// Every block of COLUMN_BLOCK_ROWS rows is a leaf of a binary tree whose
+// nodes summarize the numbers below them: nodes[1] is the root and the
+// leaf of block b is nodes[leaves + b]. A range only combines the nodes
+// inside of it, nothing is ever subtracted, so large values outside of
+// the range can't cancel the ones in it.
 typedef struct {
-	Cell_Kind kind;
-	Cell_As as;
-} Cell;
+	size_t done;
+	size_t leaves;
+	Aggregate_Acc *nodes;
+} Column_Index;
 
+// The table is stored as a struct of arrays indexed by the slot of a
+// cell, see table_slot. Every cell costs a kind byte, a double holding
+// the number or the evaluated value of an expression and a reference
+// into the side arrays of its kind, plus two bits of evaluation status.
+//
+// Dense tables keep all rows * cols cells and the slot of a cell is
+// row * cols + col. Sparse tables only keep the cells that are present
+// in the input, row by row: the cells of row r are the slots
+// row_offsets[r]..row_offsets[r + 1] and the missing cells past the end
+// of a row all share empty_slot, an empty text cell. Tables are loaded
+// sparse and table_finish picks the final layout from the density.
 typedef struct {
-	Cell *cells;
+	uint8_t *kinds;
+	double *values;
+	// Index into exprs for expressions and into texts + 1 for text, so
+	// the zeroed slots of missing cells are empty text
+	uint32_t *refs;
+	// Bitsets of the INPROGRESS and EVALUATED cells. Atomic because cells
+	// sharing a word may be evaluated by different threads.
+	_Atomic uint64_t *in_progress;
+	_Atomic uint64_t *evaluated;
+	Cell_Exprs exprs;
+	Cell_Texts texts;
+	const char *text_base;
 	size_t rows;
 	size_t cols;
+	// Row of the input stored as the first row of the table. Only the
+	// windows of --stream start further down, references and the rows
+	// of the evaluator are always rows of the input.
+	size_t row_base;
+	// empty for dense tables
+	Row_Offsets row_offsets;
+	size_t empty_slot;
+	size_t slots_count;
+	size_t slots_capacity;
+	// one per column, NULL until some aggregate needs them
+	Column_Index *columns;
 } Table;
 
 bool is_name(char c){
@@ -128,7 +711,8 @@ String_View next_token(String_View *source){
 		return SV_NULL;
 	}
 	
-	if(*source->data == '+'){
+	char c = *source->data;
+	if(c == '+' || c == '(' || c == ')' || c == ':'){
 		return sv_chop_left(source, 1);
 	}
 
@@ -140,418 +724,6109 @@ String_View next_token(String_View *source){
 	exit(1);
 }
 
-bool sv_strtod(String_View source ,double *out){
-	static char temp_buffer[1024 * 4];
-	assert(source.count < sizeof(temp_buffer));
-	snprintf(temp_buffer,sizeof(temp_buffer), SV_Fmt, SV_Arg(source));
+// Copies source into a NUL-terminated buffer and hands it to the libc
+// parser. Only used for the inputs the fast paths below don't handle.
+#define STRTO_STACK_BUFFER_CAPACITY 256
+
+double sv_strtod_slow(String_View source, bool *ok){
+	char stack_buffer[STRTO_STACK_BUFFER_CAPACITY];
+	char *buffer = stack_buffer;
+	if(source.count >= sizeof(stack_buffer)){
+		buffer = malloc(source.count + 1);
+		assert(buffer != NULL);
+	}
+	memcpy(buffer, source.data, source.count);
+	buffer[source.count] = '\0';
+
 	char *endptr = NULL;
-	double result = strtod(temp_buffer, &endptr);
-	if(out) *out =result;
-	return (endptr != temp_buffer && *endptr == '\0');
+	double result = strtod(buffer, &endptr);
+	*ok = endptr != buffer && *endptr == '\0';
+
+	if(buffer != stack_buffer){
+		free(buffer);
+	}
+	return result;
 }
 
-bool sv_strtol(String_View source ,long int *out){
-	static char temp_buffer[1024 * 4];
-	assert(source.count < sizeof(temp_buffer));
-	snprintf(temp_buffer,sizeof(temp_buffer), SV_Fmt, SV_Arg(source));
+long int sv_strtol_slow(String_View source, bool *ok){
+	char stack_buffer[STRTO_STACK_BUFFER_CAPACITY];
+	char *buffer = stack_buffer;
+	if(source.count >= sizeof(stack_buffer)){
+		buffer = malloc(source.count + 1);
+		assert(buffer != NULL);
+	}
+	memcpy(buffer, source.data, source.count);
+	buffer[source.count] = '\0';
+
 	char *endptr = NULL;
-	long int result = strtol(temp_buffer, &endptr, 10);
-	if(out) *out =result;
-	return (endptr != temp_buffer && *endptr == '\0');
-}
+	long int result = strtol(buffer, &endptr, 10);
+	*ok = endptr != buffer && *endptr == '\0';
 
-Expr_Index parse_primary_expr(String_View *source, Expr_Buffer *eb){
-	String_View token = next_token(source);
-	if(token.data == 0){
-		fprintf(stderr, "ERROR: expected primary expression token, but got end of input \n");
-		exit(1);
+	if(buffer != stack_buffer){
+		free(buffer);
 	}
+	return result;
+}
 
-	Expr_Index expr_index = expr_buffer_alloc(eb);
-	Expr *expr = expr_buffer_at(eb, expr_index);
-	memset(expr, 0, sizeof(Expr));
+typedef enum {
+	PARSE_NUMBER_INVALID = 0,
+	PARSE_NUMBER_OK,
+	// The input may be a number but the fast path can't produce a
+	// correctly rounded result for it (too many digits, huge exponents,
+	// hex floats, inf/nan, leading whitespace)
+	PARSE_NUMBER_SLOW,
+} Parse_Number_Result;
 
-	if(sv_strtod(token, &expr->as.number)){
+static const double exact_powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
 
-		expr->kind = EXPR_KIND_NUMBER;
-		return expr_index;
+#define MAX_EXACT_POWER_OF_TEN 22
+#define MAX_EXACT_MANTISSA ((uint64_t) 1 << 53)
 
-	} else {
-		expr->kind = EXPR_KIND_CELL;
-					
-		if(!isupper(*token.data)){
-			fprintf(stderr, "ERROR: cell reference must start with capital letter");
-			exit(1);
-		}
-		expr->as.cell.col = *token.data - 'A';
-		sv_chop_left(&token, 1);
-		long int row;
-		if(!sv_strtol(token, &row)){
-			fprintf(stderr, "ERROR: cell reference must have an integer as the row number\n");
-			exit(1);
-		}
+// Accepts exactly the decimal syntax of strtod(3) over the whole view.
+// The value is computed Clinger style: a mantissa of at most 2^53 and a
+// power of ten of at most 10^22 are both exact doubles, so one IEEE
+// multiplication or division of them is correctly rounded.
+Parse_Number_Result parse_decimal_fast(String_View source, double *out){
+	const char *p = source.data;
+	const char *end = source.data + source.count;
 
-		expr->as.cell.row = (size_t) row;
-					
+	if(p == end){
+		return PARSE_NUMBER_INVALID;
 	}
-	return expr_index;
-	// 2:22:03
-}
-
-Expr_Index parse_plus_expr(String_View *source, Expr_Buffer *eb){
-	Expr_Index lhs_index = parse_primary_expr(source, eb);
 
-	String_View token = next_token(source);
-	if(token.data != NULL && sv_eq(token, SV("+"))){
-		Expr_Index rhs_index = parse_plus_expr(source, eb);
-		Expr_Index expr_index = expr_buffer_alloc(eb);
-		Expr *expr = expr_buffer_at(eb, expr_index);
-		memset(expr, 0, sizeof(Expr));
-		expr->kind = EXPR_KIND_PLUS;
-		expr->as.plus.lhs = lhs_index;
-		expr->as.plus.rhs = rhs_index;
-		return expr_index;
+	bool negative = false;
+	if(*p == '+' || *p == '-'){
+		negative = *p == '-';
+		p += 1;
 	}
-	return lhs_index;
-}
 
-void dump_expr(FILE *stream ,Expr_Buffer *eb , Expr_Index expr_index, int level){
-	Expr *expr = expr_buffer_at(eb, expr_index);
-	
-	fprintf(stream, "%*s", level*2, "");
-	switch(expr->kind){
-	case EXPR_KIND_NUMBER:
-		fprintf(stream ,"NUMBER: %lf\n", expr->as.number);
-		break;
-	case EXPR_KIND_CELL:
-		fprintf(stream, "CELL (%lu, %lu)\n",expr->as.cell.row, expr->as.cell.col);
-		break;
-	case EXPR_KIND_PLUS:
-		fprintf(stream, "PLUS:\n");
-		dump_expr(stream , eb, expr->as.plus.lhs, level+1);
-		dump_expr(stream , eb, expr->as.plus.rhs, level+1);
-		break;
+	if(p == end){
+		return PARSE_NUMBER_INVALID;
 	}
-}
 
-Expr_Index parse_expr(String_View *source, Expr_Buffer *eb){
-	return parse_plus_expr(source, eb);
-}
+	if(!isdigit(*p) && *p != '.'){
+		if(*p == 'i' || *p == 'I' || *p == 'n' || *p == 'N' || isspace(*p)){
+			return PARSE_NUMBER_SLOW;
+		}
+		return PARSE_NUMBER_INVALID;
+	}
 
-Table table_alloc(size_t rows, size_t cols){
-	Table table = {0};
-	table.rows = rows;
-	table.cols = cols;
-	
-	// Allocate memory to store table
-	table.cells = malloc(sizeof(Cell) * rows * cols);
-	memset(table.cells, 0, sizeof(Cell) * rows * cols);
-	if (table.cells == NULL){
-		fprintf(stderr,"ERROR: could not allocate memory for the table \n");
-		exit(1);
+	if(*p == '0' && p + 1 < end && (p[1] == 'x' || p[1] == 'X')){
+		return PARSE_NUMBER_SLOW;
 	}
 
-	// Fill the table with zeros;
-	memset(table.cells, 0 , sizeof(Cell) * rows * cols);
-	return table;
-}
+	uint64_t mantissa = 0;
+	size_t digits = 0;
+	size_t significant_digits = 0;
+	long exponent = 0;
 
-Cell *table_cell_at(Table *table, size_t row, size_t col){
-	assert(row < table->rows);
-	assert(col < table->cols);
-	return &table->cells[row * table->cols + col];
-}
+	for(; p < end && isdigit(*p); ++p, ++digits){
+		if(mantissa == 0 && *p == '0'){
+			continue;
+		}
+		if(significant_digits < 19){
+			mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+		} else {
+			exponent += 1;
+		}
+		significant_digits += 1;
+	}
 
-void usage(FILE *stream)
+	if(p < end && *p == '.'){
+		p += 1;
+		for(; p < end && isdigit(*p); ++p, ++digits){
+			if(mantissa == 0 && *p == '0'){
+				exponent -= 1;
+				continue;
+			}
+			if(significant_digits < 19){
+				mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+				exponent -= 1;
+			}
+			significant_digits += 1;
+		}
+	}
+
+	if(digits == 0){
+		return PARSE_NUMBER_INVALID;
+	}
+
+	if(p < end && (*p == 'e' || *p == 'E')){
+		p += 1;
+		bool exponent_negative = false;
+		if(p < end && (*p == '+' || *p == '-')){
+			exponent_negative = *p == '-';
+			p += 1;
+		}
+		if(p == end || !isdigit(*p)){
+			return PARSE_NUMBER_INVALID;
+		}
+		long explicit_exponent = 0;
+		for(; p < end && isdigit(*p); ++p){
+			if(explicit_exponent < 100000){
+				explicit_exponent = explicit_exponent * 10 + (*p - '0');
+			}
+		}
+		exponent += exponent_negative ? -explicit_exponent : explicit_exponent;
+	}
+
+	if(p != end){
+		return PARSE_NUMBER_INVALID;
+	}
+
+	if(significant_digits > 19){
+		return PARSE_NUMBER_SLOW;
+	}
+
+	double value;
+	if(mantissa == 0){
+		value = 0.0;
+	} else {
+		if(mantissa > MAX_EXACT_MANTISSA){
+			return PARSE_NUMBER_SLOW;
+		}
+		// 123e25 is the same as 123000e22 as long as the mantissa stays exact
+		while(exponent > MAX_EXACT_POWER_OF_TEN && mantissa * 10 <= MAX_EXACT_MANTISSA){
+			mantissa *= 10;
+			exponent -= 1;
+		}
+		if(exponent < -MAX_EXACT_POWER_OF_TEN || exponent > MAX_EXACT_POWER_OF_TEN){
+			return PARSE_NUMBER_SLOW;
+		}
+		value = (double) mantissa;
+		if(exponent < 0){
+			value /= exact_powers_of_ten[-exponent];
+		} else {
+			value *= exact_powers_of_ten[exponent];
+		}
+	}
+
+	*out = negative ? -value : value;
+	return PARSE_NUMBER_OK;
+}
+
+// Parses the whole view as a double without copying it and without any
+// shared state, so it is safe to call from the parsing workers.
+bool sv_strtod(String_View source ,double *out){
+	double result = 0.0;
+	bool ok = false;
+	switch(parse_decimal_fast(source, &result)){
+	case PARSE_NUMBER_OK:
+		ok = true;
+		break;
+	case PARSE_NUMBER_INVALID:
+		ok = false;
+		break;
+	case PARSE_NUMBER_SLOW:
+		result = sv_strtod_slow(source, &ok);
+		break;
+	}
+	if(out) *out = result;
+	return ok;
+}
+
+bool sv_strtol(String_View source ,long int *out){
+	size_t i = 0;
+	bool negative = false;
+	if(i < source.count && (source.data[i] == '+' || source.data[i] == '-')){
+		negative = source.data[i] == '-';
+		i += 1;
+	}
+
+	// 18 decimal digits always fit into a 64 bit long
+	if(i < source.count && source.count - i <= 18 && sizeof(long int) >= 8){
+		long int result = 0;
+		for(; i < source.count && isdigit(source.data[i]); ++i){
+			result = result * 10 + (source.data[i] - '0');
+		}
+		if(i == source.count){
+			if(out) *out = negative ? -result : result;
+			return true;
+		}
+	}
+
+	bool ok = false;
+	long int result = sv_strtol_slow(source, &ok);
+	if(out) *out = result;
+	return ok;
+}
+
+const char *aggregate_fn_names[COUNT_AGGREGATES] = {
+	[AGGREGATE_SUM] = "SUM",
+	[AGGREGATE_AVG] = "AVG",
+	[AGGREGATE_MIN] = "MIN",
+	[AGGREGATE_MAX] = "MAX",
+	[AGGREGATE_COUNT] = "COUNT",
+};
+
+bool aggregate_fn_from_name(String_View name, Aggregate_Fn *fn){
+	for(size_t i = 0; i < COUNT_AGGREGATES; ++i){
+		if(sv_eq(name, sv_from_cstr(aggregate_fn_names[i]))){
+			*fn = (Aggregate_Fn) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+Expr_Index parse_cell_expr(String_View token, Expr_Buffer *eb){
+	if(token.data == NULL){
+		fprintf(stderr, "ERROR: expected cell reference, but got end of input \n");
+		exit(1);
+	}
+
+	Expr_Index expr_index = expr_buffer_alloc(eb);
+	Expr *expr = expr_buffer_at(eb, expr_index);
+	memset(expr, 0, sizeof(Expr));
+	expr->kind = EXPR_KIND_CELL;
+
+	if(!isupper(*token.data)){
+		fprintf(stderr, "ERROR: cell reference must start with capital letter");
+		exit(1);
+	}
+	expr->as.cell.col = *token.data - 'A';
+	sv_chop_left(&token, 1);
+	long int row;
+	if(!sv_strtol(token, &row)){
+		fprintf(stderr, "ERROR: cell reference must have an integer as the row number\n");
+		exit(1);
+	}
+
+	expr->as.cell.row = (size_t) row;
+	return expr_index;
+}
+
+// NAME(CELL) or NAME(CELL:CELL), the name is already consumed
+Expr_Index parse_aggregate_expr(String_View name, String_View *source, Expr_Buffer *eb){
+	Aggregate_Fn fn;
+	if(!aggregate_fn_from_name(name, &fn)){
+		fprintf(stderr, "ERROR: unknown function " SV_Fmt "\n", SV_Arg(name));
+		exit(1);
+	}
+	next_token(source);
+
+	Expr_Index first = parse_cell_expr(next_token(source), eb);
+	Expr_Index last = first;
+	String_View token = next_token(source);
+	if(token.data != NULL && sv_eq(token, SV(":"))){
+		last = parse_cell_expr(next_token(source), eb);
+		token = next_token(source);
+	}
+	if(token.data == NULL || !sv_eq(token, SV(")"))){
+		fprintf(stderr, "ERROR: expected ) after the range of " SV_Fmt "\n", SV_Arg(name));
+		exit(1);
+	}
+
+	// any two opposite corners make the same range
+	Expr_Cell *a = &expr_buffer_at(eb, first)->as.cell;
+	Expr_Cell *b = &expr_buffer_at(eb, last)->as.cell;
+	Expr_Cell top_left = {
+		.col = a->col < b->col ? a->col : b->col,
+		.row = a->row < b->row ? a->row : b->row,
+	};
+	Expr_Cell bottom_right = {
+		.col = a->col < b->col ? b->col : a->col,
+		.row = a->row < b->row ? b->row : a->row,
+	};
+	*a = top_left;
+	*b = bottom_right;
+
+	Expr_Index range_index = expr_buffer_alloc(eb);
+	Expr *range = expr_buffer_at(eb, range_index);
+	memset(range, 0, sizeof(Expr));
+	range->kind = EXPR_KIND_RANGE;
+	range->as.range.first = first;
+	range->as.range.last = last;
+
+	Expr_Index expr_index = expr_buffer_alloc(eb);
+	Expr *expr = expr_buffer_at(eb, expr_index);
+	memset(expr, 0, sizeof(Expr));
+	expr->kind = EXPR_KIND_AGGREGATE;
+	expr->as.aggregate.fn = fn;
+	expr->as.aggregate.range = range_index;
+	return expr_index;
+}
+
+Expr_Index parse_primary_expr(String_View *source, Expr_Buffer *eb){
+	String_View token = next_token(source);
+	if(token.data == 0){
+		fprintf(stderr, "ERROR: expected primary expression token, but got end of input \n");
+		exit(1);
+	}
+
+	double number = 0.0;
+	if(sv_strtod(token, &number)){
+		Expr_Index expr_index = expr_buffer_alloc(eb);
+		Expr *expr = expr_buffer_at(eb, expr_index);
+		memset(expr, 0, sizeof(Expr));
+		expr->kind = EXPR_KIND_NUMBER;
+		expr->as.number = number;
+		return expr_index;
+	}
+
+	if(sv_starts_with(sv_trim_left(*source), SV("("))){
+		return parse_aggregate_expr(token, source, eb);
+	}
+	return parse_cell_expr(token, eb);
+	// 2:22:03
+}
+
+Expr_Index parse_plus_expr(String_View *source, Expr_Buffer *eb){
+	Expr_Index lhs_index = parse_primary_expr(source, eb);
+
+	String_View token = next_token(source);
+	if(token.data != NULL && sv_eq(token, SV("+"))){
+		Expr_Index rhs_index = parse_plus_expr(source, eb);
+		Expr_Index expr_index = expr_buffer_alloc(eb);
+		Expr *expr = expr_buffer_at(eb, expr_index);
+		memset(expr, 0, sizeof(Expr));
+		expr->kind = EXPR_KIND_PLUS;
+		expr->as.plus.lhs = lhs_index;
+		expr->as.plus.rhs = rhs_index;
+		return expr_index;
+	}
+	return lhs_index;
+}
+
+void dump_expr(FILE *stream ,Expr_Buffer *eb , Expr_Index expr_index, int level){
+	Expr *expr = expr_buffer_at(eb, expr_index);
+	
+	fprintf(stream, "%*s", level*2, "");
+	switch(expr->kind){
+	case EXPR_KIND_NUMBER:
+		fprintf(stream ,"NUMBER: %lf\n", expr->as.number);
+		break;
+	case EXPR_KIND_CELL:
+		fprintf(stream, "CELL (%lu, %lu)\n",expr->as.cell.row, expr->as.cell.col);
+		break;
+	case EXPR_KIND_PLUS:
+		fprintf(stream, "PLUS:\n");
+		dump_expr(stream , eb, expr->as.plus.lhs, level+1);
+		dump_expr(stream , eb, expr->as.plus.rhs, level+1);
+		break;
+	case EXPR_KIND_SUM:
+		fprintf(stream, "SUM:\n");
+		for(size_t i = 0; i < expr->as.sum.count; ++i){
+			dump_expr(stream , eb, eb->operands.items[expr->as.sum.begin + i], level+1);
+		}
+		break;
+	case EXPR_KIND_RANGE:
+		fprintf(stream, "RANGE:\n");
+		dump_expr(stream , eb, expr->as.range.first, level+1);
+		dump_expr(stream , eb, expr->as.range.last, level+1);
+		break;
+	case EXPR_KIND_AGGREGATE:
+		fprintf(stream, "%s:\n", aggregate_fn_names[expr->as.aggregate.fn]);
+		dump_expr(stream , eb, expr->as.aggregate.range, level+1);
+		break;
+	}
+}
+
+Expr_Index parse_expr(String_View *source, Expr_Buffer *eb){
+	return parse_plus_expr(source, eb);
+}
+
+size_t expr_count_nodes(const Expr_Buffer *eb, Expr_Index expr_index){
+	const Expr *expr = expr_buffer_at(eb, expr_index);
+	size_t count = 1;
+	switch(expr->kind){
+	case EXPR_KIND_NUMBER:
+	case EXPR_KIND_CELL:
+		break;
+	case EXPR_KIND_PLUS:
+		count += expr_count_nodes(eb, expr->as.plus.lhs) + expr_count_nodes(eb, expr->as.plus.rhs);
+		break;
+	case EXPR_KIND_SUM:
+		for(size_t i = 0; i < expr->as.sum.count; ++i){
+			count += expr_count_nodes(eb, eb->operands.items[expr->as.sum.begin + i]);
+		}
+		break;
+	case EXPR_KIND_RANGE:
+		count += expr_count_nodes(eb, expr->as.range.first) + expr_count_nodes(eb, expr->as.range.last);
+		break;
+	case EXPR_KIND_AGGREGATE:
+		count += expr_count_nodes(eb, expr->as.aggregate.range);
+		break;
+	}
+	return count;
+}
+
+// Whether parse_expr accepts the whole source. For formulas that don't
+// come from the input, where an error must not end the program.
+bool cell_syntax_ok(String_View token){
+	long int row = 0;
+	if(token.count == 0 || !isupper(*token.data)){
+		return false;
+	}
+	sv_chop_left(&token, 1);
+	return sv_strtol(token, &row);
+}
+
+bool expr_syntax_ok(String_View source){
+	for(;;){
+		source = sv_trim(source);
+		String_View token = sv_chop_left_while(&source, is_name);
+		source = sv_trim_left(source);
+		double number = 0.0;
+		Aggregate_Fn fn;
+		if(token.count > 0 && sv_strtod(token, &number)){
+			// a number
+		} else if(sv_starts_with(source, SV("("))){
+			if(!aggregate_fn_from_name(token, &fn)){
+				return false;
+			}
+			sv_chop_left(&source, 1);
+			source = sv_trim_left(source);
+			if(!cell_syntax_ok(sv_chop_left_while(&source, is_name))){
+				return false;
+			}
+			source = sv_trim_left(source);
+			if(sv_starts_with(source, SV(":"))){
+				sv_chop_left(&source, 1);
+				source = sv_trim_left(source);
+				if(!cell_syntax_ok(sv_chop_left_while(&source, is_name))){
+					return false;
+				}
+				source = sv_trim_left(source);
+			}
+			if(!sv_starts_with(source, SV(")"))){
+				return false;
+			}
+			sv_chop_left(&source, 1);
+		} else if(!cell_syntax_ok(token)){
+			return false;
+		}
+		source = sv_trim(source);
+		if(source.count == 0){
+			return true;
+		}
+		if(*source.data != '+'){
+			return false;
+		}
+		sv_chop_left(&source, 1);
+	}
+}
+
+int expr_cell_compare(const void *a, const void *b){
+	const Expr_Cell *x = a;
+	const Expr_Cell *y = b;
+	if(x->col != y->col){
+		return x->col < y->col ? -1 : 1;
+	}
+	if(x->row != y->row){
+		return x->row < y->row ? -1 : 1;
+	}
+	return 0;
+}
+
+int aggregate_ref_compare(const void *a, const void *b){
+	const Aggregate_Ref *x = a;
+	const Aggregate_Ref *y = b;
+	if(x->fn != y->fn){
+		return x->fn < y->fn ? -1 : 1;
+	}
+	int result = expr_cell_compare(&x->first, &y->first);
+	return result != 0 ? result : expr_cell_compare(&x->last, &y->last);
+}
+
+Expr_Index expr_push_cell(Expr_Buffer *eb, Expr_Cell cell){
+	Expr leaf = {0};
+	leaf.kind = EXPR_KIND_CELL;
+	leaf.as.cell = cell;
+	return expr_buffer_push(eb, leaf);
+}
+
+// Whether the formula at root has the leaves expr_optimize collected
+bool expr_formula_matches(const Expr_Buffer *eb, Expr_Index root, bool has_constant, double constant){
+	size_t count = 0;
+	const Expr_Index *leaves = expr_formula_leaves(eb, &root, &count);
+	if(count != eb->cells.count + eb->aggregates.count + has_constant){
+		return false;
+	}
+	size_t i = 0;
+	for(size_t j = 0; j < eb->cells.count; ++j){
+		const Expr *leaf = expr_buffer_at(eb, leaves[i++]);
+		if(leaf->kind != EXPR_KIND_CELL || leaf->as.cell.col != eb->cells.items[j].col || leaf->as.cell.row != eb->cells.items[j].row){
+			return false;
+		}
+	}
+	for(size_t j = 0; j < eb->aggregates.count; ++j){
+		const Expr *leaf = expr_buffer_at(eb, leaves[i++]);
+		if(leaf->kind != EXPR_KIND_AGGREGATE){
+			return false;
+		}
+		Aggregate_Ref ref = expr_aggregate_ref(eb, leaf);
+		if(!aggregate_ref_eq(&ref, &eb->aggregates.items[j])){
+			return false;
+		}
+	}
+	if(has_constant){
+		const Expr *leaf = expr_buffer_at(eb, leaves[i]);
+		return leaf->kind == EXPR_KIND_NUMBER && memcmp(&leaf->as.number, &constant, sizeof(double)) == 0;
+	}
+	return true;
+}
+
+// Simplifies a freshly parsed expression occupying eb[first..count]:
+// the right leaning chain of PLUS nodes built by parse_plus_expr becomes
+// a single n-ary SUM, all the numbers in it are folded into one constant
+// and the cell operands are sorted by column and row, followed by the
+// sorted aggregates, so equivalent formulas end up with the same shape.
+// The parsed nodes are dropped. Whole formulas are hash-consed: a formula
+// equal to one already in the buffer is looked up before anything is
+// allocated and shares its nodes, anything else gets fresh ones.
+//
+// Note that this reassociates the additions: the cells are summed first
+// in canonical order and the folded constant is added last.
+Expr_Index expr_optimize(Expr_Buffer *eb, Expr_Index root, Expr_Index first){
+	double constant = 0.0;
+	bool has_constant = false;
+	eb->cells.count = 0;
+	eb->aggregates.count = 0;
+	eb->stack.count = 0;
+	da_append(&eb->stack, root);
+	while(eb->stack.count > 0){
+		Expr *expr = expr_buffer_at(eb, eb->stack.items[--eb->stack.count]);
+		switch(expr->kind){
+		case EXPR_KIND_NUMBER:
+			constant += expr->as.number;
+			has_constant = true;
+			break;
+		case EXPR_KIND_CELL:
+			da_append(&eb->cells, expr->as.cell);
+			break;
+		case EXPR_KIND_PLUS:
+			da_append(&eb->stack, expr->as.plus.rhs);
+			da_append(&eb->stack, expr->as.plus.lhs);
+			break;
+		case EXPR_KIND_AGGREGATE: {
+			Aggregate_Ref ref = expr_aggregate_ref(eb, expr);
+			da_append(&eb->aggregates, ref);
+			break;
+		}
+		case EXPR_KIND_SUM:
+			assert(0 && "unreachable: the parser does not produce sums");
+			break;
+		case EXPR_KIND_RANGE:
+			assert(0 && "unreachable: ranges only appear inside aggregates");
+			break;
+		}
+	}
+	// qsort wants non-NULL arrays even when there is nothing to sort
+	if(eb->cells.count > 1){
+		qsort(eb->cells.items, eb->cells.count, sizeof(Expr_Cell), expr_cell_compare);
+	}
+	if(eb->aggregates.count > 1){
+		qsort(eb->aggregates.items, eb->aggregates.count, sizeof(Aggregate_Ref), aggregate_ref_compare);
+	}
+
+	assert(first <= root && root < eb->count);
+	eb->count = first;
+
+	has_constant = has_constant || eb->cells.count + eb->aggregates.count == 0;
+	uint64_t full_hash = EXPR_HASH_OFFSET_BASIS;
+	for(size_t i = 0; i < eb->cells.count; ++i){
+		full_hash = expr_hash_cell(full_hash, eb->cells.items[i]);
+	}
+	for(size_t i = 0; i < eb->aggregates.count; ++i){
+		full_hash = expr_hash_aggregate(full_hash, &eb->aggregates.items[i]);
+	}
+	if(has_constant){
+		full_hash = expr_hash_number(full_hash, constant);
+	}
+	uint32_t hash = (uint32_t) full_hash;
+	bool intern = !eb->intern_off;
+	if(intern){
+		if((eb->interned_count + 1) * 2 > eb->interned_capacity){
+			expr_buffer_intern_grow(eb);
+		}
+		eb->intern_lookups += 1;
+		size_t mask = eb->interned_capacity - 1;
+		for(size_t slot = hash & mask; eb->interned[slot].index != 0; slot = (slot + 1) & mask){
+			Expr_Index candidate = eb->interned[slot].index - 1;
+			if(eb->interned[slot].hash == hash && expr_formula_matches(eb, candidate, has_constant, constant)){
+				eb->intern_hits += 1;
+				return candidate;
+			}
+		}
+		if(eb->intern_lookups == EXPR_INTERN_SAMPLE && eb->intern_hits < EXPR_INTERN_MIN_HITS){
+			eb->intern_off = true;
+		}
+	}
+
+	eb->leaves.count = 0;
+	for(size_t i = 0; i < eb->cells.count; ++i){
+		da_append(&eb->leaves, expr_push_cell(eb, eb->cells.items[i]));
+	}
+	for(size_t i = 0; i < eb->aggregates.count; ++i){
+		Aggregate_Ref *ref = &eb->aggregates.items[i];
+		Expr range = {0};
+		range.kind = EXPR_KIND_RANGE;
+		range.as.range.first = expr_push_cell(eb, ref->first);
+		range.as.range.last = expr_push_cell(eb, ref->last);
+		Expr leaf = {0};
+		leaf.kind = EXPR_KIND_AGGREGATE;
+		leaf.as.aggregate.fn = ref->fn;
+		leaf.as.aggregate.range = expr_buffer_push(eb, range);
+		da_append(&eb->leaves, expr_buffer_push(eb, leaf));
+	}
+	if(has_constant){
+		Expr leaf = {0};
+		leaf.kind = EXPR_KIND_NUMBER;
+		leaf.as.number = constant;
+		da_append(&eb->leaves, expr_buffer_push(eb, leaf));
+	}
+
+	Expr_Index result = eb->leaves.items[0];
+	if(eb->leaves.count > 1){
+		Expr sum = {0};
+		sum.kind = EXPR_KIND_SUM;
+		sum.as.sum.begin = eb->operands.count;
+		sum.as.sum.count = eb->leaves.count;
+		for(size_t i = 0; i < eb->leaves.count; ++i){
+			da_append(&eb->operands, eb->leaves.items[i]);
+		}
+		result = expr_buffer_push(eb, sum);
+	}
+	if(intern){
+		expr_buffer_intern_insert(eb, hash, result);
+	}
+	return result;
+}
+
+// Every expression is compiled once into a linear program for a small
+// stack machine. All programs live side by side in one Code_Buffer and
+// start with an OP_ENTER that tells how deep the value stack gets.
+typedef enum {
+	OP_ENTER = 0,
+	OP_PUSH_NUMBER,
+	OP_LOAD_CELL,
+	OP_ADD,
+	// fused load and add, emitted for the operands of sums
+	OP_ADD_NUMBER,
+	OP_ADD_CELL,
+	// pushes the value of Code_Buffer.aggregates[as.aggregate]
+	OP_AGGREGATE,
+	OP_RETURN,
+	COUNT_OPS,
+} Op_Kind;
+
+typedef struct {
+	uint32_t kind;
+	uint32_t col;
+	union {
+		double number;
+		size_t row;
+		size_t stack_size;
+		size_t aggregate;
+	} as;
+} Inst;
+
+typedef struct {
+	Inst *items;
+	size_t count;
+	size_t capacity;
+	// Programs are shared by all the cells with the same (interned)
+	// expression: expr_code[index] is the offset of the program of the
+	// expression + 1, or 0 if it was not compiled yet
+	size_t *expr_code;
+	size_t expr_code_capacity;
+	// Amount of programs shared by more than one cell. The OP_ENTER of
+	// such a program carries its memo slot + 1 in `col`.
+	size_t memo_count;
+	// ranges of the OP_AGGREGATE instructions
+	Aggregate_Refs aggregates;
+	// scratch stack of the compiler
+	Expr_Indices stack;
+} Code_Buffer;
+
+void code_buffer_free(Code_Buffer *cb){
+	free(cb->items);
+	free(cb->expr_code);
+	free(cb->aggregates.items);
+	free(cb->stack.items);
+	memset(cb, 0, sizeof(*cb));
+}
+
+Inst inst_for_leaf(const Expr *expr, Op_Kind number_op, Op_Kind cell_op){
+	Inst inst = {0};
+	if(expr->kind == EXPR_KIND_NUMBER){
+		inst.kind = number_op;
+		inst.as.number = expr->as.number;
+	} else {
+		assert(expr->kind == EXPR_KIND_CELL);
+		if(expr->as.cell.col > UINT32_MAX){
+			fprintf(stderr, "ERROR: column %zu is too big\n", expr->as.cell.col);
+			exit(1);
+		}
+		inst.kind = cell_op;
+		inst.col = (uint32_t) expr->as.cell.col;
+		inst.as.row = expr->as.cell.row;
+	}
+	return inst;
+}
+
+Inst inst_for_aggregate(Expr_Buffer *eb, const Expr *expr, Code_Buffer *cb){
+	assert(expr->kind == EXPR_KIND_AGGREGATE);
+	Expr *range = expr_buffer_at(eb, expr->as.aggregate.range);
+	Aggregate_Ref ref = {0};
+	ref.fn = expr->as.aggregate.fn;
+	ref.first = expr_buffer_at(eb, range->as.range.first)->as.cell;
+	ref.last = expr_buffer_at(eb, range->as.range.last)->as.cell;
+	da_append(&cb->aggregates, ref);
+
+	Inst inst = {0};
+	inst.kind = OP_AGGREGATE;
+	inst.as.aggregate = cb->aggregates.count - 1;
+	return inst;
+}
+
+// Emits the program of the expression in postorder and returns its offset
+size_t compile_expr(Expr_Buffer *eb, Expr_Index root, Code_Buffer *cb){
+	size_t code = cb->count;
+	Inst enter = {0};
+	enter.kind = OP_ENTER;
+	da_append(cb, enter);
+
+	size_t depth = 0;
+	size_t max_depth = 0;
+	cb->stack.count = 0;
+	da_append(&cb->stack, root << 1);
+	while(cb->stack.count > 0){
+		Expr_Index tagged = cb->stack.items[--cb->stack.count];
+		Expr *expr = expr_buffer_at(eb, tagged >> 1);
+		Inst inst = {0};
+
+		if(tagged & 1){
+			assert(expr->kind == EXPR_KIND_PLUS);
+			inst.kind = OP_ADD;
+			da_append(cb, inst);
+			depth -= 1;
+			continue;
+		}
+
+		switch(expr->kind){
+		case EXPR_KIND_NUMBER:
+		case EXPR_KIND_CELL:
+			inst = inst_for_leaf(expr, OP_PUSH_NUMBER, OP_LOAD_CELL);
+			da_append(cb, inst);
+			depth += 1;
+			break;
+		case EXPR_KIND_PLUS:
+			da_append(&cb->stack, ((tagged >> 1) << 1) | 1);
+			da_append(&cb->stack, expr->as.plus.rhs << 1);
+			da_append(&cb->stack, expr->as.plus.lhs << 1);
+			break;
+		case EXPR_KIND_AGGREGATE:
+			da_append(cb, inst_for_aggregate(eb, expr, cb));
+			depth += 1;
+			break;
+		case EXPR_KIND_SUM:
+			// expr_optimize only puts numbers, cells and aggregates into sums
+			for(size_t i = 0; i < expr->as.sum.count; ++i){
+				Expr *operand = expr_buffer_at(eb, eb->operands.items[expr->as.sum.begin + i]);
+				if(operand->kind == EXPR_KIND_AGGREGATE){
+					da_append(cb, inst_for_aggregate(eb, operand, cb));
+					if(i > 0){
+						Inst add = {0};
+						add.kind = OP_ADD;
+						da_append(cb, add);
+						if(max_depth < depth + 2){
+							max_depth = depth + 2;
+						}
+					}
+					continue;
+				}
+				if(i == 0){
+					inst = inst_for_leaf(operand, OP_PUSH_NUMBER, OP_LOAD_CELL);
+				} else {
+					inst = inst_for_leaf(operand, OP_ADD_NUMBER, OP_ADD_CELL);
+				}
+				da_append(cb, inst);
+			}
+			depth += 1;
+			break;
+		case EXPR_KIND_RANGE:
+			assert(0 && "unreachable: ranges only appear inside aggregates");
+			break;
+		}
+
+		if(max_depth < depth){
+			max_depth = depth;
+		}
+	}
+
+	Inst ret = {0};
+	ret.kind = OP_RETURN;
+	da_append(cb, ret);
+	cb->items[code].as.stack_size = max_depth;
+	return code;
+}
+
+// Like compile_expr but reuses the program if the expression was compiled
+// before. A program that ends up used by several cells gets a memo slot,
+// so it is computed once per evaluation and every other cell reads the
+// memoized value.
+void code_buffer_reserve_expr_code(Code_Buffer *cb, Expr_Index root){
+	if(root >= cb->expr_code_capacity){
+		size_t capacity = cb->expr_code_capacity == 0 ? 1024 : cb->expr_code_capacity;
+		while(root >= capacity){
+			capacity *= 2;
+		}
+		cb->expr_code = realloc(cb->expr_code, sizeof(size_t) * capacity);
+		assert(cb->expr_code != NULL && "Buy more RAM lol");
+		memset(&cb->expr_code[cb->expr_code_capacity], 0, sizeof(size_t) * (capacity - cb->expr_code_capacity));
+		cb->expr_code_capacity = capacity;
+	}
+}
+
+size_t compile_expr_shared(Expr_Buffer *eb, Expr_Index root, Code_Buffer *cb){
+	code_buffer_reserve_expr_code(cb, root);
+	if(cb->expr_code[root] == 0){
+		cb->expr_code[root] = compile_expr(eb, root, cb) + 1;
+		return cb->expr_code[root] - 1;
+	}
+
+	size_t code = cb->expr_code[root] - 1;
+	Inst *enter = &cb->items[code];
+	assert(enter->kind == OP_ENTER);
+	if(enter->col == 0){
+		assert(cb->memo_count < UINT32_MAX);
+		enter->col = (uint32_t) ++cb->memo_count;
+	}
+	return code;
+}
+
+typedef enum {
+	MEMO_EMPTY = 0,
+	MEMO_WRITING,
+	MEMO_READY,
+} Memo_State;
+
+// Values of the shared programs for the current evaluation pass. Workers
+// of the parallel evaluator may race to compute the same program: the
+// one that moves the slot from EMPTY to WRITING publishes the value, the
+// others just use what they computed themselves.
+typedef struct {
+	double *values;
+	atomic_uchar *states;
+	size_t count;
+} Eval_Memo;
+
+void eval_memo_init(Eval_Memo *memo, size_t count){
+	memo->count = count;
+	memo->values = malloc(sizeof(double) * (count + 1));
+	memo->states = malloc(sizeof(atomic_uchar) * (count + 1));
+	assert(memo->values != NULL && memo->states != NULL);
+	for(size_t i = 0; i < count; ++i){
+		atomic_init(&memo->states[i], MEMO_EMPTY);
+	}
+}
+
+// Forgets the memoized values, for when the cells they were computed
+// from may have changed
+void eval_memo_reset(Eval_Memo *memo){
+	for(size_t i = 0; i < memo->count; ++i){
+		atomic_store_explicit(&memo->states[i], MEMO_EMPTY, memory_order_relaxed);
+	}
+}
+
+void eval_memo_free(Eval_Memo *memo){
+	free(memo->values);
+	free(memo->states);
+	memset(memo, 0, sizeof(*memo));
+}
+
+// (Re)allocates the status bitsets for all the slots of the table, all
+// cells become UNEVALUATED
+void table_reset_status(Table *table){
+	size_t words = (table->slots_count + STATUS_WORD_BITS - 1) / STATUS_WORD_BITS;
+	free(table->in_progress);
+	free(table->evaluated);
+	table->in_progress = calloc(words + 1, sizeof(uint64_t));
+	table->evaluated = calloc(words + 1, sizeof(uint64_t));
+	if(table->in_progress == NULL || table->evaluated == NULL){
+		fprintf(stderr,"ERROR: could not allocate memory for the table \n");
+		exit(1);
+	}
+}
+
+void table_alloc_slots(Table *table, size_t slots_count){
+	table->slots_count = slots_count;
+	table->slots_capacity = slots_count;
+	table->kinds = calloc(slots_count + 1, sizeof(uint8_t));
+	table->values = calloc(slots_count + 1, sizeof(double));
+	table->refs = calloc(slots_count + 1, sizeof(uint32_t));
+	if (table->kinds == NULL || table->values == NULL || table->refs == NULL){
+		fprintf(stderr,"ERROR: could not allocate memory for the table \n");
+		exit(1);
+	}
+	table_reset_status(table);
+}
+
+// Dense storage pays for every missing cell, so it is only used when at
+// least half of the rows * cols cells are actually there
+bool table_should_be_dense(size_t rows, size_t cols, size_t cells_count){
+	return rows == 0 || cols <= cells_count * 2 / rows;
+}
+
+// Allocates a zeroed table for cells_count cells spread over rows x cols
+// in the layout picked by table_should_be_dense. The row offsets of a
+// sparse table are left for the caller to fill.
+Table table_alloc(size_t rows, size_t cols, size_t cells_count){
+	Table table = {0};
+	table.rows = rows;
+	table.cols = cols;
+	
+	// Allocate memory to store table and fill it with zeros
+	if(table_should_be_dense(rows, cols, cells_count)){
+		table_alloc_slots(&table, rows * cols);
+	} else {
+		table.row_offsets.count = rows + 1;
+		table.row_offsets.capacity = rows + 1;
+		table.row_offsets.items = calloc(rows + 1, sizeof(size_t));
+		if(table.row_offsets.items == NULL){
+			fprintf(stderr,"ERROR: could not allocate memory for the table \n");
+			exit(1);
+		}
+		table.row_offsets.items[rows] = cells_count;
+		table.empty_slot = cells_count;
+		table_alloc_slots(&table, cells_count + 1);
+	}
+
+	return table;
+}
+
+void table_free_columns(Table *table){
+	if(table->columns == NULL){
+		return;
+	}
+	for(size_t col = 0; col < table->cols; ++col){
+		free(table->columns[col].nodes);
+	}
+	free(table->columns);
+	table->columns = NULL;
+}
+
+void table_free(Table *table){
+	table_free_columns(table);
+	free(table->kinds);
+	free(table->values);
+	free(table->refs);
+	free(table->in_progress);
+	free(table->evaluated);
+	free(table->exprs.items);
+	free(table->texts.items);
+	free(table->row_offsets.items);
+	memset(table, 0, sizeof(*table));
+}
+
+bool table_is_dense(const Table *table){
+	return table->row_offsets.count == 0;
+}
+
+size_t table_row_width(const Table *table, size_t row){
+	assert(row < table->rows);
+	if(table_is_dense(table)){
+		return table->cols;
+	}
+	return table->row_offsets.items[row + 1] - table->row_offsets.items[row];
+}
+
+static inline size_t table_slot(const Table *table, size_t row, size_t col){
+	assert(row < table->rows);
+	assert(col < table->cols);
+	if(table_is_dense(table)){
+		return row * table->cols + col;
+	}
+	size_t slot = table->row_offsets.items[row] + col;
+	return slot < table->row_offsets.items[row + 1] ? slot : table->empty_slot;
+}
+
+// Inverse of table_slot for the slots that hold an actual cell
+void table_slot_position(const Table *table, size_t slot, size_t *row, size_t *col){
+	if(table_is_dense(table)){
+		*row = slot / table->cols;
+		*col = slot % table->cols;
+		return;
+	}
+	assert(slot < table->empty_slot);
+	size_t lo = 0;
+	size_t hi = table->rows;
+	while(hi - lo > 1){
+		size_t mid = lo + (hi - lo) / 2;
+		if(table->row_offsets.items[mid] <= slot){
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	*row = lo;
+	*col = slot - table->row_offsets.items[lo];
+}
+
+// Starts the rows up to and including row of a table being loaded
+void table_begin_row(Table *table, size_t row){
+	assert(!table_is_dense(table) || table->rows == 0);
+	if(table->row_offsets.count == 0){
+		da_append(&table->row_offsets, 0);
+	}
+	while(table->rows <= row){
+		da_append(&table->row_offsets, table->slots_count);
+		table->rows += 1;
+	}
+}
+
+size_t table_push_slot(Table *table){
+	if(table->slots_count >= table->slots_capacity){
+		size_t capacity = table->slots_capacity == 0 ? 1024 : table->slots_capacity * 2;
+		table->kinds = realloc(table->kinds, sizeof(uint8_t) * capacity);
+		table->values = realloc(table->values, sizeof(double) * capacity);
+		table->refs = realloc(table->refs, sizeof(uint32_t) * capacity);
+		if(table->kinds == NULL || table->values == NULL || table->refs == NULL){
+			fprintf(stderr,"ERROR: could not allocate memory for the table \n");
+			exit(1);
+		}
+		table->slots_capacity = capacity;
+	}
+	size_t slot = table->slots_count++;
+	table->kinds[slot] = CELL_KIND_TEXT;
+	table->values[slot] = 0.0;
+	table->refs[slot] = 0;
+	return slot;
+}
+
+// Appends an empty cell to the last row of a table being loaded
+size_t table_append_slot(Table *table){
+	size_t slot = table_push_slot(table);
+	table->row_offsets.items[table->rows] = table->slots_count;
+	size_t width = table_row_width(table, table->rows - 1);
+	if(table->cols < width){
+		table->cols = width;
+	}
+	return slot;
+}
+
+// Turns a freshly loaded table into its final layout
+void table_finish(Table *table){
+	size_t cells_count = table->slots_count;
+	if(!table_should_be_dense(table->rows, table->cols, cells_count)){
+		table->empty_slot = table_push_slot(table);
+		table_reset_status(table);
+		return;
+	}
+
+	if(cells_count == table->rows * table->cols){
+		// every row is full, the layouts are the same
+		free(table->row_offsets.items);
+		memset(&table->row_offsets, 0, sizeof(table->row_offsets));
+		table_reset_status(table);
+		return;
+	}
+
+	Table dense = table_alloc(table->rows, table->cols, cells_count);
+	assert(table_is_dense(&dense));
+	for(size_t row = 0; row < table->rows; ++row){
+		size_t src = table->row_offsets.items[row];
+		size_t dst = row * table->cols;
+		size_t width = table_row_width(table, row);
+		memcpy(&dense.kinds[dst], &table->kinds[src], sizeof(uint8_t) * width);
+		memcpy(&dense.values[dst], &table->values[src], sizeof(double) * width);
+		memcpy(&dense.refs[dst], &table->refs[src], sizeof(uint32_t) * width);
+	}
+	dense.row_base = table->row_base;
+	dense.exprs = table->exprs;
+	dense.texts = table->texts;
+	dense.text_base = table->text_base;
+	memset(&table->exprs, 0, sizeof(table->exprs));
+	memset(&table->texts, 0, sizeof(table->texts));
+	table_free(table);
+	*table = dense;
+}
+
+static inline Cell_Kind table_kind_at(const Table *table, size_t slot){
+	return (Cell_Kind) table->kinds[slot];
+}
+
+static inline Cell_Expr *table_expr_at(const Table *table, size_t slot){
+	assert(table->kinds[slot] == CELL_KIND_EXPR);
+	return &table->exprs.items[table->refs[slot]];
+}
+
+static inline String_View table_text_at(const Table *table, size_t slot){
+	assert(table->kinds[slot] == CELL_KIND_TEXT);
+	if(table->refs[slot] == 0){
+		return SV_NULL;
+	}
+	Cell_Text text = table->texts.items[table->refs[slot] - 1];
+	return sv_from_parts(table->text_base + text.offset, text.count);
+}
+
+static inline Eval_Status table_status_at(const Table *table, size_t slot){
+	uint64_t bit = (uint64_t) 1 << (slot % STATUS_WORD_BITS);
+	if(atomic_load_explicit(&table->evaluated[slot / STATUS_WORD_BITS], memory_order_relaxed) & bit){
+		return EVALUATED;
+	}
+	if(atomic_load_explicit(&table->in_progress[slot / STATUS_WORD_BITS], memory_order_relaxed) & bit){
+		return INPROGRESS;
+	}
+	return UNEVALUATED;
+}
+
+static inline void status_word_update(_Atomic uint64_t *word, uint64_t bit, bool set){
+	uint64_t value = atomic_load_explicit(word, memory_order_relaxed);
+	atomic_store_explicit(word, set ? value | bit : value & ~bit, memory_order_relaxed);
+}
+
+// Only for a single thread at a time, see table_set_evaluated_shared
+static inline void table_set_status(Table *table, size_t slot, Eval_Status status){
+	uint64_t bit = (uint64_t) 1 << (slot % STATUS_WORD_BITS);
+	status_word_update(&table->in_progress[slot / STATUS_WORD_BITS], bit, status == INPROGRESS);
+	status_word_update(&table->evaluated[slot / STATUS_WORD_BITS], bit, status == EVALUATED);
+}
+
+// Marks an UNEVALUATED cell as EVALUATED while other threads may be
+// updating the cells sharing the same status word
+static inline void table_set_evaluated_shared(Table *table, size_t slot){
+	uint64_t bit = (uint64_t) 1 << (slot % STATUS_WORD_BITS);
+	atomic_fetch_or_explicit(&table->evaluated[slot / STATUS_WORD_BITS], bit, memory_order_relaxed);
+}
+
+uint32_t table_ref(size_t index){
+	if(index >= UINT32_MAX){
+		fprintf(stderr, "ERROR: too many text or expression cells\n");
+		exit(1);
+	}
+	return (uint32_t) index;
+}
+
+// Copies the text cells out of the input into the arena, after which the
+// input buffer is not referenced by the table anymore and can be freed
+void table_own_text(Table *table, Arena *arena){
+	size_t size = 0;
+	for(size_t i = 0; i < table->texts.count; ++i){
+		size += table->texts.items[i].count;
+	}
+	char *data = arena_alloc(arena, size);
+	size = 0;
+	for(size_t i = 0; i < table->texts.count; ++i){
+		Cell_Text *text = &table->texts.items[i];
+		memcpy(data + size, table->text_base + text->offset, text->count);
+		text->offset = size;
+		size += text->count;
+	}
+	table->text_base = data;
+}
+
+void fprint_alloc_stats(FILE *stream, const char *name, Alloc_Stats stats, size_t input_size){
+	fprintf(stream, "    %-12s %8zu chunks %12zu bytes used %12zu bytes reserved %8.3f bytes per input byte\n",
+			name, stats.chunks, stats.bytes_used, stats.bytes_reserved,
+			input_size > 0 ? (double) stats.bytes_used / (double) input_size : 0.0);
+}
+
+// Phases of a run timed by --stats. Time is charged to a phase with
+// stats_lap, which takes the time since the previous lap, so the phases
+// always add up to the whole run.
+typedef enum {
+	STATS_PHASE_READ = 0,
+	STATS_PHASE_STREAM_PLAN,
+	STATS_PHASE_STREAM,
+	STATS_PHASE_PARSE,
+	STATS_PHASE_INCREMENTAL,
+	STATS_PHASE_RUNS,
+	STATS_PHASE_GRAPH,
+	STATS_PHASE_LEVELS,
+	STATS_PHASE_EVAL,
+	STATS_PHASE_PRINT,
+	STATS_PHASE_SERVE,
+	STATS_PHASE_SAVE,
+	STATS_PHASE_COUNT,
+} Stats_Phase;
+
+static const char *stats_phase_names[STATS_PHASE_COUNT] = {
+	[STATS_PHASE_READ] = "read",
+	[STATS_PHASE_STREAM_PLAN] = "stream_plan",
+	[STATS_PHASE_STREAM] = "stream",
+	[STATS_PHASE_PARSE] = "parse",
+	[STATS_PHASE_INCREMENTAL] = "incremental",
+	[STATS_PHASE_RUNS] = "runs",
+	[STATS_PHASE_GRAPH] = "graph",
+	[STATS_PHASE_LEVELS] = "levels",
+	[STATS_PHASE_EVAL] = "eval",
+	[STATS_PHASE_PRINT] = "print",
+	[STATS_PHASE_SERVE] = "serve",
+	[STATS_PHASE_SAVE] = "save",
+};
+
+typedef struct {
+	double wall;
+	// of all the threads of the process
+	double cpu;
+} Stats_Clock;
+
+typedef struct {
+	Stats_Clock last;
+	Stats_Clock phases[STATS_PHASE_COUNT];
+	bool ran[STATS_PHASE_COUNT];
+	size_t input_size;
+	// deepest stack of the lazy walk, only cells not evaluated before it count
+	size_t max_eval_depth;
+	// longest chain of dependencies, unknown for --stream
+	size_t levels_count;
+	bool levels_known;
+} Stats;
+
+Stats_Clock stats_clock(void){
+	struct timespec wall;
+	struct timespec cpu;
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+	return (Stats_Clock) {
+		.wall = (double) wall.tv_sec + (double) wall.tv_nsec * 1e-9,
+		.cpu = (double) cpu.tv_sec + (double) cpu.tv_nsec * 1e-9,
+	};
+}
+
+void stats_lap(Stats *stats, Stats_Phase phase){
+	Stats_Clock now = stats_clock();
+	stats->phases[phase].wall += now.wall - stats->last.wall;
+	stats->phases[phase].cpu += now.cpu - stats->last.cpu;
+	stats->ran[phase] = true;
+	stats->last = now;
+}
+
+typedef struct {
+	size_t numbers;
+	size_t texts;
+	size_t exprs;
+	size_t empty;
+} Cell_Counts;
+
+Cell_Counts table_count_cells(const Table *table){
+	Cell_Counts counts = {0};
+	for(size_t slot = 0; slot < table->slots_count; ++slot){
+		switch(table_kind_at(table, slot)){
+		case CELL_KIND_NUMBER: counts.numbers += 1; break;
+		case CELL_KIND_EXPR: counts.exprs += 1; break;
+		case CELL_KIND_TEXT: counts.texts += table->refs[slot] != 0; break;
+		}
+	}
+	counts.empty = table->rows * table->cols - counts.numbers - counts.exprs - counts.texts;
+	return counts;
+}
+
+// Prints the report of --stats, or of --stats-json, to stream. A NULL
+// table is a --stream run, which never has the whole table around.
+void fprint_stats(FILE *stream, const Stats *stats, const Table *table, const Expr_Buffer *eb, bool json){
+	struct rusage usage = {0};
+	getrusage(RUSAGE_SELF, &usage);
+	Cell_Counts counts = {0};
+	if(table != NULL){
+		counts = table_count_cells(table);
+	}
+	size_t expr_capacity = eb != NULL ? eb->chunks_count * EXPR_CHUNK_CAPACITY : 0;
+	Stats_Clock total = {0};
+	for(size_t i = 0; i < STATS_PHASE_COUNT; ++i){
+		total.wall += stats->phases[i].wall;
+		total.cpu += stats->phases[i].cpu;
+	}
+
+	if(json){
+		fprintf(stream, "{\"input_bytes\": %zu, \"phases\": {", stats->input_size);
+		const char *sep = "";
+		for(size_t i = 0; i < STATS_PHASE_COUNT; ++i){
+			if(stats->ran[i]){
+				fprintf(stream, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}",
+						sep, stats_phase_names[i], stats->phases[i].wall * 1e3, stats->phases[i].cpu * 1e3);
+				sep = ", ";
+			}
+		}
+		fprintf(stream, "}, \"wall_ms\": %.3f, \"cpu_ms\": %.3f", total.wall * 1e3, total.cpu * 1e3);
+		if(table != NULL){
+			fprintf(stream, ", \"rows\": %zu, \"cols\": %zu, \"cells\": {\"number\": %zu, \"text\": %zu, \"expr\": %zu, \"empty\": %zu}",
+					table->rows, table->cols, counts.numbers, counts.texts, counts.exprs, counts.empty);
+			fprintf(stream, ", \"expr_nodes\": %zu, \"expr_capacity\": %zu", eb->count, expr_capacity);
+		}
+		fprintf(stream, ", \"max_eval_depth\": %zu, \"dependency_levels\": ", stats->max_eval_depth);
+		if(stats->levels_known){
+			fprintf(stream, "%zu", stats->levels_count);
+		} else {
+			fprintf(stream, "null");
+		}
+		fprintf(stream, ", \"peak_rss_kb\": %ld}\n", usage.ru_maxrss);
+		return;
+	}
+
+	fprintf(stream, "Stats for %zu bytes of input:\n", stats->input_size);
+	fprintf(stream, "    %-12s %10s %10s %12s\n", "phase", "wall ms", "cpu ms", "MB/s");
+	for(size_t i = 0; i < STATS_PHASE_COUNT; ++i){
+		if(stats->ran[i]){
+			fprintf(stream, "    %-12s %10.3f %10.3f %12.1f\n", stats_phase_names[i],
+					stats->phases[i].wall * 1e3, stats->phases[i].cpu * 1e3,
+					stats->phases[i].wall > 0 ? (double) stats->input_size / stats->phases[i].wall / (1024.0 * 1024.0) : 0.0);
+		}
+	}
+	fprintf(stream, "    %-12s %10.3f %10.3f\n", "total", total.wall * 1e3, total.cpu * 1e3);
+	if(table != NULL){
+		fprintf(stream, "    cells        %zux%zu: %zu numbers, %zu texts, %zu formulas, %zu empty\n",
+				table->rows, table->cols, counts.numbers, counts.texts, counts.exprs, counts.empty);
+		fprintf(stream, "    expressions  %zu nodes, capacity %zu\n", eb->count, expr_capacity);
+	}
+	if(stats->levels_known){
+		fprintf(stream, "    stack depth  %zu, %zu dependency levels\n", stats->max_eval_depth, stats->levels_count);
+	} else {
+		fprintf(stream, "    stack depth  %zu, n/a dependency levels\n", stats->max_eval_depth);
+	}
+	fprintf(stream, "    peak rss     %ld KB\n", usage.ru_maxrss);
+}
+
+void usage(FILE *stream)
+{
+	fprintf(stream, "Usage: ./minicel [OPTIONS] <input.csv>\n");
+	fprintf(stream, "       Pass `-` as the input to read the table from stdin\n");
+	fprintf(stream, "OPTIONS:\n");
+	fprintf(stream, "    -j, --jobs <N>               amount of threads used for parsing and evaluation\n");
+	fprintf(stream, "                                 (default: amount of CPUs)\n");
+	fprintf(stream, "    -p, --precision <N|shortest> print numbers with N fixed decimals or with the\n");
+	fprintf(stream, "                                 shortest digits that read back exactly (default: shortest)\n");
+	fprintf(stream, "    --incremental <state>        reuse the values of the previous run stored in <state> and only\n");
+	fprintf(stream, "                                 recompute the cells affected by changes, then update <state>\n");
+	fprintf(stream, "    --cache <cache>              load the parsed and evaluated sheet from <cache> if it was made\n");
+	fprintf(stream, "                                 from the current input, otherwise write it there\n");
+	fprintf(stream, "    --serve <socket>             keep the evaluated table in memory and answer `set` and `get`\n");
+	fprintf(stream, "                                 requests on the unix socket <socket> instead of printing it\n");
+	fprintf(stream, "    --watch                      keep running and print the table again every time the input\n");
+	fprintf(stream, "                                 changes, recomputing only the cells affected by the changed lines\n");
+	fprintf(stream, "    --stream                     print the table a block of rows at a time, keeping only the rows\n");
+	fprintf(stream, "                                 formulas look back at in memory. Falls back to loading the whole\n");
+	fprintf(stream, "                                 table if some formula refers to a row below its own\n");
+	fprintf(stream, "    --alloc-stats                print how much memory each allocator used to stderr\n");
+	fprintf(stream, "    --profile <N>                evaluate on one thread timing every formula, then print the N\n");
+	fprintf(stream, "                                 most expensive cells, the ones with the largest fan-in, fan-out\n");
+	fprintf(stream, "                                 and expressions, and the longest chain of dependencies to stderr\n");
+	fprintf(stream, "    --trace <trace>              write the spans of every phase, chunk, level and output flush\n");
+	fprintf(stream, "                                 to <trace> in the Chrome Trace Event format\n");
+	fprintf(stream, "    --stats                      print the time spent in every phase, the amount of cells,\n");
+	fprintf(stream, "                                 expressions, dependency levels and peak memory to stderr\n");
+	fprintf(stream, "    --stats-json                 same as --stats, as a single line of JSON\n");
+}
+
+char *slurp_stream(FILE *f, size_t *size)
+{
+	size_t capacity = 64 * 1024;
+	size_t count = 0;
+	char *buffer = malloc(capacity);
+	if(buffer == NULL){
+		return NULL;
+	}
+
+	for(;;){
+		if(count == capacity){
+			capacity *= 2;
+			char *new_buffer = realloc(buffer, capacity);
+			if(new_buffer == NULL){
+				free(buffer);
+				return NULL;
+			}
+			buffer = new_buffer;
+		}
+		size_t n = fread(buffer + count, 1, capacity - count, f);
+		count += n;
+		if(n == 0){
+			break;
+		}
+	}
+
+	if(ferror(f)){
+		free(buffer);
+		return NULL;
+	}
+
+	if(size){
+		*size = count;
+	}
+	return buffer;
+}
+
+typedef struct {
+	char *data;
+	size_t size;
+	bool mapped;
+} Input_File;
+
+// Maps regular files read-only straight into memory so the table can
+// keep zero-copy String_Views into it. Everything that can't be mapped
+// (stdin, pipes, sockets) goes through the old slurping path.
+bool input_file_open(const char *file_path, Input_File *input)
+{
+	memset(input, 0, sizeof(*input));
+
+	if(strcmp(file_path, "-") == 0){
+		input->data = slurp_stream(stdin, &input->size);
+		return input->data != NULL;
+	}
+
+	int fd = open(file_path, O_RDONLY);
+	if(fd < 0){
+		return false;
+	}
+
+	struct stat statbuf;
+	if(fstat(fd, &statbuf) < 0){
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return false;
+	}
+
+	if(!S_ISREG(statbuf.st_mode)){
+		close(fd);
+		FILE *f = fopen(file_path, "rb");
+		if(f == NULL){
+			return false;
+		}
+		input->data = slurp_stream(f, &input->size);
+		fclose(f);
+		return input->data != NULL;
+	}
+
+	input->size = (size_t) statbuf.st_size;
+	if(input->size == 0){
+		// mmap(2) refuses zero-length mappings
+		close(fd);
+		input->data = malloc(1);
+		return input->data != NULL;
+	}
+
+	void *data = mmap(NULL, input->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int saved_errno = errno;
+	close(fd);
+	if(data == MAP_FAILED){
+		errno = saved_errno;
+		return false;
+	}
+	madvise(data, input->size, MADV_SEQUENTIAL);
+	madvise(data, input->size, MADV_WILLNEED);
+
+	input->data = data;
+	input->mapped = true;
+	return true;
+}
+
+void input_file_close(Input_File *input)
 {
-	fprintf(stream, "Usage: ./minicel <input.csv>\n");
+	if(input->mapped){
+		munmap(input->data, input->size);
+	} else {
+		free(input->data);
+	}
+	memset(input, 0, sizeof(*input));
+}
+
+void parse_cell_from_content(Table *table, size_t slot, String_View cell_value, Expr_Buffer *eb, Code_Buffer *cb){
+	if(sv_starts_with(cell_value,SV("="))) {
+		sv_chop_left(&cell_value, 1);
+		Cell_Expr expr = {0};
+		Expr_Index first = eb->count;
+		expr.index = expr_optimize(eb, parse_expr(&cell_value, eb), first);
+		expr.code = compile_expr_shared(eb, expr.index, cb);
+		table->kinds[slot] = CELL_KIND_EXPR;
+		table->refs[slot] = table_ref(table->exprs.count);
+		da_append(&table->exprs, expr);
+	} else if(sv_strtod(cell_value, &table->values[slot])){
+		table->kinds[slot] = CELL_KIND_NUMBER;
+	} else {
+		table->kinds[slot] = CELL_KIND_TEXT;
+		table->values[slot] = 0.0;
+		table->refs[slot] = table_ref(table->texts.count + 1);
+		Cell_Text text = {
+			.offset = (size_t) (cell_value.data - table->text_base),
+			.count = cell_value.count,
+		};
+		da_append(&table->texts, text);
+	}
+}
+
+void table_put_cell(Table *table, size_t row, size_t col, String_View cell_value, Expr_Buffer *eb, Code_Buffer *cb){
+	table_begin_row(table, row);
+	assert(row + 1 == table->rows && col == table_row_width(table, row) && "cells are loaded in order");
+	size_t slot = table_append_slot(table);
+	parse_cell_from_content(table, slot, sv_trim(cell_value), eb, cb);
+}
+
+#define DELIMS_BLOCK_CAPACITY 4096
+
+// Fills the table in a single pass over the content: every byte is
+// looked at once and the cells are appended row by row as they show up,
+// the caller then picks the layout with table_finish. The positions of
+// all '|' and '\n' are collected a block at a time with sv_index_of_any2
+// so cells are split without rescanning.
+void parse_table_from_content(Table *table, String_View content, Expr_Buffer *eb, Code_Buffer *cb){
+	size_t delims[DELIMS_BLOCK_CAPACITY];
+	table->text_base = content.data;
+
+	size_t row = 0;
+	size_t col = 0;
+	size_t cell_begin = 0;
+	size_t scan_begin = 0;
+	for(;;){
+		String_View rest = sv_from_parts(content.data + scan_begin, content.count - scan_begin);
+		size_t n = sv_index_of_any2(rest, '|', '\n', delims, DELIMS_BLOCK_CAPACITY);
+		for(size_t i = 0; i < n; ++i){
+			size_t end = scan_begin + delims[i];
+			String_View cell_value = sv_from_parts(content.data + cell_begin, end - cell_begin);
+			if(content.data[end] == '|'){
+				table_put_cell(table, row, col, cell_value, eb, cb);
+				col += 1;
+			} else {
+				if(cell_value.count > 0){
+					table_put_cell(table, row, col, cell_value, eb, cb);
+				} else if(col == 0){
+					// empty lines still produce a row
+					table_begin_row(table, row);
+				}
+				MINICEL_PROBE1(parse_row, row);
+				row += 1;
+				col = 0;
+			}
+			cell_begin = end + 1;
+		}
+
+		if(n < DELIMS_BLOCK_CAPACITY){
+			break;
+		}
+		scan_begin += delims[n - 1] + 1;
+	}
+
+	if(cell_begin < content.count){
+		String_View cell_value = sv_from_parts(content.data + cell_begin, content.count - cell_begin);
+		table_put_cell(table, row, col, cell_value, eb, cb);
+	}
+}
+
+// Inputs smaller than that are parsed on the calling thread, spinning up
+// workers for them costs more than it saves.
+#define PARALLEL_PARSE_MIN_SIZE (1024 * 1024)
+
+typedef struct {
+	String_View chunk;
+	Table table;
+	Expr_Buffer eb;
+	Code_Buffer cb;
+	size_t row_offset;
+	size_t expr_offset;
+	size_t operands_offset;
+	size_t code_offset;
+	size_t memo_offset;
+	size_t aggregates_offset;
+	size_t cell_exprs_offset;
+	size_t texts_offset;
+	size_t slots_offset;
+	Table *dst_table;
+	Expr_Buffer *dst_eb;
+	Code_Buffer *dst_cb;
+} Parse_Job;
+
+void *parse_job_parse(void *arg){
+	Parse_Job *job = arg;
+	uint64_t begin = trace_begin();
+	parse_table_from_content(&job->table, job->chunk, &job->eb, &job->cb);
+	trace_end("parse chunk", begin, "rows", job->table.rows);
+	return NULL;
+}
+
+// Moves the rows and the Expr_Buffer shard of a job to their final place,
+// rebasing every Expr_Index by the amount of nodes of the preceding shards
+void *parse_job_merge(void *arg){
+	Parse_Job *job = arg;
+	uint64_t begin = trace_begin();
+
+	for(size_t i = 0; i < job->eb.count; ++i){
+		Expr expr = *expr_buffer_at(&job->eb, i);
+		if(expr.kind == EXPR_KIND_PLUS){
+			expr.as.plus.lhs += job->expr_offset;
+			expr.as.plus.rhs += job->expr_offset;
+		} else if(expr.kind == EXPR_KIND_SUM){
+			expr.as.sum.begin += job->operands_offset;
+		} else if(expr.kind == EXPR_KIND_RANGE){
+			expr.as.range.first += job->expr_offset;
+			expr.as.range.last += job->expr_offset;
+		} else if(expr.kind == EXPR_KIND_AGGREGATE){
+			expr.as.aggregate.range += job->expr_offset;
+		}
+		*expr_buffer_at(job->dst_eb, job->expr_offset + i) = expr;
+	}
+	for(size_t i = 0; i < job->eb.operands.count; ++i){
+		job->dst_eb->operands.items[job->operands_offset + i] = job->eb.operands.items[i] + job->expr_offset;
+	}
+
+	if(!table_is_dense(job->dst_table)){
+		for(size_t row = 0; row < job->table.rows; ++row){
+			job->dst_table->row_offsets.items[job->row_offset + row] = job->table.row_offsets.items[row] + job->slots_offset;
+		}
+	}
+	for(size_t row = 0; row < job->table.rows; ++row){
+		size_t width = table_row_width(&job->table, row);
+		for(size_t col = 0; col < width; ++col){
+			size_t src = job->table.row_offsets.items[row] + col;
+			// the end of the last row is only known once the next job is merged
+			size_t dst = table_is_dense(job->dst_table) ? table_slot(job->dst_table, job->row_offset + row, col) : job->slots_offset + src;
+			uint32_t ref = job->table.refs[src];
+			if(job->table.kinds[src] == CELL_KIND_EXPR){
+				ref += (uint32_t) job->cell_exprs_offset;
+			} else if(job->table.kinds[src] == CELL_KIND_TEXT && ref != 0){
+				ref += (uint32_t) job->texts_offset;
+			}
+			job->dst_table->kinds[dst] = job->table.kinds[src];
+			job->dst_table->values[dst] = job->table.values[src];
+			job->dst_table->refs[dst] = ref;
+		}
+	}
+	for(size_t i = 0; i < job->table.exprs.count; ++i){
+		Cell_Expr expr = job->table.exprs.items[i];
+		expr.index += job->expr_offset;
+		expr.code += job->code_offset;
+		job->dst_table->exprs.items[job->cell_exprs_offset + i] = expr;
+	}
+	size_t text_offset = (size_t) (job->table.text_base - job->dst_table->text_base);
+	for(size_t i = 0; i < job->table.texts.count; ++i){
+		Cell_Text text = job->table.texts.items[i];
+		text.offset += text_offset;
+		job->dst_table->texts.items[job->texts_offset + i] = text;
+	}
+
+	for(size_t i = 0; i < job->cb.count; ++i){
+		Inst inst = job->cb.items[i];
+		if(inst.kind == OP_ENTER && inst.col != 0){
+			inst.col += (uint32_t) job->memo_offset;
+		} else if(inst.kind == OP_AGGREGATE){
+			inst.as.aggregate += job->aggregates_offset;
+		}
+		job->dst_cb->items[job->code_offset + i] = inst;
+	}
+	for(size_t i = 0; i < job->cb.aggregates.count; ++i){
+		job->dst_cb->aggregates.items[job->aggregates_offset + i] = job->cb.aggregates.items[i];
+	}
+
+	trace_end("merge chunk", begin, "rows", job->table.rows);
+	table_free(&job->table);
+	expr_buffer_free(&job->eb);
+	code_buffer_free(&job->cb);
+	return NULL;
+}
+
+void run_parse_jobs(Parse_Job *jobs, size_t jobs_count, void *(*routine)(void*)){
+	pthread_t *threads = malloc(sizeof(pthread_t) * jobs_count);
+	assert(threads != NULL);
+
+	// the last job runs on the calling thread
+	for(size_t i = 0; i + 1 < jobs_count; ++i){
+		int err = pthread_create(&threads[i], NULL, routine, &jobs[i]);
+		if(err != 0){
+			fprintf(stderr, "ERROR: could not create a parsing thread: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	routine(&jobs[jobs_count - 1]);
+	for(size_t i = 0; i + 1 < jobs_count; ++i){
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+}
+
+// Splits the content into jobs_count chunks aligned on '\n' and parses
+// them concurrently, each worker into its own Table and Expr_Buffer
+// shard. Row offsets are a prefix sum of the per-chunk row counts and
+// the shards are then copied side by side into the final table and
+// buffer, again one worker per chunk.
+void parse_table_from_content_parallel(Table *table, String_View content, Expr_Buffer *eb, Code_Buffer *cb, size_t jobs_count){
+	if(jobs_count <= 1 || content.count < PARALLEL_PARSE_MIN_SIZE){
+		uint64_t begin = trace_begin();
+		parse_table_from_content(table, content, eb, cb);
+		table_finish(table);
+		trace_end("parse", begin, "rows", table->rows);
+		return;
+	}
+
+	uint64_t begin_split = trace_begin();
+	Parse_Job *jobs = calloc(jobs_count, sizeof(Parse_Job));
+	assert(jobs != NULL);
+
+	size_t begin = 0;
+	for(size_t i = 0; i < jobs_count; ++i){
+		size_t end = content.count;
+		if(i + 1 < jobs_count){
+			end = content.count / jobs_count * (i + 1);
+			if(end < begin){
+				end = begin;
+			}
+			String_View rest = sv_from_parts(content.data + end, content.count - end);
+			size_t newline = 0;
+			end = sv_index_of(rest, '\n', &newline) ? end + newline + 1 : content.count;
+		}
+		jobs[i].chunk = sv_from_parts(content.data + begin, end - begin);
+		begin = end;
+	}
+	trace_end("split", begin_split, "chunks", jobs_count);
+
+	run_parse_jobs(jobs, jobs_count, parse_job_parse);
+
+	uint64_t begin_alloc = trace_begin();
+	size_t rows = 0;
+	size_t cols = 0;
+	size_t exprs = 0;
+	size_t operands = 0;
+	size_t code = 0;
+	size_t memos = 0;
+	size_t aggregates = 0;
+	size_t cell_exprs = 0;
+	size_t texts = 0;
+	size_t slots = 0;
+	for(size_t i = 0; i < jobs_count; ++i){
+		jobs[i].slots_offset = slots;
+		slots += jobs[i].table.slots_count;
+		jobs[i].memo_offset = memos;
+		memos += jobs[i].cb.memo_count;
+		jobs[i].aggregates_offset = aggregates;
+		aggregates += jobs[i].cb.aggregates.count;
+		jobs[i].cell_exprs_offset = cell_exprs;
+		cell_exprs += jobs[i].table.exprs.count;
+		jobs[i].texts_offset = texts;
+		texts += jobs[i].table.texts.count;
+		jobs[i].row_offset = rows;
+		jobs[i].expr_offset = exprs;
+		jobs[i].operands_offset = operands;
+		jobs[i].code_offset = code;
+		rows += jobs[i].table.rows;
+		exprs += jobs[i].eb.count;
+		operands += jobs[i].eb.operands.count;
+		code += jobs[i].cb.count;
+		if(cols < jobs[i].table.cols){
+			cols = jobs[i].table.cols;
+		}
+	}
+
+	*table = table_alloc(rows, cols, slots);
+	table_ref(cell_exprs);
+	table_ref(texts + 1);
+	table->exprs.count = cell_exprs;
+	table->exprs.capacity = cell_exprs;
+	table->exprs.items = malloc(sizeof(Cell_Expr) * (cell_exprs + 1));
+	table->texts.count = texts;
+	table->texts.capacity = texts;
+	table->texts.items = malloc(sizeof(Cell_Text) * (texts + 1));
+	table->text_base = content.data;
+	if(table->exprs.items == NULL || table->texts.items == NULL){
+		fprintf(stderr,"ERROR: could not allocate memory for the table \n");
+		exit(1);
+	}
+	assert(eb->count == 0 && eb->operands.count == 0);
+	expr_buffer_resize(eb, exprs);
+	free(eb->operands.items);
+	eb->operands.count = operands;
+	eb->operands.capacity = operands;
+	eb->operands.items = operands > 0 ? malloc(sizeof(Expr_Index) * operands) : NULL;
+	if(operands > 0 && eb->operands.items == NULL){
+		fprintf(stderr, "ERROR: could not allocate memory for the expressions\n");
+		exit(1);
+	}
+
+	assert(cb->count == 0 && cb->aggregates.count == 0);
+	free(cb->items);
+	free(cb->aggregates.items);
+	cb->count = code;
+	cb->capacity = code;
+	if(memos > UINT32_MAX){
+		fprintf(stderr, "ERROR: too many shared expressions\n");
+		exit(1);
+	}
+	cb->memo_count = memos;
+	cb->items = code > 0 ? malloc(sizeof(Inst) * code) : NULL;
+	cb->aggregates.count = aggregates;
+	cb->aggregates.capacity = aggregates;
+	cb->aggregates.items = aggregates > 0 ? malloc(sizeof(Aggregate_Ref) * aggregates) : NULL;
+	if((code > 0 && cb->items == NULL) || (aggregates > 0 && cb->aggregates.items == NULL)){
+		fprintf(stderr, "ERROR: could not allocate memory for the compiled expressions\n");
+		exit(1);
+	}
+
+	for(size_t i = 0; i < jobs_count; ++i){
+		jobs[i].dst_table = table;
+		jobs[i].dst_eb = eb;
+		jobs[i].dst_cb = cb;
+	}
+	trace_end("allocate", begin_alloc, NULL, 0);
+	run_parse_jobs(jobs, jobs_count, parse_job_merge);
+
+	free(jobs);
+}
+
+/* int main(){ */
+/* 	String_View source = SV_STATIC("A1+B1 + 80 + C1 + D1"); */
+/*  	Expr *expr = parse_expr(&source); */
+/* 	dump_expr(stdout, expr, 0); */
+/* 	return 0; */
+/* }  */
+typedef struct {
+	size_t row;
+	size_t col;
+	// Range of the cell's dependencies in Eval_Context.deps
+	size_t deps_begin;
+	size_t deps_end;
+	size_t deps_cursor;
+} Eval_Frame;
+
+typedef struct {
+	Eval_Frame *items;
+	size_t count;
+	size_t capacity;
+} Eval_Frames;
+
+typedef struct {
+	Expr_Cell *items;
+	size_t count;
+	size_t capacity;
+} Eval_Deps;
+
+typedef struct {
+	double *items;
+	size_t count;
+	size_t capacity;
+} Eval_Values;
+
+// What --profile records about every slot of the table while
+// table_eval_cell walks it
+typedef struct {
+	// nanoseconds spent collecting the dependencies of the cell and
+	// running its program, not counting the dependencies themselves
+	uint64_t *cost;
+	// formulas on the longest chain of dependencies ending at the cell
+	size_t *depth;
+	// slot + 1 of the dependency that chain goes through, 0 ends it
+	size_t *pred;
+	size_t *fan_in;
+	size_t *fan_out;
+} Eval_Profile;
+
+// Explicit heap allocated stacks of the evaluator. Nothing in evaluation
+// recurses on the C stack, so the depth of dependency chains and of the
+// expressions is only bound by memory. Reuse one context for all the
+// cells of a table to keep the stacks warm.
+typedef struct {
+	Eval_Frames frames;
+	Eval_Deps deps;
+	Expr_Indices exprs;
+	Eval_Values values;
+	// shared by all the contexts of an evaluation pass, may be NULL
+	Eval_Memo *memo;
+	// deepest the frames stack ever got, see --stats
+	size_t max_depth;
+	// NULL unless --profile
+	Eval_Profile *profile;
+	// the contexts of table_eval_levels only read the column indexes,
+	// they are extended between the levels
+	bool columns_read_only;
+} Eval_Context;
+
+void eval_context_free(Eval_Context *ctx){
+	free(ctx->frames.items);
+	free(ctx->deps.items);
+	free(ctx->exprs.items);
+	free(ctx->values.items);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+size_t table_ref_slot(const Table *table, Expr_Cell ref){
+	// rows before row_base wrap around and fail the check as well
+	size_t row = ref.row - table->row_base;
+	if(row >= table->rows || ref.col >= table->cols){
+		fprintf(stderr, "ERROR: CELL(%zu : %zu) is outside of the table\n", ref.row, ref.col);
+		exit(1);
+	}
+	return table_slot(table, row, ref.col);
+}
+
+// Appends every cell referenced by the program to ctx->deps
+void code_collect_cells(const Code_Buffer *cb, size_t code, Eval_Context *ctx){
+	for(const Inst *inst = &cb->items[code]; inst->kind != OP_RETURN; ++inst){
+		if(inst->kind == OP_LOAD_CELL || inst->kind == OP_ADD_CELL){
+			Expr_Cell cell = {.col = inst->col, .row = inst->as.row};
+			da_append(&ctx->deps, cell);
+		}
+	}
+}
+
+bool code_has_aggregates(const Code_Buffer *cb, size_t code){
+	for(const Inst *inst = &cb->items[code]; inst->kind != OP_RETURN; ++inst){
+		if(inst->kind == OP_AGGREGATE){
+			return true;
+		}
+	}
+	return false;
+}
+
+static inline double table_cell_value(Table *table, const Inst *inst){
+	Expr_Cell ref = {.col = inst->col, .row = inst->as.row};
+	size_t slot = table_ref_slot(table, ref);
+	if(table_kind_at(table, slot) == CELL_KIND_TEXT){
+		fprintf(stderr, "ERROR: CELL(%zu : %zu)", ref.row, ref.col);
+		exit(1);
+	}
+	assert(table_kind_at(table, slot) == CELL_KIND_NUMBER || table_status_at(table, slot) == EVALUATED);
+	return table->values[slot];
+}
+
+// Ranges up to this many rows are simply scanned
+#define AGGREGATE_SCAN_ROWS (2 * COLUMN_BLOCK_ROWS)
+
+// Adds the numbers of the rows [begin, end) of the column, text cells
+// are skipped
+void table_scan_column(const Table *table, size_t col, size_t begin, size_t end, Aggregate_Acc *acc){
+	for(size_t row = begin; row < end; ++row){
+		size_t slot = table_slot(table, row, col);
+		if(table_kind_at(table, slot) == CELL_KIND_TEXT){
+			continue;
+		}
+		assert(table_kind_at(table, slot) == CELL_KIND_NUMBER || table_status_at(table, slot) == EVALUATED);
+		double value = table->values[slot];
+		acc->sum += value;
+		acc->count += 1;
+		if(value < acc->min) acc->min = value;
+		if(value > acc->max) acc->max = value;
+	}
+}
+
+void aggregate_acc_merge(Aggregate_Acc *acc, const Aggregate_Acc *other){
+	acc->sum += other->sum;
+	acc->count += other->count;
+	if(other->min < acc->min) acc->min = other->min;
+	if(other->max > acc->max) acc->max = other->max;
+}
+
+Column_Index *table_column_index(Table *table, size_t col){
+	if(table->columns == NULL){
+		table->columns = calloc(table->cols + 1, sizeof(Column_Index));
+		assert(table->columns != NULL && "Buy more RAM lol");
+	}
+	Column_Index *index = &table->columns[col];
+	if(index->nodes == NULL){
+		index->leaves = 1;
+		while(index->leaves < table->rows / COLUMN_BLOCK_ROWS){
+			index->leaves *= 2;
+		}
+		index->nodes = malloc(sizeof(Aggregate_Acc) * 2 * index->leaves);
+		assert(index->nodes != NULL && "Buy more RAM lol");
+		for(size_t node = 0; node < 2 * index->leaves; ++node){
+			index->nodes[node] = (Aggregate_Acc) {.min = INFINITY, .max = -INFINITY};
+		}
+	}
+	return index;
+}
+
+// Fills the leaf of a block whose rows just became final and the nodes
+// above it. The nodes also covering blocks past `done` are wrong until
+// those blocks are added, but ranges never reach them before that.
+void column_index_add_block(const Table *table, Column_Index *index, size_t col, size_t block){
+	size_t node = index->leaves + block;
+	Aggregate_Acc acc = {.min = INFINITY, .max = -INFINITY};
+	table_scan_column(table, col, block * COLUMN_BLOCK_ROWS, (block + 1) * COLUMN_BLOCK_ROWS, &acc);
+	index->nodes[node] = acc;
+	for(node /= 2; node > 0; node /= 2){
+		Aggregate_Acc parent = index->nodes[2 * node];
+		aggregate_acc_merge(&parent, &index->nodes[2 * node + 1]);
+		index->nodes[node] = parent;
+	}
+}
+
+// Folds the rows [done, end) of the column into its index, stopping at
+// the first expression that is not evaluated yet. Returns how far the
+// index got.
+size_t table_column_extend(Table *table, size_t col, size_t end){
+	Column_Index *index = table_column_index(table, col);
+	size_t done = index->done;
+	for(; done < end; ++done){
+		size_t slot = table_slot(table, done, col);
+		if(table_kind_at(table, slot) == CELL_KIND_EXPR && table_status_at(table, slot) != EVALUATED){
+			break;
+		}
+		if((done + 1) % COLUMN_BLOCK_ROWS == 0){
+			column_index_add_block(table, index, col, done / COLUMN_BLOCK_ROWS);
+		}
+	}
+	index->done = done;
+	return done;
+}
+
+// The value of the row changed: the index is cut back to the rows above
+void table_column_touch(Table *table, size_t row, size_t col){
+	if(table->columns != NULL && table->columns[col].done > row){
+		table->columns[col].done = row;
+	}
+}
+
+size_t table_column_done(const Table *table, size_t col){
+	return table->columns != NULL ? table->columns[col].done : 0;
+}
+
+void table_aggregate_column(Table *table, size_t col, size_t begin, size_t end, bool extend, Aggregate_Acc *acc){
+	// the index can't get past a formula above the range that is not
+	// evaluated yet, like when the sheet refers to rows further down
+	if(end - begin <= AGGREGATE_SCAN_ROWS){
+		table_scan_column(table, col, begin, end, acc);
+		return;
+	}
+	size_t done = extend ? table_column_extend(table, col, end) : table_column_done(table, col);
+	if(done < end){
+		table_scan_column(table, col, begin, end, acc);
+		return;
+	}
+	// the whole blocks come from the tree, the rows around them are scanned
+	const Column_Index *index = &table->columns[col];
+	size_t first_block = (begin + COLUMN_BLOCK_ROWS - 1) / COLUMN_BLOCK_ROWS;
+	size_t end_block = end / COLUMN_BLOCK_ROWS;
+	table_scan_column(table, col, begin, first_block * COLUMN_BLOCK_ROWS, acc);
+	size_t left = index->leaves + first_block;
+	size_t right = index->leaves + end_block;
+	for(; left < right; left /= 2, right /= 2){
+		if(left & 1) aggregate_acc_merge(acc, &index->nodes[left++]);
+		if(right & 1) aggregate_acc_merge(acc, &index->nodes[--right]);
+	}
+	table_scan_column(table, col, end_block * COLUMN_BLOCK_ROWS, end, acc);
+}
+
+// Text and missing cells don't count. AVG, MIN and MAX of a range without
+// numbers are 0.
+double table_aggregate(Table *table, const Aggregate_Ref *ref, bool extend){
+	table_ref_slot(table, ref->first);
+	table_ref_slot(table, ref->last);
+	size_t begin = ref->first.row - table->row_base;
+	size_t end = ref->last.row - table->row_base + 1;
+	Aggregate_Acc acc = {.min = INFINITY, .max = -INFINITY};
+	for(size_t col = ref->first.col; col <= ref->last.col; ++col){
+		table_aggregate_column(table, col, begin, end, extend, &acc);
+	}
+	switch(ref->fn){
+	case AGGREGATE_SUM:
+		return acc.sum;
+	case AGGREGATE_AVG:
+		return acc.count > 0 ? acc.sum / (double) acc.count : 0.0;
+	case AGGREGATE_MIN:
+		return acc.count > 0 ? acc.min : 0.0;
+	case AGGREGATE_MAX:
+		return acc.count > 0 ? acc.max : 0.0;
+	case AGGREGATE_COUNT:
+		return (double) acc.count;
+	case COUNT_AGGREGATES:
+		break;
+	}
+	assert(0 && "unreachable");
+	return 0.0;
+}
+
+// Appends the cells in the ranges of the program that still have to be
+// evaluated. The rows a column index covers are final already, so long
+// ranges only look past them.
+void table_collect_range_cells(Table *table, const Code_Buffer *cb, size_t code, Eval_Context *ctx){
+	for(const Inst *inst = &cb->items[code]; inst->kind != OP_RETURN; ++inst){
+		if(inst->kind != OP_AGGREGATE){
+			continue;
+		}
+		const Aggregate_Ref *ref = &cb->aggregates.items[inst->as.aggregate];
+		table_ref_slot(table, ref->first);
+		table_ref_slot(table, ref->last);
+		size_t begin = ref->first.row - table->row_base;
+		size_t end = ref->last.row - table->row_base + 1;
+		for(size_t col = ref->first.col; col <= ref->last.col; ++col){
+			size_t row = begin;
+			if(end - begin > AGGREGATE_SCAN_ROWS){
+				size_t done = table_column_extend(table, col, end);
+				row = done > begin ? done : begin;
+			}
+			for(; row < end; ++row){
+				size_t slot = table_slot(table, row, col);
+				if(table_kind_at(table, slot) == CELL_KIND_EXPR && table_status_at(table, slot) != EVALUATED){
+					Expr_Cell cell = {.col = col, .row = row + table->row_base};
+					da_append(&ctx->deps, cell);
+				}
+			}
+		}
+	}
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// Runs a program whose referenced cells are all evaluated already
+double code_run(Table *table, const Code_Buffer *cb, size_t code, Eval_Context *ctx){
+	const Inst *ip = &cb->items[code];
+	assert(ip->kind == OP_ENTER);
+	size_t memo_slot = ip->col;
+	if(memo_slot != 0 && ctx->memo != NULL){
+		memo_slot -= 1;
+		assert(memo_slot < ctx->memo->count);
+		if(atomic_load_explicit(&ctx->memo->states[memo_slot], memory_order_acquire) == MEMO_READY){
+			return ctx->memo->values[memo_slot];
+		}
+	} else {
+		memo_slot = SIZE_MAX;
+	}
+	if(ctx->values.capacity < ip->as.stack_size){
+		ctx->values.capacity = ip->as.stack_size;
+		ctx->values.items = realloc(ctx->values.items, sizeof(double) * ctx->values.capacity);
+		assert(ctx->values.items != NULL && "Buy more RAM lol");
+	}
+	double *sp = ctx->values.items;
+
+#ifdef VM_COMPUTED_GOTO
+	static void *dispatch[COUNT_OPS] = {
+		[OP_ENTER] = &&label_OP_ENTER,
+		[OP_PUSH_NUMBER] = &&label_OP_PUSH_NUMBER,
+		[OP_LOAD_CELL] = &&label_OP_LOAD_CELL,
+		[OP_ADD] = &&label_OP_ADD,
+		[OP_ADD_NUMBER] = &&label_OP_ADD_NUMBER,
+		[OP_ADD_CELL] = &&label_OP_ADD_CELL,
+		[OP_AGGREGATE] = &&label_OP_AGGREGATE,
+		[OP_RETURN] = &&label_OP_RETURN,
+	};
+#define VM_CASE(op) label_##op:
+#define VM_NEXT() goto *dispatch[(++ip)->kind]
+	goto *dispatch[ip->kind];
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT() ++ip; continue
+	for(;;) switch((Op_Kind) ip->kind){
+#endif
+
+	VM_CASE(OP_ENTER) {
+		VM_NEXT();
+	}
+	VM_CASE(OP_PUSH_NUMBER) {
+		*sp++ = ip->as.number;
+		VM_NEXT();
+	}
+	VM_CASE(OP_LOAD_CELL) {
+		*sp++ = table_cell_value(table, ip);
+		VM_NEXT();
+	}
+	VM_CASE(OP_ADD) {
+		sp -= 1;
+		sp[-1] += sp[0];
+		VM_NEXT();
+	}
+	VM_CASE(OP_ADD_NUMBER) {
+		sp[-1] += ip->as.number;
+		VM_NEXT();
+	}
+	VM_CASE(OP_ADD_CELL) {
+		sp[-1] += table_cell_value(table, ip);
+		VM_NEXT();
+	}
+	VM_CASE(OP_AGGREGATE) {
+		*sp++ = table_aggregate(table, &cb->aggregates.items[ip->as.aggregate], !ctx->columns_read_only);
+		VM_NEXT();
+	}
+	VM_CASE(OP_RETURN) {
+		assert(sp == ctx->values.items + 1);
+		if(memo_slot != SIZE_MAX){
+			unsigned char expected = MEMO_EMPTY;
+			if(atomic_compare_exchange_strong(&ctx->memo->states[memo_slot], &expected, MEMO_WRITING)){
+				ctx->memo->values[memo_slot] = sp[-1];
+				atomic_store_explicit(&ctx->memo->states[memo_slot], MEMO_READY, memory_order_release);
+			}
+		}
+		return sp[-1];
+	}
+
+#ifndef VM_COMPUTED_GOTO
+	default:
+		assert(0 && "unreachable");
+		exit(1);
+	}
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+#ifdef VM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+void fprint_cell_name(FILE *stream, size_t row, size_t col){
+	if(col < 26){
+		fprintf(stream, "%c%zu", (char) ('A' + col), row);
+	} else {
+		fprintf(stream, "CELL(%zu : %zu)", row, col);
+	}
+}
+
+static inline void eval_profile_dep(Eval_Profile *profile, const Table *table, size_t slot, size_t dep_slot){
+	if(table_kind_at(table, dep_slot) == CELL_KIND_EXPR && profile->depth[slot] < profile->depth[dep_slot] + 1){
+		profile->depth[slot] = profile->depth[dep_slot] + 1;
+		profile->pred[slot] = dep_slot + 1;
+	}
+}
+
+// Called once the program of the cell ran, all its dependencies are
+// evaluated by then. The chains go through every cell of the ranges, not
+// just the ones the frame had to wait for. The fan-in counts every cell
+// of the ranges of the formula, the fan-out only counts the cells
+// referenced one by one.
+void eval_profile_frame(Table *table, const Code_Buffer *cb, Eval_Context *ctx, size_t slot, uint64_t start){
+	Eval_Profile *profile = ctx->profile;
+	profile->cost[slot] += monotonic_ns() - start;
+	profile->fan_in[slot] = 0;
+	profile->depth[slot] = 1;
+	for(const Inst *inst = &cb->items[table_expr_at(table, slot)->code]; inst->kind != OP_RETURN; ++inst){
+		if(inst->kind == OP_LOAD_CELL || inst->kind == OP_ADD_CELL){
+			Expr_Cell cell = {.col = inst->col, .row = inst->as.row};
+			size_t dep_slot = table_ref_slot(table, cell);
+			profile->fan_out[dep_slot] += 1;
+			profile->fan_in[slot] += 1;
+			eval_profile_dep(profile, table, slot, dep_slot);
+		} else if(inst->kind == OP_AGGREGATE){
+			const Aggregate_Ref *ref = &cb->aggregates.items[inst->as.aggregate];
+			profile->fan_in[slot] += (ref->last.row - ref->first.row + 1) * (ref->last.col - ref->first.col + 1);
+			for(size_t row = ref->first.row; row <= ref->last.row; ++row){
+				for(size_t col = ref->first.col; col <= ref->last.col; ++col){
+					eval_profile_dep(profile, table, slot, table_slot(table, row - table->row_base, col));
+				}
+			}
+		}
+	}
+}
+
+void eval_push_frame(Table *table, const Code_Buffer *cb, Eval_Context *ctx, size_t row, size_t col){
+	uint64_t start = ctx->profile != NULL ? monotonic_ns() : 0;
+	size_t slot = table_slot(table, row - table->row_base, col);
+	assert(table_kind_at(table, slot) == CELL_KIND_EXPR && table_status_at(table, slot) == UNEVALUATED);
+	table_set_status(table, slot, INPROGRESS);
+
+	Eval_Frame frame = {0};
+	frame.row = row;
+	frame.col = col;
+	frame.deps_begin = ctx->deps.count;
+	code_collect_cells(cb, table_expr_at(table, slot)->code, ctx);
+	table_collect_range_cells(table, cb, table_expr_at(table, slot)->code, ctx);
+	frame.deps_end = ctx->deps.count;
+	frame.deps_cursor = frame.deps_begin;
+	da_append(&ctx->frames, frame);
+	if(ctx->max_depth < ctx->frames.count){
+		ctx->max_depth = ctx->frames.count;
+	}
+	if(ctx->profile != NULL){
+		ctx->profile->cost[slot] += monotonic_ns() - start;
+	}
+}
+
+// Evaluates the cell and everything it depends on. Instead of recursing
+// into referenced cells it keeps a stack of frames driven by the
+// UNEVALUATED/INPROGRESS/EVALUATED states: a frame is only computed once
+// all its dependencies are EVALUATED, and meeting an INPROGRESS cell
+// while walking the dependencies means there is a cycle.
+void table_eval_cell(Table *table, const Code_Buffer *cb, Eval_Context *ctx, size_t row, size_t col){
+	MINICEL_PROBE2(eval_cell_entry, row, col);
+	size_t slot = table_slot(table, row - table->row_base, col);
+	if(table_kind_at(table, slot) != CELL_KIND_EXPR || table_status_at(table, slot) == EVALUATED){
+		MINICEL_PROBE2(eval_cell_exit, row, col);
+		return;
+	}
+	assert(table_status_at(table, slot) == UNEVALUATED);
+
+	ctx->frames.count = 0;
+	ctx->deps.count = 0;
+	eval_push_frame(table, cb, ctx, row, col);
+
+	while(ctx->frames.count > 0){
+		Eval_Frame *frame = &ctx->frames.items[ctx->frames.count - 1];
+
+		if(frame->deps_cursor < frame->deps_end){
+			Expr_Cell dep = ctx->deps.items[frame->deps_cursor++];
+			size_t dep_slot = table_ref_slot(table, dep);
+			if(table_kind_at(table, dep_slot) != CELL_KIND_EXPR || table_status_at(table, dep_slot) == EVALUATED){
+				continue;
+			}
+			if(table_status_at(table, dep_slot) == INPROGRESS){
+				// the cycle is the part of the stack starting at dep
+				size_t start = 0;
+				while(ctx->frames.items[start].row != dep.row || ctx->frames.items[start].col != dep.col){
+					start += 1;
+				}
+				fprintf(stderr,"ERROR: Circular dependency detected: ");
+				for(size_t i = start; i < ctx->frames.count; ++i){
+					fprint_cell_name(stderr, ctx->frames.items[i].row, ctx->frames.items[i].col);
+					fprintf(stderr, " -> ");
+				}
+				fprint_cell_name(stderr, dep.row, dep.col);
+				fprintf(stderr, "\n");
+				exit(1);
+			}
+			eval_push_frame(table, cb, ctx, dep.row, dep.col);
+			continue;
+		}
+
+		size_t frame_slot = table_slot(table, frame->row - table->row_base, frame->col);
+		uint64_t start = ctx->profile != NULL ? monotonic_ns() : 0;
+		table->values[frame_slot] = code_run(table, cb, table_expr_at(table, frame_slot)->code, ctx);
+		table_set_status(table, frame_slot, EVALUATED);
+		if(ctx->profile != NULL){
+			eval_profile_frame(table, cb, ctx, frame_slot, start);
+		}
+		ctx->deps.count = frame->deps_begin;
+		ctx->frames.count -= 1;
+	}
+	MINICEL_PROBE2(eval_cell_exit, row, col);
+}
+
+void eval_profile_init(Eval_Profile *profile, size_t slots_count){
+	profile->cost = calloc(slots_count, sizeof(uint64_t));
+	profile->depth = calloc(slots_count, sizeof(size_t));
+	profile->pred = calloc(slots_count, sizeof(size_t));
+	profile->fan_in = calloc(slots_count, sizeof(size_t));
+	profile->fan_out = calloc(slots_count, sizeof(size_t));
+	assert(profile->cost != NULL && profile->depth != NULL && profile->pred != NULL && "Buy more RAM lol");
+	assert(profile->fan_in != NULL && profile->fan_out != NULL && "Buy more RAM lol");
+}
+
+void eval_profile_free(Eval_Profile *profile){
+	free(profile->cost);
+	free(profile->depth);
+	free(profile->pred);
+	free(profile->fan_in);
+	free(profile->fan_out);
+	memset(profile, 0, sizeof(*profile));
+}
+
+typedef struct {
+	uint64_t key;
+	size_t slot;
+} Profile_Entry;
+
+typedef struct {
+	Profile_Entry *items;
+	size_t count;
+	size_t capacity;
+} Profile_Entries;
+
+// Largest keys first, ties in table order
+int profile_entry_compare(const void *a, const void *b){
+	const Profile_Entry *x = a;
+	const Profile_Entry *y = b;
+	if(x->key != y->key){
+		return x->key > y->key ? -1 : 1;
+	}
+	return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+void fprint_profile_slot_name(FILE *stream, const Table *table, size_t slot){
+	size_t row = 0;
+	size_t col = 0;
+	table_slot_position(table, slot, &row, &col);
+	fprint_cell_name(stream, row + table->row_base, col);
+}
+
+void fprint_profile_cell(FILE *stream, const Table *table, const Expr_Buffer *eb, const Eval_Profile *profile, size_t slot){
+	size_t row = 0;
+	size_t col = 0;
+	table_slot_position(table, slot, &row, &col);
+	char name[64];
+	if(col < 26){
+		snprintf(name, sizeof(name), "%c%zu", (char) ('A' + col), row + table->row_base);
+	} else {
+		snprintf(name, sizeof(name), "CELL(%zu : %zu)", row + table->row_base, col);
+	}
+	bool expr = table_kind_at(table, slot) == CELL_KIND_EXPR;
+	fprintf(stream, "    %-16s %12.3f %8zu %8zu %8zu %8zu\n", name,
+			(double) profile->cost[slot] * 1e-3, profile->fan_in[slot], profile->fan_out[slot],
+			expr ? expr_count_nodes(eb, table_expr_at(table, slot)->index) : 0,
+			profile->depth[slot]);
+}
+
+typedef enum {
+	PROFILE_COST = 0,
+	PROFILE_FAN_IN,
+	PROFILE_FAN_OUT,
+	PROFILE_NODES,
+	PROFILE_METRICS_COUNT,
+} Profile_Metric;
+
+// Zero for the cells the metric doesn't apply to
+uint64_t profile_metric(const Table *table, const Expr_Buffer *eb, const Eval_Profile *profile, Profile_Metric metric, size_t slot){
+	if(metric == PROFILE_FAN_OUT){
+		return profile->fan_out[slot];
+	}
+	if(table_kind_at(table, slot) != CELL_KIND_EXPR){
+		return 0;
+	}
+	switch(metric){
+	case PROFILE_COST: return profile->cost[slot];
+	case PROFILE_FAN_IN: return profile->fan_in[slot];
+	case PROFILE_NODES: return expr_count_nodes(eb, table_expr_at(table, slot)->index);
+	default: return 0;
+	}
+}
+
+// Sorts the entries and prints the first `top` of them
+void fprint_profile_top(FILE *stream, const char *title, Profile_Entries *entries, size_t top,
+		const Table *table, const Expr_Buffer *eb, const Eval_Profile *profile){
+	qsort(entries->items, entries->count, sizeof(Profile_Entry), profile_entry_compare);
+	fprintf(stream, "  %s:\n", title);
+	fprintf(stream, "    %-16s %12s %8s %8s %8s %8s\n", "cell", "cost us", "fan-in", "fan-out", "nodes", "depth");
+	for(size_t i = 0; i < entries->count && i < top; ++i){
+		fprint_profile_cell(stream, table, eb, profile, entries->items[i].slot);
+	}
+}
+
+// Prints the report of --profile: the `top` most expensive formulas, the
+// ones reading the most cells, the cells read the most, the largest
+// expressions and the longest chain of dependencies. Cells in between
+// are left out of chains longer than 2 * top.
+void fprint_profile(FILE *stream, const Table *table, const Expr_Buffer *eb, const Eval_Profile *profile, size_t top){
+	Profile_Entries entries = {0};
+	uint64_t total = 0;
+	size_t formulas = 0;
+	size_t last = 0;
+	for(size_t slot = 0; slot < table->slots_count; ++slot){
+		if(table_kind_at(table, slot) == CELL_KIND_EXPR){
+			total += profile->cost[slot];
+			formulas += 1;
+			if(profile->depth[last] < profile->depth[slot]){
+				last = slot;
+			}
+		}
+	}
+	fprintf(stream, "Profile of %zu formulas, %.3f ms evaluating them:\n", formulas, (double) total * 1e-6);
+
+	static const char *titles[PROFILE_METRICS_COUNT] = {
+		[PROFILE_COST] = "Most expensive",
+		[PROFILE_FAN_IN] = "Largest fan-in",
+		[PROFILE_FAN_OUT] = "Largest fan-out",
+		[PROFILE_NODES] = "Most expression nodes",
+	};
+	for(Profile_Metric metric = 0; metric < PROFILE_METRICS_COUNT; ++metric){
+		entries.count = 0;
+		for(size_t slot = 0; slot < table->slots_count; ++slot){
+			Profile_Entry entry = {
+				.key = profile_metric(table, eb, profile, metric, slot),
+				.slot = slot,
+			};
+			if(entry.key > 0){
+				da_append(&entries, entry);
+			}
+		}
+		fprint_profile_top(stream, titles[metric], &entries, top, table, eb, profile);
+	}
+	free(entries.items);
+
+	if(formulas == 0){
+		return;
+	}
+	// the chain is walked from its end, the first cell goes last
+	size_t count = profile->depth[last];
+	size_t *path = malloc(sizeof(size_t) * count);
+	assert(path != NULL && "Buy more RAM lol");
+	uint64_t path_cost = 0;
+	size_t i = count;
+	for(size_t slot = last + 1; slot != 0; slot = profile->pred[slot - 1]){
+		path[--i] = slot - 1;
+		path_cost += profile->cost[slot - 1];
+	}
+	assert(i == 0);
+	fprintf(stream, "  Critical path: %zu formulas, %.3f ms\n    ", count, (double) path_cost * 1e-6);
+	for(i = 0; i < count; ++i){
+		if(count > 2 * top && i == top){
+			fprintf(stream, "(%zu more) -> ", count - 2 * top);
+			i = count - top;
+		}
+		fprint_profile_slot_name(stream, table, path[i]);
+		fprintf(stream, i + 1 < count ? " -> " : "\n");
+	}
+	free(path);
+}
+
+// Generated sheets fill whole columns with the same formula shifted by
+// row: =A1+B1, =A2+B2, ... Such a run of cells has a template, the
+// program of its first cell: the program of the cell k rows below is the
+// template with every referenced row moved down by k. A run whose cells
+// only read numbers is evaluated a block of rows at a time, with one
+// loop over the columns per instruction of the template instead of a
+// trip through code_run per cell.
+//
+// Only dense tables have columns to loop over, and only runs of sums of
+// cells and numbers that are not evaluated yet are picked up.
+#define FORMULA_RUN_MIN_ROWS 16
+#define FORMULA_RUN_BLOCK_ROWS 1024
+
+typedef struct {
+	size_t col;
+	size_t first_row;
+	size_t count;
+	// offset of the template in the Code_Buffer
+	size_t code;
+} Formula_Run;
+
+typedef struct {
+	Formula_Run *items;
+	size_t count;
+	size_t capacity;
+} Formula_Runs;
+
+// Whether the program is the template moved down by delta rows
+bool code_is_shifted(const Code_Buffer *cb, size_t template, size_t code, size_t delta){
+	const Inst *a = &cb->items[template];
+	const Inst *b = &cb->items[code];
+	assert(a->kind == OP_ENTER && b->kind == OP_ENTER);
+	for(++a, ++b; a->kind != OP_RETURN; ++a, ++b){
+		if(a->kind != b->kind){
+			return false;
+		}
+		switch((Op_Kind) a->kind){
+		case OP_PUSH_NUMBER:
+		case OP_ADD_NUMBER:
+			if(memcmp(&a->as.number, &b->as.number, sizeof(double)) != 0){
+				return false;
+			}
+			break;
+		case OP_LOAD_CELL:
+		case OP_ADD_CELL:
+			if(a->col != b->col || a->as.row + delta != b->as.row){
+				return false;
+			}
+			break;
+		default:
+			return false;
+		}
+	}
+	return b->kind == OP_RETURN;
+}
+
+void formula_runs_close(Formula_Runs *runs, Formula_Run *run){
+	if(run->count >= FORMULA_RUN_MIN_ROWS){
+		da_append(runs, *run);
+	}
+	run->count = 0;
+}
+
+// Walks the table row by row, like the programs were compiled, keeping
+// the run open in every column
+void table_find_runs(Table *table, const Code_Buffer *cb, Formula_Runs *runs){
+	runs->count = 0;
+	if(!table_is_dense(table)){
+		return;
+	}
+	Formula_Run *open = calloc(table->cols + 1, sizeof(Formula_Run));
+	assert(open != NULL && "Buy more RAM lol");
+	for(size_t row = 0; row < table->rows; ++row){
+		for(size_t col = 0; col < table->cols; ++col){
+			size_t slot = table_slot(table, row, col);
+			Formula_Run *run = &open[col];
+			if(table_kind_at(table, slot) != CELL_KIND_EXPR || table_status_at(table, slot) != UNEVALUATED){
+				formula_runs_close(runs, run);
+				continue;
+			}
+			size_t code = table_expr_at(table, slot)->code;
+			if(run->count > 0 && code_is_shifted(cb, run->code, code, row - run->first_row)){
+				run->count += 1;
+				continue;
+			}
+			formula_runs_close(runs, run);
+			run->col = col;
+			run->first_row = row;
+			run->count = 1;
+			run->code = code;
+		}
+	}
+	for(size_t col = 0; col < table->cols; ++col){
+		formula_runs_close(runs, &open[col]);
+	}
+	free(open);
+}
+
+// Whether all the cells the run reads are numbers in the table
+bool table_run_reads_numbers(const Table *table, const Code_Buffer *cb, const Formula_Run *run){
+	for(const Inst *inst = &cb->items[run->code]; inst->kind != OP_RETURN; ++inst){
+		if(inst->kind != OP_LOAD_CELL && inst->kind != OP_ADD_CELL){
+			continue;
+		}
+		// rows before row_base wrap around and fail the check as well
+		size_t first = inst->as.row - table->row_base;
+		if(inst->col >= table->cols || first >= table->rows || table->rows - first < run->count){
+			return false;
+		}
+		for(size_t i = 0; i < run->count; ++i){
+			if(table_kind_at(table, table_slot(table, first + i, inst->col)) != CELL_KIND_NUMBER){
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// The loops of the runs. Nothing in them depends on the previous
+// iteration, so they are left to the vectorizer.
+static void run_fill(double *restrict acc, size_t n, double number){
+	for(size_t i = 0; i < n; ++i){
+		acc[i] = number;
+	}
+}
+
+static void run_add_number(double *restrict acc, size_t n, double number){
+	for(size_t i = 0; i < n; ++i){
+		acc[i] += number;
+	}
+}
+
+static void run_load(double *restrict acc, size_t n, const double *restrict column, size_t stride){
+	for(size_t i = 0; i < n; ++i){
+		acc[i] = column[i * stride];
+	}
+}
+
+static void run_add(double *restrict acc, size_t n, const double *restrict column, size_t stride){
+	for(size_t i = 0; i < n; ++i){
+		acc[i] += column[i * stride];
+	}
+}
+
+// Computes exactly what code_run would, the additions happen in the
+// same order
+void table_eval_run(Table *table, const Code_Buffer *cb, const Formula_Run *run){
+	double acc[FORMULA_RUN_BLOCK_ROWS];
+	size_t stride = table->cols;
+	for(size_t begin = 0; begin < run->count; begin += FORMULA_RUN_BLOCK_ROWS){
+		size_t n = run->count - begin;
+		n = n < FORMULA_RUN_BLOCK_ROWS ? n : FORMULA_RUN_BLOCK_ROWS;
+		for(const Inst *inst = &cb->items[run->code + 1]; inst->kind != OP_RETURN; ++inst){
+			const double *column = NULL;
+			if(inst->kind == OP_LOAD_CELL || inst->kind == OP_ADD_CELL){
+				column = &table->values[table_slot(table, inst->as.row - table->row_base + begin, inst->col)];
+			}
+			switch((Op_Kind) inst->kind){
+			case OP_PUSH_NUMBER:
+				run_fill(acc, n, inst->as.number);
+				break;
+			case OP_LOAD_CELL:
+				run_load(acc, n, column, stride);
+				break;
+			case OP_ADD_NUMBER:
+				run_add_number(acc, n, inst->as.number);
+				break;
+			case OP_ADD_CELL:
+				run_add(acc, n, column, stride);
+				break;
+			default:
+				assert(0 && "unreachable: table_find_runs only takes sums");
+				exit(1);
+			}
+		}
+		for(size_t i = 0; i < n; ++i){
+			size_t slot = table_slot(table, run->first_row + begin + i, run->col);
+			table->values[slot] = acc[i];
+			table_set_status(table, slot, EVALUATED);
+		}
+	}
+}
+
+// Evaluates the runs that only read numbers, everything else is left to
+// table_eval_cell. Returns the amount of cells evaluated.
+size_t table_eval_runs(Table *table, const Code_Buffer *cb, const Formula_Runs *runs){
+	size_t count = 0;
+	for(size_t i = 0; i < runs->count; ++i){
+		if(table_run_reads_numbers(table, cb, &runs->items[i])){
+			table_eval_run(table, cb, &runs->items[i]);
+			count += runs->items[i].count;
+		}
+	}
+	return count;
+}
+
+// Fixed set of workers that run the same task together. The caller takes
+// part as worker 0 and thread_pool_run returns once every worker is done
+// with the task, which also makes all their writes visible to the caller.
+typedef struct {
+	pthread_t *threads;
+	size_t threads_count;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	size_t generation;
+	size_t busy;
+	bool quit;
+	void (*task)(void *arg, size_t worker);
+	void *arg;
+} Thread_Pool;
+
+typedef struct {
+	Thread_Pool *pool;
+	size_t worker;
+} Thread_Pool_Worker;
+
+void *thread_pool_worker(void *arg){
+	Thread_Pool_Worker *self = arg;
+	Thread_Pool *pool = self->pool;
+	size_t generation = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for(;;){
+		while(!pool->quit && pool->generation == generation){
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+		}
+		if(pool->quit){
+			break;
+		}
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->mutex);
+
+		pool->task(pool->arg, self->worker);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->busy -= 1;
+		if(pool->busy == 0){
+			pthread_cond_signal(&pool->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	free(self);
+	return NULL;
+}
+
+void thread_pool_init(Thread_Pool *pool, size_t workers_count){
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	pool->threads_count = workers_count > 0 ? workers_count - 1 : 0;
+	pool->threads = malloc(sizeof(pthread_t) * (pool->threads_count + 1));
+	assert(pool->threads != NULL);
+	for(size_t i = 0; i < pool->threads_count; ++i){
+		Thread_Pool_Worker *worker = malloc(sizeof(Thread_Pool_Worker));
+		assert(worker != NULL);
+		worker->pool = pool;
+		worker->worker = i + 1;
+		int err = pthread_create(&pool->threads[i], NULL, thread_pool_worker, worker);
+		if(err != 0){
+			fprintf(stderr, "ERROR: could not create a worker thread: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+}
+
+size_t thread_pool_workers_count(const Thread_Pool *pool){
+	return pool->threads_count + 1;
+}
+
+void thread_pool_run(Thread_Pool *pool, void (*task)(void *arg, size_t worker), void *arg){
+	pthread_mutex_lock(&pool->mutex);
+	pool->task = task;
+	pool->arg = arg;
+	pool->busy = pool->threads_count;
+	pool->generation += 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	task(arg, 0);
+
+	pthread_mutex_lock(&pool->mutex);
+	while(pool->busy > 0){
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void thread_pool_free(Thread_Pool *pool){
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for(size_t i = 0; i < pool->threads_count; ++i){
+		pthread_join(pool->threads[i], NULL);
+	}
+	free(pool->threads);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+typedef struct {
+	size_t *items;
+	size_t count;
+	size_t capacity;
+} Cell_Ids;
+
+// Dependencies between the EXPR cells of a table. Cells are identified
+// by their slot in the table. Both directions are kept in CSR form: the
+// edges of cell i are edges[offsets[i]..offsets[i + 1]].
+//
+// Long ranges don't get an edge per cell. Every column a long range
+// looks at gets a tree over blocks of COLUMN_BLOCK_ROWS rows, laid out
+// like Column_Index, whose nodes come after the slots: a leaf depends on
+// the cells of its block and an inner node on its two children. A range
+// depends on the fewest nodes covering its whole blocks and on the cells
+// of the blocks it only covers partly.
+//
+// `order` lists the EXPR cells in topological order grouped into levels:
+// cells of level k only depend on cells of levels < k, so all cells of a
+// level can be evaluated concurrently. The tree nodes are not in it.
+typedef struct {
+	size_t nodes_count;
+	size_t *deps_offsets;
+	size_t *deps;
+	size_t *dependents_offsets;
+	size_t *dependents;
+	size_t *order;
+	size_t order_count;
+	size_t *level_offsets;
+	size_t levels_count;
+	// first node of the tree of every column, 0 if it has none
+	size_t *trees;
+	size_t tree_leaves;
+	// the columns with a tree
+	size_t *range_cols;
+	size_t range_cols_count;
+} Dep_Graph;
+
+void dep_graph_free(Dep_Graph *graph){
+	free(graph->deps_offsets);
+	free(graph->deps);
+	free(graph->dependents_offsets);
+	free(graph->dependents);
+	free(graph->order);
+	free(graph->level_offsets);
+	free(graph->trees);
+	free(graph->range_cols);
+	memset(graph, 0, sizeof(*graph));
+}
+
+// Reports one of the cycles among the cells that Kahn's algorithm could
+// not order. Every one of them still has an unordered dependency, so
+// following those from any of them has to come back to an already seen
+// cell eventually.
+void dep_graph_report_cycle(const Dep_Graph *graph, const Table *table, const size_t *indegree){
+	size_t start = 0;
+	while(indegree[start] == 0){
+		start += 1;
+	}
+
+	size_t *seen_at = malloc(sizeof(size_t) * graph->nodes_count);
+	assert(seen_at != NULL);
+	for(size_t i = 0; i < graph->nodes_count; ++i){
+		seen_at[i] = SIZE_MAX;
+	}
+
+	Cell_Ids path = {0};
+	size_t id = start;
+	while(seen_at[id] == SIZE_MAX){
+		seen_at[id] = path.count;
+		da_append(&path, id);
+		size_t next = SIZE_MAX;
+		for(size_t i = graph->deps_offsets[id]; i < graph->deps_offsets[id + 1]; ++i){
+			if(indegree[graph->deps[i]] > 0){
+				next = graph->deps[i];
+				break;
+			}
+		}
+		assert(next != SIZE_MAX);
+		id = next;
+	}
+
+	// the tree nodes on the way are not cells
+	size_t row = 0;
+	size_t col = 0;
+	size_t first = SIZE_MAX;
+	fprintf(stderr, "ERROR: Circular dependency detected: ");
+	for(size_t i = seen_at[id]; i < path.count; ++i){
+		if(path.items[i] >= table->slots_count){
+			continue;
+		}
+		if(first == SIZE_MAX){
+			first = path.items[i];
+		}
+		table_slot_position(table, path.items[i], &row, &col);
+		fprint_cell_name(stderr, table->row_base + row, col);
+		fprintf(stderr, " -> ");
+	}
+	table_slot_position(table, first, &row, &col);
+	fprint_cell_name(stderr, table->row_base + row, col);
+	fprintf(stderr, "\n");
+	free(seen_at);
+	free(path.items);
+}
+
+// Appends what a formula with the range depends on: the cells of the
+// range, or for a long one the tree nodes covering its whole blocks and
+// the cells around them
+void dep_graph_range_deps(const Dep_Graph *graph, const Table *table, const Aggregate_Ref *ref, Cell_Ids *ids){
+	size_t begin = ref->first.row - table->row_base;
+	size_t end = ref->last.row - table->row_base + 1;
+	for(size_t col = ref->first.col; col <= ref->last.col; ++col){
+		size_t skip_begin = end;
+		size_t skip_end = end;
+		if(end - begin > AGGREGATE_SCAN_ROWS){
+			size_t first_block = (begin + COLUMN_BLOCK_ROWS - 1) / COLUMN_BLOCK_ROWS;
+			size_t end_block = end / COLUMN_BLOCK_ROWS;
+			skip_begin = first_block * COLUMN_BLOCK_ROWS;
+			skip_end = end_block * COLUMN_BLOCK_ROWS;
+			size_t tree = graph->trees[col];
+			size_t left = graph->tree_leaves + first_block;
+			size_t right = graph->tree_leaves + end_block;
+			for(; left < right; left /= 2, right /= 2){
+				if(left & 1) da_append(ids, tree + left++);
+				if(right & 1) da_append(ids, tree + --right);
+			}
+		}
+		for(size_t row = begin; row < skip_begin; ++row){
+			da_append(ids, table_slot(table, row, col));
+		}
+		for(size_t row = skip_end; row < end; ++row){
+			da_append(ids, table_slot(table, row, col));
+		}
+	}
+}
+
+// Appends the dependencies of a node, cells or tree nodes, that may
+// not be EXPR cells
+void dep_graph_node_deps(const Dep_Graph *graph, Table *table, const Code_Buffer *cb, Eval_Context *ctx, size_t id, Cell_Ids *ids){
+	if(id < table->slots_count){
+		if(table_kind_at(table, id) != CELL_KIND_EXPR){
+			return;
+		}
+		size_t code = table_expr_at(table, id)->code;
+		ctx->deps.count = 0;
+		code_collect_cells(cb, code, ctx);
+		for(size_t i = 0; i < ctx->deps.count; ++i){
+			da_append(ids, table_ref_slot(table, ctx->deps.items[i]));
+		}
+		for(const Inst *inst = &cb->items[code]; inst->kind != OP_RETURN; ++inst){
+			if(inst->kind == OP_AGGREGATE){
+				dep_graph_range_deps(graph, table, &cb->aggregates.items[inst->as.aggregate], ids);
+			}
+		}
+		return;
+	}
+
+	// the trees all have the same size
+	size_t col = graph->range_cols[(id - table->slots_count) / (2 * graph->tree_leaves)];
+	size_t node = id - graph->trees[col];
+	if(node >= graph->tree_leaves){
+		size_t block = node - graph->tree_leaves;
+		for(size_t row = block * COLUMN_BLOCK_ROWS; row < (block + 1) * COLUMN_BLOCK_ROWS && row < table->rows; ++row){
+			da_append(ids, table_slot(table, row, col));
+		}
+	} else if(node > 0){
+		da_append(ids, graph->trees[col] + 2 * node);
+		da_append(ids, graph->trees[col] + 2 * node + 1);
+	}
+}
+
+// Gives a tree to every column some long range looks at
+void dep_graph_plan_trees(Dep_Graph *graph, Table *table, const Code_Buffer *cb){
+	graph->trees = calloc(table->cols + 1, sizeof(size_t));
+	assert(graph->trees != NULL && "Buy more RAM lol");
+	for(size_t id = 0; id < table->slots_count; ++id){
+		if(table_kind_at(table, id) != CELL_KIND_EXPR){
+			continue;
+		}
+		for(const Inst *inst = &cb->items[table_expr_at(table, id)->code]; inst->kind != OP_RETURN; ++inst){
+			if(inst->kind != OP_AGGREGATE){
+				continue;
+			}
+			const Aggregate_Ref *ref = &cb->aggregates.items[inst->as.aggregate];
+			table_ref_slot(table, ref->first);
+			table_ref_slot(table, ref->last);
+			if(ref->last.row - ref->first.row + 1 > AGGREGATE_SCAN_ROWS){
+				for(size_t col = ref->first.col; col <= ref->last.col; ++col){
+					graph->trees[col] = 1;
+				}
+			}
+		}
+	}
+
+	graph->tree_leaves = 1;
+	while(graph->tree_leaves < table->rows / COLUMN_BLOCK_ROWS){
+		graph->tree_leaves *= 2;
+	}
+	graph->range_cols = malloc(sizeof(size_t) * (table->cols + 1));
+	assert(graph->range_cols != NULL && "Buy more RAM lol");
+	graph->nodes_count = table->slots_count;
+	for(size_t col = 0; col < table->cols; ++col){
+		if(graph->trees[col] != 0){
+			graph->trees[col] = graph->nodes_count;
+			graph->nodes_count += 2 * graph->tree_leaves;
+			graph->range_cols[graph->range_cols_count++] = col;
+		}
+	}
+}
+
+// Whether the node takes part in the order: EXPR cells and tree nodes
+static inline bool dep_graph_is_node(const Table *table, size_t id){
+	return id >= table->slots_count || table_kind_at(table, id) == CELL_KIND_EXPR;
+}
+
+// Returns false after reporting a cycle
+bool dep_graph_build(Dep_Graph *graph, Table *table, const Code_Buffer *cb, Eval_Context *ctx){
+	memset(graph, 0, sizeof(*graph));
+	dep_graph_plan_trees(graph, table, cb);
+	size_t n = graph->nodes_count;
+
+	graph->deps_offsets = calloc(n + 1, sizeof(size_t));
+	graph->dependents_offsets = calloc(n + 1, sizeof(size_t));
+	size_t *indegree = calloc(n + 1, sizeof(size_t));
+	assert(graph->deps_offsets != NULL && graph->dependents_offsets != NULL && indegree != NULL);
+
+	Cell_Ids deps = {0};
+	Cell_Ids ids = {0};
+	size_t exprs_count = 0;
+	for(size_t id = 0; id < n; ++id){
+		if(dep_graph_is_node(table, id)){
+			exprs_count += 1;
+			ids.count = 0;
+			dep_graph_node_deps(graph, table, cb, ctx, id, &ids);
+			for(size_t i = 0; i < ids.count; ++i){
+				size_t dep_id = ids.items[i];
+				if(dep_graph_is_node(table, dep_id)){
+					indegree[id] += 1;
+					da_append(&deps, dep_id);
+					graph->dependents_offsets[dep_id + 1] += 1;
+				}
+			}
+		}
+		graph->deps_offsets[id + 1] = deps.count;
+	}
+	free(ids.items);
+	graph->deps = deps.items;
+
+	for(size_t id = 0; id < n; ++id){
+		graph->dependents_offsets[id + 1] += graph->dependents_offsets[id];
+	}
+	graph->dependents = malloc(sizeof(size_t) * (deps.count + 1));
+	size_t *cursor = malloc(sizeof(size_t) * (n + 1));
+	assert(graph->dependents != NULL && cursor != NULL);
+	memcpy(cursor, graph->dependents_offsets, sizeof(size_t) * (n + 1));
+	for(size_t id = 0; id < n; ++id){
+		for(size_t i = graph->deps_offsets[id]; i < graph->deps_offsets[id + 1]; ++i){
+			graph->dependents[cursor[graph->deps[i]]++] = id;
+		}
+	}
+	free(cursor);
+
+	// Kahn's algorithm, one level at a time
+	graph->order = malloc(sizeof(size_t) * (exprs_count + 1));
+	Cell_Ids level_offsets = {0};
+	assert(graph->order != NULL);
+	for(size_t id = 0; id < n; ++id){
+		if(dep_graph_is_node(table, id) && indegree[id] == 0){
+			graph->order[graph->order_count++] = id;
+		}
+	}
+
+	size_t level_begin = 0;
+	while(level_begin < graph->order_count){
+		da_append(&level_offsets, level_begin);
+		size_t level_end = graph->order_count;
+		for(size_t i = level_begin; i < level_end; ++i){
+			size_t id = graph->order[i];
+			for(size_t j = graph->dependents_offsets[id]; j < graph->dependents_offsets[id + 1]; ++j){
+				size_t dependent = graph->dependents[j];
+				assert(indegree[dependent] > 0);
+				indegree[dependent] -= 1;
+				if(indegree[dependent] == 0){
+					graph->order[graph->order_count++] = dependent;
+				}
+			}
+		}
+		level_begin = level_end;
+	}
+	da_append(&level_offsets, graph->order_count);
+	graph->level_offsets = level_offsets.items;
+	graph->levels_count = level_offsets.count - 1;
+
+	if(graph->order_count < exprs_count){
+		dep_graph_report_cycle(graph, table, indegree);
+		free(indegree);
+		return false;
+	}
+	free(indegree);
+
+	// the tree nodes only order the cells, levels left without cells go
+	size_t count = 0;
+	size_t levels_count = 0;
+	for(size_t k = 0; k < graph->levels_count; ++k){
+		size_t level_begin = count;
+		for(size_t i = graph->level_offsets[k]; i < graph->level_offsets[k + 1]; ++i){
+			if(graph->order[i] < table->slots_count){
+				graph->order[count++] = graph->order[i];
+			}
+		}
+		if(count > level_begin){
+			graph->level_offsets[levels_count++] = level_begin;
+		}
+	}
+	graph->level_offsets[levels_count] = count;
+	graph->levels_count = levels_count;
+	graph->order_count = count;
+	return true;
+}
+
+// Levels smaller than that are evaluated on the calling thread alone
+#define PARALLEL_EVAL_MIN_LEVEL 1024
+#define PARALLEL_EVAL_BATCH 256
+
+typedef struct {
+	Table *table;
+	const Code_Buffer *cb;
+	const Dep_Graph *graph;
+	Eval_Context *ctxs;
+	size_t level_end;
+	atomic_size_t next;
+	// spread over the pool, every worker traces its share
+	bool parallel;
+} Level_Eval;
+
+void level_eval_task(void *arg, size_t worker){
+	Level_Eval *level = arg;
+	Eval_Context *ctx = &level->ctxs[worker];
+	const Dep_Graph *graph = level->graph;
+	uint64_t begin_trace = level->parallel ? trace_begin() : 0;
+	size_t count = 0;
+	for(;;){
+		size_t begin = atomic_fetch_add(&level->next, PARALLEL_EVAL_BATCH);
+		if(begin >= level->level_end){
+			break;
+		}
+		size_t end = begin + PARALLEL_EVAL_BATCH;
+		if(end > level->level_end){
+			end = level->level_end;
+		}
+		for(size_t i = begin; i < end; ++i){
+			size_t slot = graph->order[i];
+			assert(table_kind_at(level->table, slot) == CELL_KIND_EXPR);
+			if(table_status_at(level->table, slot) == EVALUATED){
+				continue;
+			}
+			level->table->values[slot] = code_run(level->table, level->cb, table_expr_at(level->table, slot)->code, ctx);
+			table_set_evaluated_shared(level->table, slot);
+			count += 1;
+		}
+	}
+	if(level->parallel){
+		trace_end("level batch", begin_trace, "cells", count);
+	}
+}
+
+// Evaluates all EXPR cells level by level, spreading every big enough
+// level over the pool
+void table_eval_levels(Table *table, const Code_Buffer *cb, const Dep_Graph *graph, Thread_Pool *pool, Eval_Memo *memo){
+	size_t workers_count = thread_pool_workers_count(pool);
+	Eval_Context *ctxs = calloc(workers_count, sizeof(Eval_Context));
+	assert(ctxs != NULL);
+
+	for(size_t i = 0; i < workers_count; ++i){
+		ctxs[i].memo = memo;
+		ctxs[i].columns_read_only = true;
+	}
+
+	Level_Eval level = {0};
+	level.table = table;
+	level.cb = cb;
+	level.graph = graph;
+	level.ctxs = ctxs;
+	// consecutive small levels are traced as one span
+	uint64_t begin_serial = 0;
+	size_t serial_count = 0;
+	for(size_t k = 0; k < graph->levels_count; ++k){
+		// the ranges of this level only look at cells of the levels before
+		for(size_t i = 0; i < graph->range_cols_count; ++i){
+			table_column_extend(table, graph->range_cols[i], table->rows);
+		}
+		size_t begin = graph->level_offsets[k];
+		level.level_end = graph->level_offsets[k + 1];
+		atomic_store(&level.next, begin);
+		level.parallel = workers_count > 1 && level.level_end - begin >= PARALLEL_EVAL_MIN_LEVEL;
+		if(level.parallel){
+			if(serial_count > 0){
+				trace_end("serial levels", begin_serial, "levels", serial_count);
+				serial_count = 0;
+			}
+			uint64_t begin_level = trace_begin();
+			thread_pool_run(pool, level_eval_task, &level);
+			trace_end("level", begin_level, "cells", level.level_end - begin);
+		} else {
+			if(serial_count == 0){
+				begin_serial = trace_begin();
+			}
+			level_eval_task(&level, 0);
+			serial_count += 1;
+		}
+	}
+	if(serial_count > 0){
+		trace_end("serial levels", begin_serial, "levels", serial_count);
+	}
+
+	for(size_t i = 0; i < workers_count; ++i){
+		eval_context_free(&ctxs[i]);
+	}
+	free(ctxs);
+}
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size){
+	const unsigned char *bytes = data;
+	for(size_t i = 0; i < size; ++i){
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+// Hash of what the cell says rather than how it is spelled, so it can be
+// computed from the parsed table without going back to the input
+uint64_t table_cell_hash(Table *table, Expr_Buffer *eb, Eval_Context *ctx, size_t row, size_t col){
+	size_t slot = table_slot(table, row, col);
+	Cell_Kind kind = table_kind_at(table, slot);
+	uint64_t hash = hash_bytes(FNV_OFFSET_BASIS, &kind, sizeof(kind));
+	switch(kind){
+	case CELL_KIND_TEXT: {
+		String_View text = table_text_at(table, slot);
+		return hash_bytes(hash, text.data, text.count);
+	}
+	case CELL_KIND_NUMBER:
+		return hash_bytes(hash, &table->values[slot], sizeof(double));
+	case CELL_KIND_EXPR:
+		ctx->exprs.count = 0;
+		da_append(&ctx->exprs, table_expr_at(table, slot)->index);
+		while(ctx->exprs.count > 0){
+			Expr *expr = expr_buffer_at(eb, ctx->exprs.items[--ctx->exprs.count]);
+			hash = hash_bytes(hash, &expr->kind, sizeof(expr->kind));
+			switch(expr->kind){
+			case EXPR_KIND_NUMBER:
+				hash = hash_bytes(hash, &expr->as.number, sizeof(expr->as.number));
+				break;
+			case EXPR_KIND_CELL:
+				hash = hash_bytes(hash, &expr->as.cell, sizeof(expr->as.cell));
+				break;
+			case EXPR_KIND_PLUS:
+				da_append(&ctx->exprs, expr->as.plus.rhs);
+				da_append(&ctx->exprs, expr->as.plus.lhs);
+				break;
+			case EXPR_KIND_SUM:
+				hash = hash_bytes(hash, &expr->as.sum.count, sizeof(expr->as.sum.count));
+				for(size_t i = expr->as.sum.count; i > 0; --i){
+					da_append(&ctx->exprs, eb->operands.items[expr->as.sum.begin + i - 1]);
+				}
+				break;
+			case EXPR_KIND_RANGE:
+				da_append(&ctx->exprs, expr->as.range.last);
+				da_append(&ctx->exprs, expr->as.range.first);
+				break;
+			case EXPR_KIND_AGGREGATE:
+				hash = hash_bytes(hash, &expr->as.aggregate.fn, sizeof(expr->as.aggregate.fn));
+				da_append(&ctx->exprs, expr->as.aggregate.range);
+				break;
+			}
+		}
+		return hash;
+	}
+	return hash;
+}
+
+// What an incremental run keeps from the previous one: per cell hashes and
+// values plus who depends on whom. Only the cells the previous table had
+// are kept, numbered like its slots: the cells of row r are
+// row_offsets[r]..row_offsets[r + 1], see table_cells_count.
+typedef struct {
+	size_t rows;
+	size_t cols;
+	size_t *row_offsets;
+	uint64_t *hashes;
+	double *values;
+	size_t *dependents_offsets;
+	size_t *dependents;
+} Eval_State;
+
+#define EVAL_STATE_MAGIC "MCLSTATE"
+#define EVAL_STATE_VERSION 2
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t size_of_size_t;
+	uint64_t rows;
+	uint64_t cols;
+	uint64_t cells_count;
+	uint64_t dependents_count;
+} Eval_State_Header;
+
+// Amount of cells of the table in the incremental state: the whole grid
+// of a dense table, only the cells present in the input of a sparse one.
+// Either way the cell at row, col is table_slot(table, row, col).
+size_t table_cells_count(const Table *table){
+	return table_is_dense(table) ? table->rows * table->cols : table->empty_slot;
+}
+
+// Cell of the state at row, col or SIZE_MAX if the previous table did not
+// have it
+size_t eval_state_cell(const Eval_State *state, size_t row, size_t col){
+	if(row >= state->rows || col >= state->row_offsets[row + 1] - state->row_offsets[row]){
+		return SIZE_MAX;
+	}
+	return state->row_offsets[row] + col;
+}
+
+void eval_state_free(Eval_State *state){
+	free(state->row_offsets);
+	free(state->hashes);
+	free(state->values);
+	free(state->dependents_offsets);
+	free(state->dependents);
+	memset(state, 0, sizeof(*state));
+}
+
+// Returns false if there is no usable state, the caller then evaluates
+// everything from scratch
+bool eval_state_load(const char *file_path, Eval_State *state){
+	memset(state, 0, sizeof(*state));
+
+	FILE *f = fopen(file_path, "rb");
+	if(f == NULL){
+		if(errno != ENOENT){
+			fprintf(stderr, "WARNING: could not open state file %s: %s\n", file_path, strerror(errno));
+		}
+		return false;
+	}
+
+	Eval_State_Header header = {0};
+	if(fread(&header, sizeof(header), 1, f) != 1 ||
+	   memcmp(header.magic, EVAL_STATE_MAGIC, sizeof(header.magic)) != 0 ||
+	   header.version != EVAL_STATE_VERSION ||
+	   header.size_of_size_t != sizeof(size_t) ||
+	   (header.cols > 0 && header.rows > SIZE_MAX / header.cols) ||
+	   header.cells_count > header.rows * header.cols){
+		fprintf(stderr, "WARNING: %s is not a minicel state file, ignoring it\n", file_path);
+		fclose(f);
+		return false;
+	}
+
+	size_t n = header.cells_count;
+	state->rows = header.rows;
+	state->cols = header.cols;
+	state->row_offsets = malloc(sizeof(size_t) * (header.rows + 1));
+	state->hashes = malloc(sizeof(uint64_t) * (n + 1));
+	state->values = malloc(sizeof(double) * (n + 1));
+	state->dependents_offsets = malloc(sizeof(size_t) * (n + 1));
+	state->dependents = malloc(sizeof(size_t) * (header.dependents_count + 1));
+	assert(state->row_offsets && state->hashes && state->values && state->dependents_offsets && state->dependents);
+
+	bool ok = fread(state->row_offsets, sizeof(size_t), header.rows + 1, f) == header.rows + 1 &&
+		fread(state->hashes, sizeof(uint64_t), n, f) == n &&
+		fread(state->values, sizeof(double), n, f) == n &&
+		fread(state->dependents_offsets, sizeof(size_t), n + 1, f) == n + 1 &&
+		fread(state->dependents, sizeof(size_t), header.dependents_count, f) == header.dependents_count;
+	fclose(f);
+
+	ok = ok && state->row_offsets[0] == 0 && state->row_offsets[header.rows] == n;
+	for(size_t row = 0; ok && row < header.rows; ++row){
+		ok = state->row_offsets[row] <= state->row_offsets[row + 1] &&
+			state->row_offsets[row + 1] - state->row_offsets[row] <= header.cols;
+	}
+	for(size_t i = 0; ok && i < n; ++i){
+		ok = state->dependents_offsets[i] <= state->dependents_offsets[i + 1];
+	}
+	ok = ok && state->dependents_offsets[n] == header.dependents_count;
+	for(size_t i = 0; ok && i < header.dependents_count; ++i){
+		ok = state->dependents[i] < n;
+	}
+
+	if(!ok){
+		fprintf(stderr, "WARNING: state file %s is truncated or corrupted, ignoring it\n", file_path);
+		eval_state_free(state);
+		return false;
+	}
+	return true;
+}
+
+// The state keeps the dependents of every cell, EXPR or not, since a
+// changed number has to invalidate the cells using it. hashes are indexed
+// by slot like the cells of the state.
+void eval_state_save(const char *file_path, Table *table, const Code_Buffer *cb, Eval_Context *ctx, const uint64_t *hashes){
+	size_t n = table_cells_count(table);
+	// counting sort of the edges by dependency: the first pass counts them
+	// into offsets[dep + 2], the second one places them using offsets[dep + 1]
+	// as the cursor, leaving the final offsets behind
+	size_t *dependents_offsets = calloc(n + 2, sizeof(size_t));
+	size_t *dependents = NULL;
+	assert(dependents_offsets != NULL);
+	for(size_t pass = 0; pass < 2; ++pass){
+		for(size_t slot = 0; slot < n; ++slot){
+			if(table_kind_at(table, slot) != CELL_KIND_EXPR){
+				continue;
+			}
+			ctx->deps.count = 0;
+			code_collect_cells(cb, table_expr_at(table, slot)->code, ctx);
+			for(size_t i = 0; i < ctx->deps.count; ++i){
+				// the evaluation stops on references to missing cells
+				size_t dep_id = table_slot(table, ctx->deps.items[i].row, ctx->deps.items[i].col);
+				assert(dep_id < n);
+				if(pass == 0){
+					dependents_offsets[dep_id + 2] += 1;
+				} else {
+					dependents[dependents_offsets[dep_id + 1]++] = slot;
+				}
+			}
+		}
+		if(pass == 0){
+			for(size_t id = 0; id < n; ++id){
+				dependents_offsets[id + 2] += dependents_offsets[id + 1];
+			}
+			dependents = malloc(sizeof(size_t) * (dependents_offsets[n + 1] + 1));
+			assert(dependents != NULL);
+		}
+	}
+
+	// write next to the old state and swap, so a crash never leaves a half written file behind
+	size_t tmp_path_size = strlen(file_path) + 5;
+	char *tmp_path = malloc(tmp_path_size);
+	assert(tmp_path != NULL);
+	snprintf(tmp_path, tmp_path_size, "%s.tmp", file_path);
+
+	FILE *f = fopen(tmp_path, "wb");
+	if(f == NULL){
+		fprintf(stderr, "ERROR: could not write state file %s: %s\n", tmp_path, strerror(errno));
+		exit(1);
+	}
+
+	Eval_State_Header header = {0};
+	memcpy(header.magic, EVAL_STATE_MAGIC, sizeof(header.magic));
+	header.version = EVAL_STATE_VERSION;
+	header.size_of_size_t = sizeof(size_t);
+	header.rows = table->rows;
+	header.cols = table->cols;
+	header.cells_count = n;
+	header.dependents_count = dependents_offsets[n];
+	fwrite(&header, sizeof(header), 1, f);
+	for(size_t row = 0; row <= table->rows; ++row){
+		size_t offset = table_is_dense(table) ? row * table->cols : table->row_offsets.items[row];
+		fwrite(&offset, sizeof(offset), 1, f);
+	}
+	fwrite(hashes, sizeof(uint64_t), n, f);
+	for(size_t slot = 0; slot < n; ++slot){
+		double value = table_kind_at(table, slot) == CELL_KIND_EXPR ? table->values[slot] : 0.0;
+		fwrite(&value, sizeof(value), 1, f);
+	}
+	fwrite(dependents_offsets, sizeof(size_t), n + 1, f);
+	fwrite(dependents, sizeof(size_t), header.dependents_count, f);
+	free(dependents_offsets);
+	free(dependents);
+
+	if(ferror(f) || fclose(f) != 0 || rename(tmp_path, file_path) < 0){
+		fprintf(stderr, "ERROR: could not write state file %s: %s\n", file_path, strerror(errno));
+		exit(1);
+	}
+	free(tmp_path);
+}
+
+// Marks every EXPR cell whose input did not change and that does not
+// depend on a changed cell as EVALUATED with the value of the previous
+// run. A cell is changed if its hash differs, if it did not exist before
+// or, for the previous cells, if it is gone now. The dependents of
+// changed cells are found through the previous run's graph: an edge can
+// only be missing from it if the depending cell itself changed. Ranges
+// are not in the graph, so the cells with aggregates always count as
+// changed.
+// Returns the amount of EXPR cells left to evaluate.
+size_t table_apply_eval_state(Table *table, const Code_Buffer *cb, const Eval_State *state, const uint64_t *hashes){
+	size_t n = table_cells_count(table);
+	size_t old_n = state->row_offsets[state->rows];
+	bool *dirty = calloc(n + 1, sizeof(bool));
+	bool *old_dirty = calloc(old_n + 1, sizeof(bool));
+	Cell_Ids queue = {0};
+	assert(dirty != NULL && old_dirty != NULL);
+
+	for(size_t row = 0; row < table->rows; ++row){
+		for(size_t col = 0; col < table_row_width(table, row); ++col){
+			size_t id = table_slot(table, row, col);
+			bool aggregates = table_kind_at(table, id) == CELL_KIND_EXPR &&
+				code_has_aggregates(cb, table_expr_at(table, id)->code);
+			size_t old_id = eval_state_cell(state, row, col);
+			if(old_id == SIZE_MAX){
+				dirty[id] = true;
+			} else if(state->hashes[old_id] != hashes[id] || aggregates){
+				dirty[id] = true;
+				old_dirty[old_id] = true;
+				da_append(&queue, old_id);
+			}
+		}
+	}
+	for(size_t row = 0; row < state->rows; ++row){
+		size_t width = state->row_offsets[row + 1] - state->row_offsets[row];
+		for(size_t col = 0; col < width; ++col){
+			if(row >= table->rows || col >= table_row_width(table, row)){
+				size_t old_id = state->row_offsets[row] + col;
+				old_dirty[old_id] = true;
+				da_append(&queue, old_id);
+			}
+		}
+	}
+
+	while(queue.count > 0){
+		size_t old_id = queue.items[--queue.count];
+		for(size_t i = state->dependents_offsets[old_id]; i < state->dependents_offsets[old_id + 1]; ++i){
+			size_t dependent = state->dependents[i];
+			if(!old_dirty[dependent]){
+				old_dirty[dependent] = true;
+				da_append(&queue, dependent);
+			}
+		}
+	}
+
+	size_t dirty_count = 0;
+	for(size_t row = 0; row < table->rows; ++row){
+		for(size_t col = 0; col < table_row_width(table, row); ++col){
+			size_t slot = table_slot(table, row, col);
+			if(table_kind_at(table, slot) != CELL_KIND_EXPR){
+				continue;
+			}
+			if(!dirty[slot]){
+				size_t old_id = eval_state_cell(state, row, col);
+				if(!old_dirty[old_id]){
+					table->values[slot] = state->values[old_id];
+					table_set_status(table, slot, EVALUATED);
+					continue;
+				}
+			}
+			dirty_count += 1;
+		}
+	}
+
+	free(queue.items);
+	free(old_dirty);
+	free(dirty);
+	return dirty_count;
+}
+
+// Checksum of the sheet cache sections. Same idea as hash_bytes but eats
+// a word at a time, so checking a cache costs about as much as reading it.
+// Data checksummed in pieces has to be split at multiples of 8 bytes.
+uint64_t checksum_bytes(uint64_t hash, const void *data, size_t size){
+	const unsigned char *bytes = data;
+	size_t i = 0;
+	for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)){
+		uint64_t word = 0;
+		memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word) * FNV_PRIME;
+		hash ^= hash >> 32;
+	}
+	return hash_bytes(hash, bytes + i, size - i);
+}
+
+// Compiled sheet cache: the parsed table with its evaluated values, the
+// expressions and the compiled code, laid out exactly like they are in
+// memory. Loading it is a single mmap(2), the arrays of the Table,
+// Expr_Buffer and Code_Buffer point straight into the mapping. That only
+// works between builds that agree on the layout of all the structures,
+// anything else is rejected by the markers in the header.
+#define SHEET_CACHE_MAGIC "MCLSHEET"
+#define SHEET_CACHE_VERSION 2
+#define SHEET_CACHE_ENDIAN_MARK 0x01020304
+#define SHEET_CACHE_ALIGNMENT 64
+
+typedef enum {
+	SHEET_SECTION_KINDS = 0,
+	SHEET_SECTION_VALUES,
+	SHEET_SECTION_REFS,
+	SHEET_SECTION_ROW_OFFSETS,
+	SHEET_SECTION_CELL_EXPRS,
+	SHEET_SECTION_CELL_TEXTS,
+	SHEET_SECTION_TEXT_DATA,
+	// padded to whole chunks, so every chunk of the Expr_Buffer is a
+	// pointer into the mapping
+	SHEET_SECTION_EXPRS,
+	SHEET_SECTION_OPERANDS,
+	SHEET_SECTION_CODE,
+	SHEET_SECTION_AGGREGATES,
+	COUNT_SHEET_SECTIONS,
+} Sheet_Section_Kind;
+
+typedef struct {
+	uint64_t offset;
+	uint64_t size;
+	uint64_t checksum;
+} Sheet_Section;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian_mark;
+	uint32_t size_of_size_t;
+	uint32_t size_of_expr;
+	uint32_t size_of_inst;
+	uint32_t size_of_cell_expr;
+	// the csv the cache was made from
+	uint64_t source_size;
+	int64_t source_mtime_sec;
+	int64_t source_mtime_nsec;
+	uint64_t rows;
+	uint64_t cols;
+	uint64_t empty_slot;
+	uint64_t slots_count;
+	uint64_t row_offsets_count;
+	uint64_t cell_exprs_count;
+	uint64_t cell_texts_count;
+	uint64_t text_size;
+	uint64_t exprs_count;
+	uint64_t operands_count;
+	uint64_t code_count;
+	uint64_t memo_count;
+	uint64_t aggregates_count;
+	Sheet_Section sections[COUNT_SHEET_SECTIONS];
+	// of all the fields above
+	uint64_t checksum;
+} Sheet_Cache_Header;
+
+typedef struct {
+	void *data;
+	size_t size;
+} Sheet_Cache;
+
+typedef struct {
+	FILE *f;
+	uint64_t offset;
+	Sheet_Section *section;
+} Sheet_Cache_Writer;
+
+void sheet_cache_write(Sheet_Cache_Writer *w, const void *data, size_t size){
+	fwrite(data, 1, size, w->f);
+	w->offset += size;
+	if(w->section != NULL){
+		assert(w->section->size % sizeof(uint64_t) == 0);
+		w->section->checksum = checksum_bytes(w->section->checksum, data, size);
+		w->section->size += size;
+	}
+}
+
+void sheet_cache_write_zeros(Sheet_Cache_Writer *w, size_t size){
+	static const char zeros[SHEET_CACHE_ALIGNMENT * 16] = {0};
+	while(size > 0){
+		size_t n = size < sizeof(zeros) ? size : sizeof(zeros);
+		sheet_cache_write(w, zeros, n);
+		size -= n;
+	}
+}
+
+void sheet_cache_begin_section(Sheet_Cache_Writer *w, Sheet_Section *section){
+	w->section = NULL;
+	sheet_cache_write_zeros(w, (SHEET_CACHE_ALIGNMENT - w->offset % SHEET_CACHE_ALIGNMENT) % SHEET_CACHE_ALIGNMENT);
+	section->offset = w->offset;
+	section->size = 0;
+	section->checksum = FNV_OFFSET_BASIS;
+	w->section = section;
+}
+
+uint64_t sheet_cache_header_checksum(const Sheet_Cache_Header *header){
+	return checksum_bytes(FNV_OFFSET_BASIS, header, offsetof(Sheet_Cache_Header, checksum));
+}
+
+// Size of count items or UINT64_MAX if it does not fit, which no section
+// can be as big as
+uint64_t sheet_cache_array_size(uint64_t count, size_t item_size){
+	return count > UINT64_MAX / item_size ? UINT64_MAX : count * item_size;
+}
+
+void sheet_cache_save(const char *file_path, const struct stat *source, const Table *table, const Expr_Buffer *eb, const Code_Buffer *cb){
+	assert(table->row_base == 0);
+
+	// texts are compacted, the cache must not depend on the input
+	Cell_Text *texts = malloc(sizeof(Cell_Text) * (table->texts.count + 1));
+	size_t text_size = 0;
+	assert(texts != NULL);
+	for(size_t i = 0; i < table->texts.count; ++i){
+		texts[i].offset = text_size;
+		texts[i].count = table->texts.items[i].count;
+		text_size += texts[i].count;
+	}
+	char *text_data = malloc(text_size + 1);
+	assert(text_data != NULL);
+	for(size_t i = 0; i < table->texts.count; ++i){
+		memcpy(text_data + texts[i].offset, table->text_base + table->texts.items[i].offset, texts[i].count);
+	}
+
+	size_t tmp_path_size = strlen(file_path) + 5;
+	char *tmp_path = malloc(tmp_path_size);
+	assert(tmp_path != NULL);
+	snprintf(tmp_path, tmp_path_size, "%s.tmp", file_path);
+
+	FILE *f = fopen(tmp_path, "wb");
+	if(f == NULL){
+		fprintf(stderr, "ERROR: could not write sheet cache %s: %s\n", tmp_path, strerror(errno));
+		exit(1);
+	}
+
+	Sheet_Cache_Header header = {0};
+	memcpy(header.magic, SHEET_CACHE_MAGIC, sizeof(header.magic));
+	header.version = SHEET_CACHE_VERSION;
+	header.endian_mark = SHEET_CACHE_ENDIAN_MARK;
+	header.size_of_size_t = sizeof(size_t);
+	header.size_of_expr = sizeof(Expr);
+	header.size_of_inst = sizeof(Inst);
+	header.size_of_cell_expr = sizeof(Cell_Expr);
+	header.source_size = (uint64_t) source->st_size;
+	header.source_mtime_sec = source->st_mtim.tv_sec;
+	header.source_mtime_nsec = source->st_mtim.tv_nsec;
+	header.rows = table->rows;
+	header.cols = table->cols;
+	header.empty_slot = table->empty_slot;
+	header.slots_count = table->slots_count;
+	header.row_offsets_count = table->row_offsets.count;
+	header.cell_exprs_count = table->exprs.count;
+	header.cell_texts_count = table->texts.count;
+	header.text_size = text_size;
+	header.exprs_count = eb->count;
+	header.operands_count = eb->operands.count;
+	header.code_count = cb->count;
+	header.memo_count = cb->memo_count;
+	header.aggregates_count = cb->aggregates.count;
+
+	// the header is written again once the sections are known
+	Sheet_Cache_Writer w = {0};
+	w.f = f;
+	sheet_cache_write(&w, &header, sizeof(header));
+
+	Sheet_Section *sections = header.sections;
+	sheet_cache_begin_section(&w, &sections[SHEET_SECTION_KINDS]);
+	sheet_cache_write(&w, table->kinds, sizeof(uint8_t) * table->slots_count);
+	sheet_cache_begin_section(&w, &sections[SHEET_SECTION_VALUES]);
+	sheet_cache_write(&w, table->values, sizeof(double) * table->slots_count);
+	sheet_cache_begin_section(&w, &sections[SHEET_SECTION_REFS]);
+	sheet_cache_write(&w, table->refs, sizeof(uint32_t) * table->slots_count);
+	sheet_cache_begin_section(&w, &sections[SHEET_SECTION_ROW_OFFSETS]);
+	sheet_cache_write(&w, table->row_offsets.items, sizeof(size_t) * table->row_offsets.count);
+	sheet_cache_begin_section(&w, &sections[SHEET_SECTION_CELL_EXPRS]);
+	sheet_cache_write(&w, table->exprs.items, sizeof(Cell_Expr) * table->exprs.count);
+	sheet_cache_begin_section(&w, &sections[SHEET_SECTION_CELL_TEXTS]);
+	sheet_cache_write(&w, texts, sizeof(Cell_Text) * table->texts.count);
+	sheet_cache_begin_section(&w, &sections[SHEET_SECTION_TEXT_DATA]);
+	sheet_cache_write(&w, text_data, text_size);
+	sheet_cache_begin_section(&w, &sections[SHEET_SECTION_EXPRS]);
+	for(size_t i = 0; i * EXPR_CHUNK_CAPACITY < eb->count; ++i){
+		size_t n = eb->count - i * EXPR_CHUNK_CAPACITY;
+		n = n < EXPR_CHUNK_CAPACITY ? n : EXPR_CHUNK_CAPACITY;
+		sheet_cache_write(&w, eb->chunks[i], sizeof(Expr) * n);
+		sheet_cache_write_zeros(&w, sizeof(Expr) * (EXPR_CHUNK_CAPACITY - n));
+	}
+	sheet_cache_begin_section(&w, &sections[SHEET_SECTION_OPERANDS]);
+	sheet_cache_write(&w, eb->operands.items, sizeof(Expr_Index) * eb->operands.count);
+	sheet_cache_begin_section(&w, &sections[SHEET_SECTION_CODE]);
+	sheet_cache_write(&w, cb->items, sizeof(Inst) * cb->count);
+	sheet_cache_begin_section(&w, &sections[SHEET_SECTION_AGGREGATES]);
+	sheet_cache_write(&w, cb->aggregates.items, sizeof(Aggregate_Ref) * cb->aggregates.count);
+	free(texts);
+	free(text_data);
+
+	header.checksum = sheet_cache_header_checksum(&header);
+	if(fseek(f, 0, SEEK_SET) == 0){
+		fwrite(&header, sizeof(header), 1, f);
+	}
+
+	if(ferror(f) || fclose(f) != 0 || rename(tmp_path, file_path) < 0){
+		fprintf(stderr, "ERROR: could not write sheet cache %s: %s\n", file_path, strerror(errno));
+		exit(1);
+	}
+	free(tmp_path);
+}
+
+// Returns false if there is no cache for this exact source, the caller
+// then parses the csv. The mapping is private and writable so the values
+// can still be updated in place, see table_apply_eval_state.
+bool sheet_cache_load(const char *file_path, const struct stat *source, Sheet_Cache *cache, Table *table, Expr_Buffer *eb, Code_Buffer *cb){
+	memset(cache, 0, sizeof(*cache));
+
+	int fd = open(file_path, O_RDONLY);
+	if(fd < 0){
+		if(errno != ENOENT){
+			fprintf(stderr, "WARNING: could not open sheet cache %s: %s\n", file_path, strerror(errno));
+		}
+		return false;
+	}
+
+	struct stat statbuf;
+	if(fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) || (size_t) statbuf.st_size < sizeof(Sheet_Cache_Header)){
+		fprintf(stderr, "WARNING: %s is not a minicel sheet cache, ignoring it\n", file_path);
+		close(fd);
+		return false;
+	}
+
+	size_t size = (size_t) statbuf.st_size;
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED){
+		fprintf(stderr, "WARNING: could not map sheet cache %s: %s\n", file_path, strerror(errno));
+		return false;
+	}
+
+	const Sheet_Cache_Header *header = data;
+	if(memcmp(header->magic, SHEET_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+	   header->version != SHEET_CACHE_VERSION ||
+	   header->endian_mark != SHEET_CACHE_ENDIAN_MARK ||
+	   header->size_of_size_t != sizeof(size_t) ||
+	   header->size_of_expr != sizeof(Expr) ||
+	   header->size_of_inst != sizeof(Inst) ||
+	   header->size_of_cell_expr != sizeof(Cell_Expr)){
+		fprintf(stderr, "WARNING: %s is not a minicel sheet cache of this build, ignoring it\n", file_path);
+		munmap(data, size);
+		return false;
+	}
+
+	if(header->source_size != (uint64_t) source->st_size ||
+	   header->source_mtime_sec != source->st_mtim.tv_sec ||
+	   header->source_mtime_nsec != source->st_mtim.tv_nsec){
+		// the csv changed since, the cache is simply replaced
+		munmap(data, size);
+		return false;
+	}
+
+	uint64_t expected[COUNT_SHEET_SECTIONS] = {0};
+	size_t exprs_chunks = (header->exprs_count + EXPR_CHUNK_CAPACITY - 1) / EXPR_CHUNK_CAPACITY;
+	expected[SHEET_SECTION_KINDS] = sheet_cache_array_size(header->slots_count, sizeof(uint8_t));
+	expected[SHEET_SECTION_VALUES] = sheet_cache_array_size(header->slots_count, sizeof(double));
+	expected[SHEET_SECTION_REFS] = sheet_cache_array_size(header->slots_count, sizeof(uint32_t));
+	expected[SHEET_SECTION_ROW_OFFSETS] = sheet_cache_array_size(header->row_offsets_count, sizeof(size_t));
+	expected[SHEET_SECTION_CELL_EXPRS] = sheet_cache_array_size(header->cell_exprs_count, sizeof(Cell_Expr));
+	expected[SHEET_SECTION_CELL_TEXTS] = sheet_cache_array_size(header->cell_texts_count, sizeof(Cell_Text));
+	expected[SHEET_SECTION_TEXT_DATA] = header->text_size;
+	expected[SHEET_SECTION_EXPRS] = sheet_cache_array_size(exprs_chunks, sizeof(Expr) * EXPR_CHUNK_CAPACITY);
+	expected[SHEET_SECTION_OPERANDS] = sheet_cache_array_size(header->operands_count, sizeof(Expr_Index));
+	expected[SHEET_SECTION_CODE] = sheet_cache_array_size(header->code_count, sizeof(Inst));
+	expected[SHEET_SECTION_AGGREGATES] = sheet_cache_array_size(header->aggregates_count, sizeof(Aggregate_Ref));
+
+	bool dense = header->row_offsets_count == 0;
+	bool ok = header->checksum == sheet_cache_header_checksum(header) &&
+		(dense ? header->cols == 0 || header->rows == header->slots_count / header->cols
+		 : header->row_offsets_count == header->rows + 1 && header->empty_slot + 1 == header->slots_count);
+	for(size_t i = 0; ok && i < COUNT_SHEET_SECTIONS; ++i){
+		const Sheet_Section *section = &header->sections[i];
+		ok = section->offset % SHEET_CACHE_ALIGNMENT == 0 &&
+			section->size == expected[i] &&
+			section->size <= size && section->offset <= size - section->size &&
+			section->checksum == checksum_bytes(FNV_OFFSET_BASIS, (char*) data + section->offset, section->size);
+	}
+	if(!ok){
+		fprintf(stderr, "WARNING: sheet cache %s is truncated or corrupted, ignoring it\n", file_path);
+		munmap(data, size);
+		return false;
+	}
+
+	char *base = data;
+	const Sheet_Section *sections = header->sections;
+	memset(table, 0, sizeof(*table));
+	table->kinds = (uint8_t*) (base + sections[SHEET_SECTION_KINDS].offset);
+	table->values = (double*) (base + sections[SHEET_SECTION_VALUES].offset);
+	table->refs = (uint32_t*) (base + sections[SHEET_SECTION_REFS].offset);
+	table->exprs.items = (Cell_Expr*) (base + sections[SHEET_SECTION_CELL_EXPRS].offset);
+	table->exprs.count = header->cell_exprs_count;
+	table->exprs.capacity = header->cell_exprs_count;
+	table->texts.items = (Cell_Text*) (base + sections[SHEET_SECTION_CELL_TEXTS].offset);
+	table->texts.count = header->cell_texts_count;
+	table->texts.capacity = header->cell_texts_count;
+	table->text_base = base + sections[SHEET_SECTION_TEXT_DATA].offset;
+	table->rows = header->rows;
+	table->cols = header->cols;
+	table->row_offsets.items = (size_t*) (base + sections[SHEET_SECTION_ROW_OFFSETS].offset);
+	table->row_offsets.count = header->row_offsets_count;
+	table->row_offsets.capacity = header->row_offsets_count;
+	table->empty_slot = header->empty_slot;
+	table->slots_count = header->slots_count;
+	table->slots_capacity = header->slots_count;
+
+	// the values in the cache are final
+	table_reset_status(table);
+	for(size_t i = 0; i * STATUS_WORD_BITS < table->slots_count; ++i){
+		atomic_store_explicit(&table->evaluated[i], UINT64_MAX, memory_order_relaxed);
+	}
+
+	memset(eb, 0, sizeof(*eb));
+	eb->count = header->exprs_count;
+	eb->chunks_count = exprs_chunks;
+	eb->chunks_capacity = exprs_chunks;
+	eb->chunks = malloc(sizeof(Expr*) * (exprs_chunks + 1));
+	assert(eb->chunks != NULL && "Buy more RAM lol");
+	for(size_t i = 0; i < exprs_chunks; ++i){
+		eb->chunks[i] = (Expr*) (base + sections[SHEET_SECTION_EXPRS].offset) + i * EXPR_CHUNK_CAPACITY;
+	}
+	eb->operands.items = (Expr_Index*) (base + sections[SHEET_SECTION_OPERANDS].offset);
+	eb->operands.count = header->operands_count;
+	eb->operands.capacity = header->operands_count;
+
+	memset(cb, 0, sizeof(*cb));
+	cb->items = (Inst*) (base + sections[SHEET_SECTION_CODE].offset);
+	cb->count = header->code_count;
+	cb->capacity = header->code_count;
+	cb->memo_count = header->memo_count;
+	cb->aggregates.items = (Aggregate_Ref*) (base + sections[SHEET_SECTION_AGGREGATES].offset);
+	cb->aggregates.count = header->aggregates_count;
+	cb->aggregates.capacity = header->aggregates_count;
+
+	cache->data = data;
+	cache->size = size;
+	return true;
+}
+
+// Counterpart of sheet_cache_load, frees what the load allocated and
+// unmaps the rest. Nothing loaded from the cache may be grown.
+void sheet_cache_release(Sheet_Cache *cache, Table *table, Expr_Buffer *eb, Code_Buffer *cb){
+	table_free_columns(table);
+	free(table->in_progress);
+	free(table->evaluated);
+	free(eb->chunks);
+	munmap(cache->data, cache->size);
+	memset(table, 0, sizeof(*table));
+	memset(eb, 0, sizeof(*eb));
+	memset(cb, 0, sizeof(*cb));
+	memset(cache, 0, sizeof(*cache));
+}
+
+// Shortest round-trip formatting of doubles (Grisu3, after Florian Loitsch's
+// "Printing Floating-Point Numbers Quickly and Accurately with Integers").
+// Grisu3 finds the shortest and closest digits for about 99.5% of doubles
+// and knows when it failed, the rest goes through dtoa_exact_digits.
+typedef struct {
+	uint64_t f;
+	int e;
+} Diy_Fp;
+
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT (-DP_EXPONENT_BIAS)
+#define DP_EXPONENT_MASK 0x7FF0000000000000ULL
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_HIDDEN_BIT 0x0010000000000000ULL
+
+// 10^k for k = -348, -340, ..., 340 normalized to 64 bit significands
+static const uint64_t cached_powers_f[] = {
+	0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+	0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+	0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+	0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+	0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+	0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+	0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+	0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+	0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+	0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+	0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+	0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+	0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+	0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+	0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+	0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+	0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+	0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+	0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+	0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+	0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+	0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+	0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+	0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+	0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+	0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+	0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+	0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+	0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+
+static const int cached_powers_e[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+	-954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+	-688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+	-422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+	-157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+	109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+	641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+	907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t pow10_u64[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL,
+};
+
+Diy_Fp diy_fp_from_double(double d){
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	int biased_e = (int) ((bits & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+	uint64_t significand = bits & DP_SIGNIFICAND_MASK;
+	Diy_Fp result;
+	if(biased_e != 0){
+		result.f = significand + DP_HIDDEN_BIT;
+		result.e = biased_e - DP_EXPONENT_BIAS;
+	} else {
+		result.f = significand;
+		result.e = DP_MIN_EXPONENT + 1;
+	}
+	return result;
+}
+
+Diy_Fp diy_fp_sub(Diy_Fp a, Diy_Fp b){
+	assert(a.e == b.e && a.f >= b.f);
+	return (Diy_Fp) {a.f - b.f, a.e};
+}
+
+Diy_Fp diy_fp_mul(Diy_Fp a, Diy_Fp b){
+	const uint64_t M32 = 0xFFFFFFFFULL;
+	uint64_t ah = a.f >> 32, al = a.f & M32;
+	uint64_t bh = b.f >> 32, bl = b.f & M32;
+	uint64_t ahbh = ah * bh, ahbl = ah * bl, albh = al * bh, albl = al * bl;
+	uint64_t tmp = (albl >> 32) + (ahbl & M32) + (albh & M32);
+	tmp += 1ULL << 31; // round
+	return (Diy_Fp) {ahbh + (ahbl >> 32) + (albh >> 32) + (tmp >> 32), a.e + b.e + 64};
+}
+
+Diy_Fp diy_fp_normalize(Diy_Fp a){
+	while(!(a.f & (1ULL << 63))){
+		a.f <<= 1;
+		a.e -= 1;
+	}
+	return a;
+}
+
+Diy_Fp diy_fp_normalize_boundary(Diy_Fp a){
+	while(!(a.f & (DP_HIDDEN_BIT << 1))){
+		a.f <<= 1;
+		a.e -= 1;
+	}
+	a.f <<= 64 - DP_SIGNIFICAND_SIZE - 2;
+	a.e -= 64 - DP_SIGNIFICAND_SIZE - 2;
+	return a;
+}
+
+void diy_fp_normalized_boundaries(Diy_Fp v, Diy_Fp *minus, Diy_Fp *plus){
+	Diy_Fp pl = diy_fp_normalize_boundary((Diy_Fp) {(v.f << 1) + 1, v.e - 1});
+	Diy_Fp mi = v.f == DP_HIDDEN_BIT
+		? (Diy_Fp) {(v.f << 2) - 1, v.e - 2}
+		: (Diy_Fp) {(v.f << 1) - 1, v.e - 1};
+	mi.f <<= mi.e - pl.e;
+	mi.e = pl.e;
+	*plus = pl;
+	*minus = mi;
+}
+
+Diy_Fp cached_power_for_binary_exponent(int e, int *K){
+	double dk = (-61 - e) * 0.30102999566398114 + 347;
+	int k = (int) dk;
+	if(dk - k > 0.0){
+		k += 1;
+	}
+	unsigned index = (unsigned) ((k >> 3) + 1);
+	*K = -(-348 + (int) (index << 3));
+	assert(index < sizeof(cached_powers_f) / sizeof(cached_powers_f[0]));
+	return (Diy_Fp) {cached_powers_f[index], cached_powers_e[index]};
+}
+
+// Moves the last digit down towards w while that stays inside the unsafe
+// interval. unit is the error of the scaled values: when a digit within
+// unit of the one picked could be closer, or the result may fall outside
+// of the real interval, the digits can't be trusted and false is returned.
+bool grisu_round_weed(char *buffer, int len, uint64_t distance_too_high_w, uint64_t unsafe_interval,
+					  uint64_t rest, uint64_t ten_kappa, uint64_t unit){
+	uint64_t small_distance = distance_too_high_w - unit;
+	uint64_t big_distance = distance_too_high_w + unit;
+	while(rest < small_distance && unsafe_interval - rest >= ten_kappa &&
+		  (rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance)){
+		buffer[len - 1] -= 1;
+		rest += ten_kappa;
+	}
+	if(rest < big_distance && unsafe_interval - rest >= ten_kappa &&
+	   (rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance)){
+		return false;
+	}
+	return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+int count_decimal_digits_u32(uint32_t n){
+	int digits = 1;
+	while(n >= 10){
+		n /= 10;
+		digits += 1;
+	}
+	return digits;
+}
+
+// Generates the digits of the number in the interval low..high that has
+// the fewest of them, w being the scaled value itself
+bool grisu_digit_gen(Diy_Fp low, Diy_Fp w, Diy_Fp high, char *buffer, int *len, int *kappa){
+	uint64_t unit = 1;
+	Diy_Fp too_low = {low.f - unit, low.e};
+	Diy_Fp too_high = {high.f + unit, high.e};
+	uint64_t unsafe_interval = diy_fp_sub(too_high, too_low).f;
+	Diy_Fp one = {1ULL << -w.e, w.e};
+	uint32_t integrals = (uint32_t) (too_high.f >> -one.e);
+	uint64_t fractionals = too_high.f & (one.f - 1);
+	*kappa = count_decimal_digits_u32(integrals);
+	uint32_t divisor = (uint32_t) pow10_u64[*kappa - 1];
+	*len = 0;
+
+	while(*kappa > 0){
+		buffer[(*len)++] = (char) ('0' + integrals / divisor);
+		integrals %= divisor;
+		*kappa -= 1;
+		uint64_t rest = ((uint64_t) integrals << -one.e) + fractionals;
+		if(rest < unsafe_interval){
+			return grisu_round_weed(buffer, *len, diy_fp_sub(too_high, w).f, unsafe_interval,
+									rest, (uint64_t) divisor << -one.e, unit);
+		}
+		divisor /= 10;
+	}
+
+	for(;;){
+		fractionals *= 10;
+		unit *= 10;
+		unsafe_interval *= 10;
+		buffer[(*len)++] = (char) ('0' + (fractionals >> -one.e));
+		fractionals &= one.f - 1;
+		*kappa -= 1;
+		if(fractionals < unsafe_interval){
+			return grisu_round_weed(buffer, *len, diy_fp_sub(too_high, w).f * unit, unsafe_interval,
+									fractionals, one.f, unit);
+		}
+	}
+}
+
+// Produces the digits of a positive finite value: value = digits * 10^K.
+// Returns false for the few values where the digits might not be the
+// shortest or the closest ones.
+bool grisu3(double value, char *buffer, int *len, int *K){
+	Diy_Fp v = diy_fp_from_double(value);
+	Diy_Fp w_m, w_p;
+	diy_fp_normalized_boundaries(v, &w_m, &w_p);
+
+	Diy_Fp c_mk = cached_power_for_binary_exponent(w_p.e, K);
+	Diy_Fp W = diy_fp_mul(diy_fp_normalize(v), c_mk);
+	Diy_Fp Wp = diy_fp_mul(w_p, c_mk);
+	Diy_Fp Wm = diy_fp_mul(w_m, c_mk);
+	int kappa = 0;
+	bool ok = grisu_digit_gen(Wm, W, Wp, buffer, len, &kappa);
+	*K += kappa;
+	return ok;
+}
+
+int write_exponent(int K, char *buffer){
+	char *begin = buffer;
+	if(K < 0){
+		*buffer++ = '-';
+		K = -K;
+	} else {
+		*buffer++ = '+';
+	}
+	if(K >= 100){
+		*buffer++ = (char) ('0' + K / 100);
+		K %= 100;
+		*buffer++ = (char) ('0' + K / 10);
+		*buffer++ = (char) ('0' + K % 10);
+	} else if(K >= 10){
+		*buffer++ = (char) ('0' + K / 10);
+		*buffer++ = (char) ('0' + K % 10);
+	} else {
+		*buffer++ = (char) ('0' + K);
+	}
+	return (int) (buffer - begin);
+}
+
+// Lays the digits out as 1234, 12.34, 0.001234 or 1.234e+30 depending on
+// where the decimal point ends up
+int grisu_prettify(char *buffer, int length, int k){
+	const int kk = length + k; // 10^(kk-1) <= v < 10^kk
+
+	if(length <= kk && kk <= 21){
+		// 1234e7 -> 12340000000
+		memset(buffer + length, '0', (size_t) (kk - length));
+		return kk;
+	} else if(0 < kk && kk <= 21){
+		// 1234e-2 -> 12.34
+		memmove(buffer + kk + 1, buffer + kk, (size_t) (length - kk));
+		buffer[kk] = '.';
+		return length + 1;
+	} else if(-6 < kk && kk <= 0){
+		// 1234e-6 -> 0.001234
+		const int offset = 2 - kk;
+		memmove(buffer + offset, buffer, (size_t) length);
+		buffer[0] = '0';
+		buffer[1] = '.';
+		memset(buffer + 2, '0', (size_t) (offset - 2));
+		return length + offset;
+	} else if(length == 1){
+		// 1e30
+		buffer[1] = 'e';
+		return 2 + write_exponent(kk - 1, buffer + 2);
+	} else {
+		// 1234e30 -> 1.234e+33
+		memmove(buffer + 2, buffer + 1, (size_t) (length - 1));
+		buffer[1] = '.';
+		buffer[length + 1] = 'e';
+		return length + 2 + write_exponent(kk - 1, buffer + length + 2);
+	}
+}
+
+#define DTOA_BUFFER_CAPACITY 32
+
+// Slow path for what Grisu3 can't decide: the fewest digits printf rounds
+// to that read back as value. Both printf and strtod round correctly, so
+// these are the closest digits of that length too.
+void dtoa_exact_digits(double value, char *buffer, int *len, int *K){
+	char scratch[DTOA_BUFFER_CAPACITY];
+	for(int digits = 1; digits <= 17; ++digits){
+		snprintf(scratch, sizeof(scratch), "%.*e", digits - 1, value);
+		if(strtod(scratch, NULL) == value){
+			break;
+		}
+	}
+	// d.ddde+xx
+	const char *p = scratch;
+	*len = 0;
+	for(; *p != 'e'; ++p){
+		if(*p != '.'){
+			buffer[(*len)++] = *p;
+		}
+	}
+	*K = atoi(p + 1) - (*len - 1);
+}
+
+// Writes the shortest representation of value that reads back as the
+// same double. buffer must hold at least DTOA_BUFFER_CAPACITY bytes.
+// Returns the amount of written bytes, no NUL terminator.
+int dtoa_shortest(double value, char *buffer){
+	if(value != value){
+		memcpy(buffer, "nan", 3);
+		return 3;
+	}
+
+	int n = 0;
+	if(signbit(value)){
+		buffer[n++] = '-';
+		value = -value;
+	}
+
+	if(isinf(value)){
+		memcpy(buffer + n, "inf", 3);
+		return n + 3;
+	}
+
+	if(value == 0.0){
+		buffer[n++] = '0';
+		return n;
+	}
+
+	int length = 0;
+	int K = 0;
+	if(!grisu3(value, buffer + n, &length, &K)){
+		dtoa_exact_digits(value, buffer + n, &length, &K);
+	}
+	return n + grisu_prettify(buffer + n, length, K);
+}
+
+// All table output goes through one big user space buffer that is
+// handed to write(2) whenever it fills up
+#define OUTPUT_CAPACITY (1024 * 1024)
+
+typedef struct {
+	// Negative for an output that keeps everything in memory until the
+	// caller takes it, see --serve
+	int fd;
+	char *items;
+	size_t count;
+	size_t capacity;
+	// Negative precision means shortest round-trip formatting, otherwise
+	// the amount of fixed digits after the decimal point
+	int precision;
+} Output;
+
+void output_flush(Output *out){
+	uint64_t begin = trace_begin();
+	size_t written = 0;
+	while(written < out->count){
+		ssize_t n = write(out->fd, out->items + written, out->count - written);
+		if(n < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			fprintf(stderr, "ERROR: could not write the output: %s\n", strerror(errno));
+			exit(1);
+		}
+		written += (size_t) n;
+	}
+	trace_end("flush", begin, "bytes", written);
+	out->count = 0;
+}
+
+void output_write(Output *out, const char *data, size_t size){
+	if(out->items == NULL){
+		out->capacity = OUTPUT_CAPACITY;
+		out->items = malloc(out->capacity);
+		assert(out->items != NULL);
+	}
+
+	while(size > 0){
+		if(out->count == out->capacity){
+			if(out->fd < 0){
+				out->capacity *= 2;
+				out->items = realloc(out->items, out->capacity);
+				assert(out->items != NULL && "Buy more RAM lol");
+			} else {
+				output_flush(out);
+			}
+		}
+		size_t n = out->capacity - out->count;
+		if(n > size){
+			n = size;
+		}
+		memcpy(out->items + out->count, data, n);
+		out->count += n;
+		data += n;
+		size -= n;
+	}
+}
+
+void output_write_char(Output *out, char c){
+	if(out->count < out->capacity){
+		out->items[out->count++] = c;
+	} else {
+		output_write(out, &c, 1);
+	}
+}
+
+void output_write_number(Output *out, double value){
+	char buffer[DTOA_BUFFER_CAPACITY + 512];
+	int n;
+	if(out->precision < 0){
+		n = dtoa_shortest(value, buffer);
+	} else {
+		n = snprintf(buffer, sizeof(buffer), "%.*f", out->precision, value);
+		if(n < 0 || (size_t) n >= sizeof(buffer)){
+			// only huge values with a big precision get here
+			char *big = NULL;
+			n = snprintf(NULL, 0, "%.*f", out->precision, value);
+			big = malloc((size_t) n + 1);
+			assert(big != NULL);
+			snprintf(big, (size_t) n + 1, "%.*f", out->precision, value);
+			output_write(out, big, (size_t) n);
+			free(big);
+			return;
+		}
+	}
+	output_write(out, buffer, (size_t) n);
+}
+
+void output_free(Output *out){
+	free(out->items);
+	out->items = NULL;
+	out->count = 0;
+	out->capacity = 0;
+}
+
+void output_write_cell(Output *out, Table *table, size_t slot){
+	switch (table_kind_at(table, slot)){
+	case CELL_KIND_TEXT: {
+		String_View text = table_text_at(table, slot);
+		output_write(out, text.data, text.count);
+	} break;
+	case CELL_KIND_NUMBER:
+	case CELL_KIND_EXPR:
+		output_write_number(out, table->values[slot]);
+		break;
+	}
+}
+
+void output_write_table_row(Output *out, Table *table, size_t row){
+	size_t width = table_row_width(table, row);
+	for(size_t col = 0; col < table->cols; ++col){
+		if(col < width){
+			output_write_cell(out, table, table_slot(table, row, col));
+		}
+		if(col < table->cols - 1){
+			output_write_char(out, '|');
+		}
+	}
+	output_write_char(out, '\n');
+}
+
+// Amount of scanned input after which --stream gives the pages back
+#define STREAM_RELEASE_SIZE (1024 * 1024)
+
+// What --stream needs to know about the whole input before printing the
+// first row
+typedef struct {
+	size_t rows;
+	size_t cols;
+	// the farthest a formula looks back from its own row
+	size_t window;
+	// some formula refers to a row below its own
+	bool forward;
+} Stream_Plan;
+
+// Splits the content into rows and cells exactly like
+// parse_table_from_content and parses only the formulas, into a scratch
+// buffer that is reset after every cell. Pages of a mapped input are
+// released as soon as they are scanned.
+Stream_Plan stream_plan_from_content(String_View content, bool mapped){
+	Stream_Plan plan = {0};
+	Expr_Buffer eb = {0};
+	const char *released = content.data;
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	while(content.count > 0){
+		if(mapped && (size_t) (content.data - released) >= STREAM_RELEASE_SIZE){
+			size_t size = (size_t) (content.data - released) / page_size * page_size;
+			madvise((void*) released, size, MADV_DONTNEED);
+			released += size;
+		}
+		String_View line = sv_chop_by_delim(&content, '\n');
+		size_t width = 0;
+		while(line.count > 0){
+			String_View cell_value = sv_chop_by_delim(&line, '|');
+			width += 1;
+
+			cell_value = sv_trim(cell_value);
+			if(!sv_starts_with(cell_value, SV("="))){
+				continue;
+			}
+			sv_chop_left(&cell_value, 1);
+			eb.count = 0;
+			parse_expr(&cell_value, &eb);
+			for(size_t i = 0; i < eb.count; ++i){
+				Expr *expr = expr_buffer_at(&eb, i);
+				if(expr->kind != EXPR_KIND_CELL){
+					continue;
+				}
+				if(expr->as.cell.row > plan.rows){
+					plan.forward = true;
+				} else if(plan.window < plan.rows - expr->as.cell.row){
+					plan.window = plan.rows - expr->as.cell.row;
+				}
+			}
+		}
+		if(plan.cols < width){
+			plan.cols = width;
+		}
+		plan.rows += 1;
+	}
+	expr_buffer_free(&eb);
+	return plan;
+}
+
+// Rows parsed, evaluated and printed at a time by --stream, blocks are
+// never shorter than the window so the rows carried over are parsed again
+// at most once
+#define STREAM_BLOCK_ROWS 4096
+
+// Evaluates and prints the table a block of rows at a time, keeping only
+// the last plan->window rows of the previous block around for the
+// formulas looking back. Those rows are parsed again as the top of the
+// next block and take their values from the previous one, so nothing is
+// evaluated twice and chains of references never reach out of the block.
+//
+// A mapped input is released behind the window as well, so the memory
+// used does not grow with the input at all.
+void stream_table(String_View content, bool mapped, const Stream_Plan *plan, Output *out){
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	assert(!plan->forward);
+
+	Table prev = {0};
+	Cell_Ids row_starts = {0};
+	Formula_Runs runs = {0};
+	size_t base_row = 0;
+	size_t base_offset = 0;
+	size_t next_row = 0;
+	size_t next_offset = 0;
+	size_t block_rows = plan->window > STREAM_BLOCK_ROWS ? plan->window : STREAM_BLOCK_ROWS;
+	while(next_row < plan->rows){
+		uint64_t begin_block = trace_begin();
+		// the block holds rows [base_row, end_row) and prints [next_row, end_row)
+		row_starts.count = 0;
+		size_t offset = base_offset;
+		for(size_t row = base_row; row < next_row; ++row){
+			da_append(&row_starts, offset);
+			String_View rest = sv_from_parts(content.data + offset, content.count - offset);
+			size_t newline = 0;
+			offset = sv_index_of(rest, '\n', &newline) ? offset + newline + 1 : content.count;
+		}
+		assert(offset == next_offset);
+		size_t end_row = next_row;
+		while(end_row < plan->rows && end_row - next_row < block_rows){
+			da_append(&row_starts, offset);
+			String_View rest = sv_from_parts(content.data + offset, content.count - offset);
+			size_t newline = 0;
+			offset = sv_index_of(rest, '\n', &newline) ? offset + newline + 1 : content.count;
+			end_row += 1;
+		}
+
+		Table table = {0};
+		Expr_Buffer eb = {0};
+		Code_Buffer cb = {0};
+		parse_table_from_content(&table, sv_from_parts(content.data + base_offset, offset - base_offset), &eb, &cb);
+		assert(table.rows == end_row - base_row);
+		table.row_base = base_row;
+		table.cols = plan->cols;
+		table_finish(&table);
+
+		for(size_t row = base_row; row < next_row; ++row){
+			size_t width = table_row_width(&table, row - base_row);
+			for(size_t col = 0; col < width; ++col){
+				size_t slot = table_slot(&table, row - base_row, col);
+				if(table_kind_at(&table, slot) == CELL_KIND_EXPR){
+					table.values[slot] = prev.values[table_slot(&prev, row - prev.row_base, col)];
+					table_set_status(&table, slot, EVALUATED);
+				}
+			}
+		}
+		table_free(&prev);
+
+		table_find_runs(&table, &cb, &runs);
+		table_eval_runs(&table, &cb, &runs);
+
+		Eval_Memo memo = {0};
+		eval_memo_init(&memo, cb.memo_count);
+		Eval_Context ctx = {0};
+		ctx.memo = &memo;
+		for(size_t row = next_row; row < end_row; ++row){
+			for(size_t col = 0; col < table_row_width(&table, row - base_row); ++col){
+				table_eval_cell(&table, &cb, &ctx, row, col);
+			}
+			output_write_table_row(out, &table, row - base_row);
+		}
+		output_flush(out);
+		eval_context_free(&ctx);
+		eval_memo_free(&memo);
+		expr_buffer_free(&eb);
+		code_buffer_free(&cb);
+
+		trace_end("stream block", begin_block, "rows", end_row - next_row);
+		prev = table;
+		size_t carry = plan->window < end_row - base_row ? plan->window : end_row - base_row;
+		base_row = end_row - carry;
+		base_offset = carry > 0 ? row_starts.items[base_row - table.row_base] : offset;
+		next_row = end_row;
+		next_offset = offset;
+		if(mapped && base_offset >= page_size){
+			// the mapping is read-only, dropped pages are read back from the file if touched again
+			madvise((void*) content.data, base_offset / page_size * page_size, MADV_DONTNEED);
+		}
+	}
+	table_free(&prev);
+	free(row_starts.items);
+	free(runs.items);
+}
+
+// Requests and responses of --serve are frames of a 4 byte big endian
+// length followed by that many bytes. A request is a list of commands,
+// one per line:
+//
+//     set <cell> <content>   content is parsed like a cell of the csv
+//     get <cell>[:<cell>]    values of the cell or of the range, one row
+//                            per line with the columns separated by |
+//
+// The response holds the output of all the gets in order, plus an
+// `ERROR: ` line for every command that failed. Failed commands don't
+// change anything.
+#define SERVE_MAX_FRAME_SIZE (64 * 1024 * 1024)
+
+// set by SIGINT and SIGTERM
+static volatile sig_atomic_t serve_stopped = 0;
+
+typedef struct {
+	size_t dependent;
+	// index + 1 of the next edge of the same cell, 0 ends the list
+	size_t next;
+} Serve_Edge;
+
+typedef struct {
+	Serve_Edge *items;
+	size_t count;
+	size_t capacity;
+} Serve_Edges;
+
+typedef struct {
+	char *items;
+	size_t count;
+	size_t capacity;
+} Serve_Text;
+
+// The rows of a column some aggregate of the slot looks at. `next` is the
+// next range of the same node of the column tree plus one, 0 ends the list.
+typedef struct {
+	size_t first_row;
+	size_t last_row;
+	size_t slot;
+	size_t next;
+} Serve_Range;
+
+typedef struct {
+	Serve_Range *items;
+	size_t count;
+	size_t capacity;
+} Serve_Ranges;
+
+// The ranges over a column hang on a binary tree over blocks of
+// COLUMN_BLOCK_ROWS rows, laid out like Column_Index. A range is on the
+// fewest nodes covering its whole blocks plus the leaves of the blocks it
+// only covers partly, so the ranges over a row are all on the path from
+// its leaf to the root.
+typedef struct {
+	size_t leaves;
+	size_t *heads;
+	// the last walk over the dependents that went through the node
+	uint32_t *seen;
+} Serve_Column;
+
+// Everything --serve keeps resident between requests. The values stay in
+// the table: a set marks the cells depending on the changed one as
+// UNEVALUATED again and a get evaluates just what it needs with
+// table_eval_cell, everything else keeps the value it had.
+//
+// The dependents of a slot are the CSR range built at startup plus the
+// list of edges added by the formulas set since, plus the formulas with
+// a range over it, found in the tree of its column. Edges and ranges
+// of replaced formulas are never removed, they only cost an extra
+// recomputation.
+typedef struct {
+	Table *table;
+	Expr_Buffer *eb;
+	Code_Buffer *cb;
+	Eval_Context *ctx;
+	Eval_Memo *memo;
+	bool memo_stale;
+	// all the texts of the table, Table.text_base points here
+	Serve_Text text;
+	size_t *dependents_offsets;
+	size_t *dependents;
+	size_t *added_heads;
+	Serve_Edges added;
+	// all the ranges, linked into the trees of the columns
+	Serve_Ranges ranges;
+	Serve_Column *columns;
+	Cell_Ids stack;
+	// visited marks of serve_mark_dependents
+	uint32_t *marks;
+	uint32_t mark;
+	Output response;
+} Server;
+
+void serve_text_append(Serve_Text *text, String_View sv){
+	if(text->count + sv.count > text->capacity){
+		size_t capacity = text->capacity == 0 ? 1024 : text->capacity;
+		while(text->count + sv.count > capacity){
+			capacity *= 2;
+		}
+		text->items = realloc(text->items, capacity);
+		assert(text->items != NULL && "Buy more RAM lol");
+		text->capacity = capacity;
+	}
+	memcpy(text->items + text->count, sv.data, sv.count);
+	text->count += sv.count;
+}
+
+void serve_column_push(Server *server, Serve_Column *column, size_t node, Serve_Range range){
+	range.next = column->heads[node];
+	da_append(&server->ranges, range);
+	column->heads[node] = server->ranges.count;
+}
+
+void serve_column_add(Server *server, size_t col, Serve_Range range){
+	Serve_Column *column = &server->columns[col];
+	if(column->heads == NULL){
+		column->leaves = 1;
+		while(column->leaves * COLUMN_BLOCK_ROWS < server->table->rows){
+			column->leaves *= 2;
+		}
+		column->heads = calloc(2 * column->leaves, sizeof(size_t));
+		column->seen = calloc(2 * column->leaves, sizeof(uint32_t));
+		assert(column->heads != NULL && column->seen != NULL && "Buy more RAM lol");
+	}
+	size_t first_block = range.first_row / COLUMN_BLOCK_ROWS;
+	size_t last_block = range.last_row / COLUMN_BLOCK_ROWS;
+	size_t left = (range.first_row + COLUMN_BLOCK_ROWS - 1) / COLUMN_BLOCK_ROWS;
+	size_t right = (range.last_row + 1) / COLUMN_BLOCK_ROWS;
+	if(range.first_row % COLUMN_BLOCK_ROWS != 0){
+		serve_column_push(server, column, column->leaves + first_block, range);
+	}
+	if((range.last_row + 1) % COLUMN_BLOCK_ROWS != 0 && (last_block != first_block || range.first_row % COLUMN_BLOCK_ROWS == 0)){
+		serve_column_push(server, column, column->leaves + last_block, range);
+	}
+	for(left += column->leaves, right += column->leaves; left < right; left /= 2, right /= 2){
+		if(left & 1) serve_column_push(server, column, left++, range);
+		if(right & 1) serve_column_push(server, column, --right, range);
+	}
+}
+
+void serve_add_ranges(Server *server, size_t slot, size_t code){
+	const Code_Buffer *cb = server->cb;
+	for(const Inst *inst = &cb->items[code]; inst->kind != OP_RETURN; ++inst){
+		if(inst->kind != OP_AGGREGATE){
+			continue;
+		}
+		const Aggregate_Ref *ref = &cb->aggregates.items[inst->as.aggregate];
+		Serve_Range range = {
+			.first_row = ref->first.row,
+			.last_row = ref->last.row,
+			.slot = slot,
+		};
+		for(size_t col = ref->first.col; col <= ref->last.col; ++col){
+			serve_column_add(server, col, range);
+		}
+	}
+}
+
+// Takes over a fully evaluated table
+void server_init(Server *server, Table *table, Expr_Buffer *eb, Code_Buffer *cb, Eval_Context *ctx, Eval_Memo *memo){
+	memset(server, 0, sizeof(*server));
+	server->table = table;
+	server->eb = eb;
+	server->cb = cb;
+	server->ctx = ctx;
+	server->memo = memo;
+	server->response.fd = -1;
+
+	// texts set by clients are appended to the same buffer
+	for(size_t i = 0; i < table->texts.count; ++i){
+		Cell_Text *text = &table->texts.items[i];
+		size_t offset = server->text.count;
+		serve_text_append(&server->text, sv_from_parts(table->text_base + text->offset, text->count));
+		text->offset = offset;
+	}
+	table->text_base = server->text.items;
+
+	// A parallel load merges shards without interning their formulas, so
+	// they go into the table here. That way setting a formula a cell
+	// already has finds the same root, and new formulas share programs.
+	size_t n = table->slots_count;
+	eb->intern_off = false;
+	for(size_t slot = 0; slot < n; ++slot){
+		if(table_kind_at(table, slot) != CELL_KIND_EXPR){
+			continue;
+		}
+		const Cell_Expr *expr = table_expr_at(table, slot);
+		Expr_Index root = expr_buffer_intern_formula(eb, expr->index);
+		code_buffer_reserve_expr_code(cb, root);
+		if(cb->expr_code[root] == 0){
+			cb->expr_code[root] = expr->code + 1;
+		}
+	}
+
+	// counting sort of the edges by dependency, like eval_state_save
+	server->dependents_offsets = calloc(n + 2, sizeof(size_t));
+	assert(server->dependents_offsets != NULL);
+	for(size_t pass = 0; pass < 2; ++pass){
+		for(size_t slot = 0; slot < n; ++slot){
+			if(table_kind_at(table, slot) != CELL_KIND_EXPR){
+				continue;
+			}
+			ctx->deps.count = 0;
+			code_collect_cells(cb, table_expr_at(table, slot)->code, ctx);
+			for(size_t i = 0; i < ctx->deps.count; ++i){
+				size_t dep_slot = table_ref_slot(table, ctx->deps.items[i]);
+				if(pass == 0){
+					server->dependents_offsets[dep_slot + 2] += 1;
+				} else {
+					server->dependents[server->dependents_offsets[dep_slot + 1]++] = slot;
+				}
+			}
+		}
+		if(pass == 0){
+			for(size_t slot = 0; slot < n; ++slot){
+				server->dependents_offsets[slot + 2] += server->dependents_offsets[slot + 1];
+			}
+			server->dependents = malloc(sizeof(size_t) * (server->dependents_offsets[n + 1] + 1));
+			assert(server->dependents != NULL);
+		}
+	}
+
+	server->added_heads = calloc(n + 1, sizeof(size_t));
+	server->marks = calloc(n + 1, sizeof(uint32_t));
+	server->columns = calloc(table->cols + 1, sizeof(Serve_Column));
+	assert(server->added_heads != NULL && server->marks != NULL && server->columns != NULL);
+	for(size_t slot = 0; slot < n; ++slot){
+		if(table_kind_at(table, slot) == CELL_KIND_EXPR){
+			serve_add_ranges(server, slot, table_expr_at(table, slot)->code);
+		}
+	}
+}
+
+void server_free(Server *server){
+	free(server->text.items);
+	free(server->dependents_offsets);
+	free(server->dependents);
+	free(server->added_heads);
+	free(server->added.items);
+	for(size_t col = 0; server->columns != NULL && col < server->table->cols; ++col){
+		free(server->columns[col].heads);
+		free(server->columns[col].seen);
+	}
+	free(server->columns);
+	free(server->ranges.items);
+	free(server->stack.items);
+	free(server->marks);
+	output_free(&server->response);
+	memset(server, 0, sizeof(*server));
+}
+
+// Starts a new walk over the dependents, the marks of the older ones
+// don't count anymore
+void serve_next_mark(Server *server){
+	server->mark += 1;
+	if(server->mark == 0){
+		memset(server->marks, 0, sizeof(uint32_t) * (server->table->slots_count + 1));
+		for(size_t col = 0; col < server->table->cols; ++col){
+			if(server->columns[col].seen != NULL){
+				memset(server->columns[col].seen, 0, sizeof(uint32_t) * 2 * server->columns[col].leaves);
+			}
+		}
+		server->mark = 1;
+	}
+}
+
+// In a walk the ranges of an inner node are only pushed the first time:
+// they cover all the rows below the node, so the walk got all of them
+// already. The nodes above it were seen as well.
+void serve_push_dependents(Server *server, size_t slot, Cell_Ids *ids, bool walk){
+	for(size_t i = server->dependents_offsets[slot]; i < server->dependents_offsets[slot + 1]; ++i){
+		da_append(ids, server->dependents[i]);
+	}
+	for(size_t edge = server->added_heads[slot]; edge != 0; edge = server->added.items[edge - 1].next){
+		da_append(ids, server->added.items[edge - 1].dependent);
+	}
+	size_t row = 0;
+	size_t col = 0;
+	table_slot_position(server->table, slot, &row, &col);
+	const Serve_Column *column = &server->columns[col];
+	if(column->heads == NULL){
+		return;
+	}
+	// the leaf also holds ranges starting or ending inside of its block
+	for(size_t node = column->leaves + row / COLUMN_BLOCK_ROWS; node > 0; node /= 2){
+		if(walk && node < column->leaves){
+			if(column->seen[node] == server->mark){
+				break;
+			}
+			column->seen[node] = server->mark;
+		}
+		for(size_t i = column->heads[node]; i != 0; i = server->ranges.items[i - 1].next){
+			const Serve_Range *range = &server->ranges.items[i - 1];
+			if(range->first_row <= row && row <= range->last_row){
+				da_append(ids, range->slot);
+			}
+		}
+	}
+}
+
+void serve_add_edge(Server *server, size_t dep_slot, size_t slot){
+	Serve_Edge edge = {
+		.dependent = slot,
+		.next = server->added_heads[dep_slot],
+	};
+	da_append(&server->added, edge);
+	server->added_heads[dep_slot] = server->added.count;
+}
+
+// Marks everything depending on the slot as UNEVALUATED again. Cells that
+// are UNEVALUATED already are not followed, nothing depending on them can
+// be EVALUATED.
+// The column indexes of the aggregates are cut back above every cell
+// that changes.
+void serve_invalidate(Server *server, size_t slot){
+	Table *table = server->table;
+	Cell_Ids *stack = &server->stack;
+	size_t row = 0;
+	size_t col = 0;
+	table_slot_position(table, slot, &row, &col);
+	table_column_touch(table, row, col);
+	serve_next_mark(server);
+	stack->count = 0;
+	da_append(stack, slot);
+	while(stack->count > 0){
+		size_t id = stack->items[--stack->count];
+		size_t begin = stack->count;
+		serve_push_dependents(server, id, stack, true);
+		size_t end = stack->count;
+		stack->count = begin;
+		for(size_t i = begin; i < end; ++i){
+			size_t dependent = stack->items[i];
+			if(table_kind_at(table, dependent) == CELL_KIND_EXPR && table_status_at(table, dependent) == EVALUATED){
+				table_set_status(table, dependent, UNEVALUATED);
+				table_slot_position(table, dependent, &row, &col);
+				table_column_touch(table, row, col);
+				stack->items[stack->count++] = dependent;
+			}
+		}
+	}
+}
+
+// Whether some formula refers to the slot
+bool serve_is_referenced(Server *server, size_t slot){
+	Table *table = server->table;
+	server->stack.count = 0;
+	serve_push_dependents(server, slot, &server->stack, false);
+	for(size_t i = 0; i < server->stack.count; ++i){
+		size_t dependent = server->stack.items[i];
+		if(table_kind_at(table, dependent) != CELL_KIND_EXPR){
+			continue;
+		}
+		server->ctx->deps.count = 0;
+		code_collect_cells(server->cb, table_expr_at(table, dependent)->code, server->ctx);
+		for(size_t j = 0; j < server->ctx->deps.count; ++j){
+			if(table_ref_slot(table, server->ctx->deps.items[j]) == slot){
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Whether the current formula of the slot uses the cell, directly or
+// through a range
+bool serve_uses(Server *server, size_t slot, size_t row, size_t col){
+	Table *table = server->table;
+	const Code_Buffer *cb = server->cb;
+	if(table_kind_at(table, slot) != CELL_KIND_EXPR){
+		return false;
+	}
+	for(const Inst *inst = &cb->items[table_expr_at(table, slot)->code]; inst->kind != OP_RETURN; ++inst){
+		if((inst->kind == OP_LOAD_CELL || inst->kind == OP_ADD_CELL) && inst->col == col && inst->as.row == row){
+			return true;
+		}
+		if(inst->kind == OP_AGGREGATE){
+			const Aggregate_Ref *ref = &cb->aggregates.items[inst->as.aggregate];
+			if(ref->first.row <= row && row <= ref->last.row && ref->first.col <= col && col <= ref->last.col){
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Marks the slot and every formula depending on it with server->mark.
+// Walking the dependents rather than the dependencies keeps ranges cheap:
+// a formula is only reached through the cells it uses. Edges the current
+// formulas don't have anymore are not followed.
+void serve_mark_dependents(Server *server, size_t slot){
+	Table *table = server->table;
+	Cell_Ids *stack = &server->stack;
+	serve_next_mark(server);
+	server->marks[slot] = server->mark;
+	stack->count = 0;
+	da_append(stack, slot);
+	while(stack->count > 0){
+		size_t id = stack->items[--stack->count];
+		size_t row = 0;
+		size_t col = 0;
+		table_slot_position(table, id, &row, &col);
+		size_t begin = stack->count;
+		serve_push_dependents(server, id, stack, true);
+		size_t end = stack->count;
+		stack->count = begin;
+		for(size_t i = begin; i < end; ++i){
+			size_t dependent = stack->items[i];
+			if(server->marks[dependent] != server->mark && serve_uses(server, dependent, row, col)){
+				server->marks[dependent] = server->mark;
+				stack->items[stack->count++] = dependent;
+			}
+		}
+	}
+}
+
+// Returns why the evaluator would stop on the references of the program
+// or NULL. Leaves the cells it references in ctx->deps.
+const char *table_check_refs(const Table *table, const Code_Buffer *cb, size_t code, Eval_Context *ctx){
+	ctx->deps.count = 0;
+	code_collect_cells(cb, code, ctx);
+	for(size_t i = 0; i < ctx->deps.count; ++i){
+		Expr_Cell dep = ctx->deps.items[i];
+		if(dep.row >= table->rows || dep.col >= table->cols){
+			return "the formula refers to a cell outside of the table";
+		}
+		if(table_kind_at(table, table_slot(table, dep.row, dep.col)) == CELL_KIND_TEXT){
+			return "the formula refers to a text cell";
+		}
+	}
+	for(const Inst *inst = &cb->items[code]; inst->kind != OP_RETURN; ++inst){
+		if(inst->kind == OP_AGGREGATE){
+			const Aggregate_Ref *ref = &cb->aggregates.items[inst->as.aggregate];
+			if(ref->last.row >= table->rows || ref->last.col >= table->cols){
+				return "the formula refers to a cell outside of the table";
+			}
+		}
+	}
+	return NULL;
+}
+
+// Returns the reason the cell could not be set or NULL. Unlike the csv,
+// a formula from a client is checked before it is used: everything the
+// evaluator would stop the program on is refused here. Setting a cell to
+// what it already holds does not invalidate anything.
+const char *serve_set(Server *server, size_t row, size_t col, String_View content){
+	Table *table = server->table;
+	Eval_Context *ctx = server->ctx;
+	size_t slot = table_slot(table, row, col);
+	double number = 0.0;
+	if(!table_is_dense(table) && slot == table->empty_slot){
+		return "the cell is not in the table";
+	}
+
+	if(sv_starts_with(content, SV("="))){
+		sv_chop_left(&content, 1);
+		if(!expr_syntax_ok(content)){
+			return "invalid formula";
+		}
+		Cell_Expr expr = {0};
+		Expr_Index first = server->eb->count;
+		expr.index = expr_optimize(server->eb, parse_expr(&content, server->eb), first);
+		// an equal formula is found in the intern table, but the cell may
+		// hold another copy of it from a different shard
+		if(table_kind_at(table, slot) == CELL_KIND_EXPR && expr_formula_eq(server->eb, table_expr_at(table, slot)->index, expr.index)){
+			return NULL;
+		}
+		expr.code = compile_expr_shared(server->eb, expr.index, server->cb);
+		// the program may have been shared with an existing one even if
+		// the formula is refused below
+		if(server->cb->memo_count != server->memo->count){
+			eval_memo_free(server->memo);
+			eval_memo_init(server->memo, server->cb->memo_count);
+		}
+
+		const char *error = table_check_refs(table, server->cb, expr.code, ctx);
+		if(error != NULL){
+			return error;
+		}
+		const Code_Buffer *cb = server->cb;
+
+		// a cycle means the formula uses the cell or something depending on it
+		serve_mark_dependents(server, slot);
+		for(size_t i = 0; i < ctx->deps.count; ++i){
+			if(server->marks[table_slot(table, ctx->deps.items[i].row, ctx->deps.items[i].col)] == server->mark){
+				return "circular dependency";
+			}
+		}
+		for(const Inst *inst = &cb->items[expr.code]; inst->kind != OP_RETURN; ++inst){
+			if(inst->kind != OP_AGGREGATE){
+				continue;
+			}
+			const Aggregate_Ref *ref = &cb->aggregates.items[inst->as.aggregate];
+			for(size_t row = ref->first.row; row <= ref->last.row; ++row){
+				for(size_t col = ref->first.col; col <= ref->last.col; ++col){
+					if(server->marks[table_slot(table, row, col)] == server->mark){
+						return "circular dependency";
+					}
+				}
+			}
+		}
+
+		table->kinds[slot] = CELL_KIND_EXPR;
+		table->refs[slot] = table_ref(table->exprs.count);
+		da_append(&table->exprs, expr);
+		table_set_status(table, slot, UNEVALUATED);
+		ctx->deps.count = 0;
+		code_collect_cells(server->cb, expr.code, ctx);
+		for(size_t i = 0; i < ctx->deps.count; ++i){
+			serve_add_edge(server, table_ref_slot(table, ctx->deps.items[i]), slot);
+		}
+		serve_add_ranges(server, slot, expr.code);
+	} else if(sv_strtod(content, &number)){
+		if(table_kind_at(table, slot) == CELL_KIND_NUMBER && table->values[slot] == number){
+			return NULL;
+		}
+		table->kinds[slot] = CELL_KIND_NUMBER;
+		table->values[slot] = number;
+	} else {
+		if(table_kind_at(table, slot) == CELL_KIND_TEXT && sv_eq(table_text_at(table, slot), content)){
+			return NULL;
+		}
+		if(serve_is_referenced(server, slot)){
+			return "the cell is used by a formula and can't be text";
+		}
+		Cell_Text text = {
+			.offset = server->text.count,
+			.count = content.count,
+		};
+		serve_text_append(&server->text, content);
+		table->text_base = server->text.items;
+		table->kinds[slot] = CELL_KIND_TEXT;
+		table->values[slot] = 0.0;
+		table->refs[slot] = table_ref(table->texts.count + 1);
+		da_append(&table->texts, text);
+	}
+
+	server->memo_stale = true;
+	serve_invalidate(server, slot);
+	return NULL;
+}
+
+// Call before evaluating anything after a set
+void serve_refresh_memo(Server *server){
+	if(server->memo_stale){
+		eval_memo_reset(server->memo);
+		server->memo_stale = false;
+	}
+}
+
+void serve_get(Server *server, size_t first_row, size_t first_col, size_t last_row, size_t last_col){
+	Table *table = server->table;
+	serve_refresh_memo(server);
+	for(size_t row = first_row; row <= last_row; ++row){
+		size_t width = table_row_width(table, row);
+		for(size_t col = first_col; col <= last_col; ++col){
+			if(col < width){
+				table_eval_cell(table, server->cb, server->ctx, row, col);
+				output_write_cell(&server->response, table, table_slot(table, row, col));
+			}
+			if(col < last_col){
+				output_write_char(&server->response, '|');
+			}
+		}
+		output_write_char(&server->response, '\n');
+	}
 }
 
-char *slurp_file(const char *file_path, size_t *size)
-{
-	char *buffer = NULL;
-	FILE *f = fopen(file_path, "rb");
-	if(f == NULL){
-		goto error;
+bool serve_parse_cell(const Table *table, String_View name, size_t *row, size_t *col){
+	long int number = 0;
+	if(name.count < 2 || !isupper(*name.data)){
+		return false;
 	}
+	*col = (size_t) (*name.data - 'A');
+	sv_chop_left(&name, 1);
+	if(!sv_strtol(name, &number) || number < 0){
+		return false;
+	}
+	*row = (size_t) number;
+	return *row < table->rows && *col < table->cols;
+}
 
-	if(fseek(f, 0, SEEK_END) < 0){
-		goto error;
+void serve_request(Server *server, String_View request){
+	Output *response = &server->response;
+	response->count = 0;
+	while(request.count > 0){
+		String_View line = sv_trim(sv_chop_by_delim(&request, '\n'));
+		if(line.count == 0){
+			continue;
+		}
+		String_View command = line;
+		String_View verb = sv_chop_by_delim(&line, ' ');
+		line = sv_trim_left(line);
+		String_View cell = sv_chop_by_delim(&line, ' ');
+		size_t row = 0;
+		size_t col = 0;
+		const char *error = NULL;
+		if(sv_eq(verb, SV("set"))){
+			if(!serve_parse_cell(server->table, cell, &row, &col)){
+				error = "invalid cell";
+			} else {
+				error = serve_set(server, row, col, sv_trim(line));
+			}
+		} else if(sv_eq(verb, SV("get"))){
+			String_View first = sv_chop_by_delim(&cell, ':');
+			size_t last_row = 0;
+			size_t last_col = 0;
+			if(!serve_parse_cell(server->table, first, &row, &col) ||
+			   !serve_parse_cell(server->table, cell.count > 0 ? cell : first, &last_row, &last_col) ||
+			   row > last_row || col > last_col){
+				error = "invalid cell or range";
+			} else {
+				serve_get(server, row, col, last_row, last_col);
+			}
+		} else {
+			error = "unknown command";
+		}
+		if(error != NULL){
+			output_write(response, "ERROR: ", 7);
+			output_write(response, command.data, command.count);
+			output_write(response, ": ", 2);
+			output_write(response, error, strlen(error));
+			output_write_char(response, '\n');
+		}
 	}
+}
 
-	long m = ftell(f);
-	if(m < 0){
-		goto error;
+bool serve_read(int fd, void *data, size_t size){
+	char *bytes = data;
+	while(size > 0){
+		ssize_t n = read(fd, bytes, size);
+		if(n < 0 && errno == EINTR && !serve_stopped){
+			continue;
+		}
+		if(n <= 0){
+			return false;
+		}
+		bytes += n;
+		size -= (size_t) n;
 	}
+	return true;
+}
 
-	buffer = malloc(sizeof(char) * m);
-	if(buffer == NULL){
-		goto error;
+bool serve_write(int fd, const void *data, size_t size){
+	const char *bytes = data;
+	while(size > 0){
+		ssize_t n = write(fd, bytes, size);
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n <= 0){
+			return false;
+		}
+		bytes += n;
+		size -= (size_t) n;
 	}
-	
-	if(fseek(f, 0, SEEK_SET) < 0){
-		goto error;
+	return true;
+}
+
+// Answers the requests of one client until it hangs up
+void serve_client(Server *server, int fd, Serve_Text *request){
+	for(;;){
+		uint32_t size = 0;
+		if(!serve_read(fd, &size, sizeof(size))){
+			return;
+		}
+		size = ntohl(size);
+		if(size > SERVE_MAX_FRAME_SIZE){
+			fprintf(stderr, "WARNING: request of %u bytes is too big, dropping the client\n", size);
+			return;
+		}
+		if(request->capacity < size){
+			request->items = realloc(request->items, size);
+			assert(request->items != NULL && "Buy more RAM lol");
+			request->capacity = size;
+		}
+		if(!serve_read(fd, request->items, size)){
+			return;
+		}
+
+		serve_request(server, sv_from_parts(request->items, size));
+
+		uint32_t response_size = htonl((uint32_t) server->response.count);
+		if(server->response.count > UINT32_MAX ||
+		   !serve_write(fd, &response_size, sizeof(response_size)) ||
+		   !serve_write(fd, server->response.items, server->response.count)){
+			return;
+		}
 	}
+}
 
-	size_t n = fread(buffer, 1, m, f);
-	assert(n == (size_t) m);
-	if(ferror(f)){
-		goto error;
+void serve_stop(int signum){
+	(void) signum;
+	serve_stopped = 1;
+}
+
+// Serves the clients one at a time until SIGINT or SIGTERM
+void serve(Server *server, const char *socket_path){
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	if(strlen(socket_path) >= sizeof(addr.sun_path)){
+		fprintf(stderr, "ERROR: socket path %s is too long\n", socket_path);
+		exit(1);
 	}
+	strcpy(addr.sun_path, socket_path);
 
-	if(size){
-		*size = n;
+	// a socket left behind by a previous run would make bind fail
+	struct stat statbuf;
+	if(stat(socket_path, &statbuf) == 0 && S_ISSOCK(statbuf.st_mode)){
+		unlink(socket_path);
 	}
-	
-	fclose(f);
-	
-	return buffer;
- error:
-	if(f){
-		fclose(f);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listen_fd < 0 ||
+	   bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+	   listen(listen_fd, 16) < 0){
+		fprintf(stderr, "ERROR: could not listen on %s: %s\n", socket_path, strerror(errno));
+		exit(1);
 	}
-	if(buffer){
-		free(buffer);
+
+	// no SA_RESTART, so the signals interrupt accept(2)
+	struct sigaction action = {0};
+	action.sa_handler = serve_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	Serve_Text request = {0};
+	while(!serve_stopped){
+		int fd = accept(listen_fd, NULL, NULL);
+		if(fd < 0){
+			if(errno != EINTR){
+				fprintf(stderr, "WARNING: could not accept a client: %s\n", strerror(errno));
+			}
+			continue;
+		}
+		serve_client(server, fd, &request);
+		close(fd);
 	}
-	return NULL;
+
+	free(request.items);
+	close(listen_fd);
+	unlink(socket_path);
 }
 
+typedef struct {
+	uint64_t *items;
+	size_t count;
+	size_t capacity;
+} Line_Hashes;
 
-void parse_table_from_content(Table *table, String_View content, Expr_Buffer *eb){
-	for(size_t row = 0 ; row < content.count; ++row){
+// Hashes the lines of the content that the parser turns into rows
+void line_hashes_compute(Line_Hashes *hashes, String_View content){
+	hashes->count = 0;
+	while(content.count > 0){
 		String_View line = sv_chop_by_delim(&content, '\n');
-		for(size_t col = 0; col < line.count; ++col){
-			String_View cell_value = sv_trim(sv_chop_by_delim(&line, '|'));
-			Cell *cell = table_cell_at(table, row,col);
-			
-			if(sv_starts_with(cell_value,SV("="))) {
-				sv_chop_left(&cell_value, 1);
-				cell->kind = CELL_KIND_EXPR;
-				cell->as.expr.index = parse_expr(&cell_value, eb);
-			}  else {
-				/* static char temp_buffer[1024 * 4]; */
-				/* assert(cell_value.count < sizeof(temp_buffer)); */
-				/* snprintf(temp_buffer,sizeof(temp_buffer), SV_Fmt, SV_Arg(cell_value)); */
-				/* char *endptr; */
-				//cell->as.number = strtod(temp_buffer, &endptr);
-
-				//if(endptr != temp_buffer && *endptr == '\0'){
-				if(sv_strtod(cell_value,&cell->as.number )){
-					cell->kind = CELL_KIND_NUMBER;
-				} else {
-					cell->kind = CELL_KIND_TEXT;
-					cell->as.text = cell_value;
-				}
-			}
-		}
+		da_append(hashes, checksum_bytes(FNV_OFFSET_BASIS, line.data, line.count));
 	}
 }
 
+typedef struct {
+	size_t row;
+	size_t col;
+	String_View content;
+	// why serve_set refused the cell the last time, NULL once it is set
+	const char *error;
+} Watch_Cell;
 
-void estimate_table_size(String_View content, size_t *out_rows, size_t *out_cols){
+typedef struct {
+	Watch_Cell *items;
+	size_t count;
+	size_t capacity;
+} Watch_Cells;
 
-	size_t rows = 0;
-	size_t cols = 0;
+// Collects the cells of a changed line, returns false if the line does
+// not fit the current layout of the table
+bool watch_collect_line(const Table *table, size_t row, String_View line, Watch_Cells *cells){
+	size_t begin = cells->count;
+	size_t col = 0;
+	while(line.count > 0){
+		Watch_Cell cell = {0};
+		cell.row = row;
+		cell.col = col++;
+		cell.content = sv_trim(sv_chop_by_delim(&line, '|'));
+		da_append(cells, cell);
+	}
+	size_t width = cells->count - begin;
+	if(table_is_dense(table)){
+		while(width < table->cols){
+			Watch_Cell cell = {0};
+			cell.row = row;
+			cell.col = width++;
+			cell.content = SV("");
+			da_append(cells, cell);
+		}
+		return width == table->cols;
+	}
+	return width == table_row_width(table, row);
+}
 
-	for(; rows < content.count; ++rows){
-		String_View line = sv_chop_by_delim(&content,'\n');
-		size_t col = 0;
-		for(; col < line.count; ++col){
-			sv_chop_by_delim(&line, '|');
+// Reports the formulas of the content that don't parse
+bool watch_syntax_ok(String_View content){
+	bool ok = true;
+	for(size_t row = 0; content.count > 0; ++row){
+		String_View line = sv_chop_by_delim(&content, '\n');
+		for(size_t col = 0; line.count > 0; ++col){
+			String_View cell = sv_trim(sv_chop_by_delim(&line, '|'));
+			if(sv_starts_with(cell, SV("=")) && !expr_syntax_ok(sv_from_parts(cell.data + 1, cell.count - 1))){
+				fprintf(stderr, "ERROR: ");
+				fprint_cell_name(stderr, row, col);
+				fprintf(stderr, ": invalid formula\n");
+				ok = false;
+			}
 		}
+	}
+	return ok;
+}
 
-		if(cols < col){
-			cols = col;
+// Reports everything in a freshly parsed table the evaluator would stop
+// the program on, with the checks of serve_set
+bool watch_table_ok(Table *table, const Code_Buffer *cb, Eval_Context *ctx){
+	bool ok = true;
+	for(size_t row = 0; row < table->rows; ++row){
+		size_t width = table_row_width(table, row);
+		for(size_t col = 0; col < width; ++col){
+			size_t slot = table_slot(table, row, col);
+			if(table_kind_at(table, slot) != CELL_KIND_EXPR){
+				continue;
+			}
+			const char *error = table_check_refs(table, cb, table_expr_at(table, slot)->code, ctx);
+			if(error != NULL){
+				fprintf(stderr, "ERROR: ");
+				fprint_cell_name(stderr, row, col);
+				fprintf(stderr, ": %s\n", error);
+				ok = false;
+			}
 		}
 	}
-	
-	if(out_rows){
-		*out_rows = rows;
+	if(!ok){
+		return false;
 	}
+	Dep_Graph graph = {0};
+	ok = dep_graph_build(&graph, table, cb, ctx);
+	dep_graph_free(&graph);
+	return ok;
+}
 
-	if(out_cols){
-		*out_cols = cols;
+// Replaces everything with a fresh parse of the content. A content the
+// evaluator would stop on is reported and the previous table is kept.
+// Returns whether the table was replaced.
+bool watch_reload(Server *server, String_View content, size_t jobs){
+	if(!watch_syntax_ok(content)){
+		return false;
+	}
+	Table fresh = {0};
+	Expr_Buffer fresh_eb = {0};
+	Code_Buffer fresh_cb = {0};
+	parse_table_from_content_parallel(&fresh, content, &fresh_eb, &fresh_cb, jobs);
+	if(!watch_table_ok(&fresh, &fresh_cb, server->ctx)){
+		table_free(&fresh);
+		expr_buffer_free(&fresh_eb);
+		code_buffer_free(&fresh_cb);
+		return false;
 	}
-}
 
-/* int main(){ */
-/* 	String_View source = SV_STATIC("A1+B1 + 80 + C1 + D1"); */
-/*  	Expr *expr = parse_expr(&source); */
-/* 	dump_expr(stdout, expr, 0); */
-/* 	return 0; */
-/* }  */
-void table_eval_cell(Table *table, Cell *cell, Expr_Buffer *eb);
+	Table *table = server->table;
+	Expr_Buffer *eb = server->eb;
+	Code_Buffer *cb = server->cb;
+	Eval_Context *ctx = server->ctx;
+	Eval_Memo *memo = server->memo;
+	server_free(server);
+	table_free(table);
+	expr_buffer_free(eb);
+	code_buffer_free(cb);
+	eval_memo_free(memo);
 
-double table_eval_expr(Table *table, Expr_Buffer *eb, Expr_Index expr_index){
-	Expr* expr = expr_buffer_at(eb, expr_index);
-	switch(expr->kind){
-	case EXPR_KIND_NUMBER:
-		return expr->as.number;
-	case EXPR_KIND_CELL:{
-		Cell *cell = table_cell_at(table, expr->as.cell.row, expr->as.cell.col);
-		switch(cell->kind){
-		case CELL_KIND_NUMBER:
-			return cell->as.number;
-		case CELL_KIND_TEXT:
-			fprintf(stderr, "ERROR: CELL(%zu : %zu)", expr->as.cell.row, expr->as.cell.col);
-			exit(1);
-			break;
-		case CELL_KIND_EXPR:
-			table_eval_cell(table, cell, eb);
-			return cell->as.expr.value;
+	*table = fresh;
+	*eb = fresh_eb;
+	*cb = fresh_cb;
+	eval_memo_init(memo, cb->memo_count);
+	for(size_t row = 0; row < table->rows; ++row){
+		for(size_t col = 0; col < table_row_width(table, row); ++col){
+			table_eval_cell(table, cb, ctx, row, col);
 		}
 	}
-		break;
-	case EXPR_KIND_PLUS: {
-		double lhs = table_eval_expr(table, eb, expr->as.plus.lhs);
-		double rhs = table_eval_expr(table, eb, expr->as.plus.rhs);
-	  return lhs + rhs;
-	}	break;
-	}
-	return 0;
+	server_init(server, table, eb, cb, ctx, memo);
+	return true;
 }
-	
-void table_eval_cell(Table *table, Cell *cell, Expr_Buffer *eb){
-	
-	if(cell->kind == CELL_KIND_EXPR){
 
-		if(cell->as.expr.status == INPROGRESS){
-			fprintf(stderr,"ERROR: Circular dependency detected!\n");
-			exit(1);
-		}
+// Applies the changed lines of the content cell by cell through
+// serve_set. Returns false if the table has to be reloaded instead.
+bool watch_update(Server *server, String_View content, const Line_Hashes *new_lines, Line_Hashes *lines, Watch_Cells *cells){
+	Table *table = server->table;
+	if(new_lines->count != lines->count || new_lines->count != table->rows){
+		return false;
+	}
 
-		if(cell->as.expr.status == UNEVALUATED){
-			cell->as.expr.status = INPROGRESS;
-			cell->as.expr.value = table_eval_expr(table, eb, cell->as.expr.index);
-			cell->as.expr.status = EVALUATED;
+	cells->count = 0;
+	for(size_t row = 0; content.count > 0; ++row){
+		String_View line = sv_chop_by_delim(&content, '\n');
+		if(new_lines->items[row] != lines->items[row] && !watch_collect_line(table, row, line, cells)){
+			return false;
 		}
 	}
-}
 
-// * dump into hard disk
-/* int main(){ */
-/* 	Expr_Buffer eb = {0}; */
-/* 	String_View source = SV_STATIC("10 + 20 + A1 + B1 + 69 + 240"); */
-/* 	Expr_Index expr_index = parse_expr(&source, &eb); */
-/* 	dump_expr(stdout, &eb, expr_index, 0); */
-/* 	const char * bin_file_path = "expr.bin"; */
-/* 	FILE *f = fopen(bin_file_path, "wb");  */
-/* 	expr_buffer_dump(f, &eb, expr_index); */
-/* 	fclose(f); */
-/* 	free(eb.items); */
-/* 	printf("Saved the dump to %s \n", bin_file_path); */
-/* 	return 0; */
-/* } */
+	// A cell may only be settable after another one of the same change,
+	// like the two halves of a reversed reference. Retry the refused ones
+	// for as long as that makes progress.
+	size_t left = cells->count;
+	for(size_t i = 0; i < cells->count; ++i){
+		cells->items[i].error = "";
+	}
+	for(;;){
+		size_t before = left;
+		for(size_t i = 0; i < cells->count; ++i){
+			Watch_Cell *cell = &cells->items[i];
+			if(cell->error != NULL){
+				cell->error = serve_set(server, cell->row, cell->col, cell->content);
+				left -= cell->error == NULL;
+			}
+		}
+		if(left == 0 || left == before){
+			break;
+		}
+	}
 
-// 51:22 
-int main2(){
-	const char * dump_file_path = "expr.bin";
-	FILE *f = fopen(dump_file_path, "rb");
+	// the lines with refused cells keep their old hash, so they are
+	// tried again on the next change
+	for(size_t row = 0; row < lines->count; ++row){
+		lines->items[row] = new_lines->items[row];
+	}
+	for(size_t i = 0; i < cells->count; ++i){
+		Watch_Cell *cell = &cells->items[i];
+		if(cell->error != NULL){
+			fprintf(stderr, "ERROR: ");
+			fprint_cell_name(stderr, cell->row, cell->col);
+			fprintf(stderr, ": %s\n", cell->error);
+			lines->items[cell->row] = 0;
+		}
+	}
+	return true;
+}
 
-	Expr_Index root = 0;
-	fread(&root, sizeof(root), 1, f);
+// Prints the table again every time the file is written. Watching the
+// directory rather than the file itself also catches editors that save
+// by renaming a new file over the old one.
+void watch_file(const char *file_path, Server *server, Line_Hashes *lines, Output *out, size_t jobs){
+	const char *slash = strrchr(file_path, '/');
+	const char *name = slash != NULL ? slash + 1 : file_path;
+	char *dir = strdup(slash == NULL ? "." : slash == file_path ? "/" : file_path);
+	assert(dir != NULL);
+	if(slash != NULL && slash != file_path){
+		dir[slash - file_path] = '\0';
+	}
 
-	size_t count = 0;
-	fread(&count, sizeof(count), 1 , f);
+	int fd = inotify_init1(IN_CLOEXEC);
+	if(fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+		fprintf(stderr, "ERROR: could not watch %s: %s\n", file_path, strerror(errno));
+		exit(1);
+	}
 
-	Expr_Buffer eb = {0};
-	eb.count = count;
-	eb.capacity = count;
-	eb.items = malloc(sizeof(Expr) * eb.capacity);
-	fread(eb.items, sizeof(Expr), eb.count, f);
+	char events[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+	Line_Hashes new_lines = {0};
+	Watch_Cells cells = {0};
+	for(;;){
+		ssize_t n = read(fd, events, sizeof(events));
+		if(n < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			fprintf(stderr, "ERROR: could not watch %s: %s\n", file_path, strerror(errno));
+			exit(1);
+		}
+		bool changed = false;
+		for(ssize_t i = 0; i < n;){
+			const struct inotify_event *event = (const struct inotify_event*) &events[i];
+			changed = changed || (event->len > 0 && strcmp(event->name, name) == 0);
+			i += (ssize_t) (sizeof(struct inotify_event) + event->len);
+		}
+		if(!changed){
+			continue;
+		}
 
-	fclose(f);
+		Input_File content = {0};
+		if(!input_file_open(file_path, &content)){
+			fprintf(stderr, "WARNING: could not read file %s: %s\n", file_path, strerror(errno));
+			continue;
+		}
+		String_View input = sv_from_parts(content.data, content.size);
+		line_hashes_compute(&new_lines, input);
+		if(!watch_update(server, input, &new_lines, lines, &cells) && watch_reload(server, input, jobs)){
+			lines->count = 0;
+			for(size_t row = 0; row < new_lines.count; ++row){
+				da_append(lines, new_lines.items[row]);
+			}
+		}
+		// serve_set and server_init copied the texts out of the input
+		input_file_close(&content);
 
-	dump_expr(stdout, &eb, root, 0);
+		Table *table = server->table;
+		serve_refresh_memo(server);
+		for(size_t row = 0; row < table->rows; ++row){
+			for(size_t col = 0; col < table_row_width(table, row); ++col){
+				table_eval_cell(table, server->cb, server->ctx, row, col);
+			}
+			output_write_table_row(out, table, row);
+		}
+		output_flush(out);
+	}
+}
 
-	// free(eb.items);
-	return 0;
+char *shift(int *argc, char ***argv){
+	assert(*argc > 0);
+	char *result = **argv;
+	*argc -= 1;
+	*argv += 1;
+	return result;
 }
 
 int main(int argc, char **argv)
 {
+	shift(&argc, &argv);
+
+	const char *input_file_path = NULL;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int precision = -1;
+	const char *state_file_path = NULL;
+	const char *cache_file_path = NULL;
+	const char *socket_path = NULL;
+	const char *trace_file_path = NULL;
+	bool alloc_stats = false;
+	long profile_top = 0;
+	bool stats_enabled = false;
+	bool stats_json = false;
+	bool stream = false;
+	bool watch = false;
+	while (argc > 0)
+		{
+			const char *arg = shift(&argc, &argv);
+			if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0)
+				{
+					if (argc == 0 || !sv_strtol(sv_from_cstr(*argv), &jobs) || jobs < 1)
+						{
+							usage(stderr);
+							fprintf(stderr, "ERROR: %s expects a positive amount of threads\n", arg);
+							exit(1);
+						}
+					shift(&argc, &argv);
+				}
+			else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--precision") == 0)
+				{
+					long digits = 0;
+					if (argc > 0 && strcmp(*argv, "shortest") == 0)
+						{
+							precision = -1;
+						}
+					else if (argc > 0 && sv_strtol(sv_from_cstr(*argv), &digits) && digits >= 0 && digits <= 64)
+						{
+							precision = (int) digits;
+						}
+					else
+						{
+							usage(stderr);
+							fprintf(stderr, "ERROR: %s expects `shortest` or an amount of digits from 0 to 64\n", arg);
+							exit(1);
+						}
+					shift(&argc, &argv);
+				}
+			else if (strcmp(arg, "--incremental") == 0)
+				{
+					if (argc == 0)
+						{
+							usage(stderr);
+							fprintf(stderr, "ERROR: %s expects a path to the state file\n", arg);
+							exit(1);
+						}
+					state_file_path = shift(&argc, &argv);
+				}
+			else if (strcmp(arg, "--cache") == 0)
+				{
+					if (argc == 0)
+						{
+							usage(stderr);
+							fprintf(stderr, "ERROR: %s expects a path to the cache file\n", arg);
+							exit(1);
+						}
+					cache_file_path = shift(&argc, &argv);
+				}
+			else if (strcmp(arg, "--serve") == 0)
+				{
+					if (argc == 0)
+						{
+							usage(stderr);
+							fprintf(stderr, "ERROR: %s expects a path to the socket\n", arg);
+							exit(1);
+						}
+					socket_path = shift(&argc, &argv);
+				}
+			else if (strcmp(arg, "--trace") == 0)
+				{
+					if (argc == 0)
+						{
+							usage(stderr);
+							fprintf(stderr, "ERROR: %s expects a path to the trace file\n", arg);
+							exit(1);
+						}
+					trace_file_path = shift(&argc, &argv);
+				}
+			else if (strcmp(arg, "--stream") == 0)
+				{
+					stream = true;
+				}
+			else if (strcmp(arg, "--watch") == 0)
+				{
+					watch = true;
+				}
+			else if (strcmp(arg, "--alloc-stats") == 0)
+				{
+					alloc_stats = true;
+				}
+			else if (strcmp(arg, "--profile") == 0)
+				{
+					if (argc == 0 || !sv_strtol(sv_from_cstr(*argv), &profile_top) || profile_top < 1)
+						{
+							usage(stderr);
+							fprintf(stderr, "ERROR: %s expects a positive amount of cells\n", arg);
+							exit(1);
+						}
+					shift(&argc, &argv);
+				}
+			else if (strcmp(arg, "--stats") == 0 || strcmp(arg, "--stats-json") == 0)
+				{
+					stats_enabled = true;
+					stats_json = strcmp(arg, "--stats-json") == 0;
+				}
+			else if (arg[0] == '-' && arg[1] != '\0')
+				{
+					usage(stderr);
+					fprintf(stderr, "ERROR: unknown flag %s\n", arg);
+					exit(1);
+				}
+			else
+				{
+					input_file_path = arg;
+				}
+		}
+	if (jobs < 1)
+		{
+			jobs = 1;
+		}
 
-	if (argc < 2)
+	if (input_file_path == NULL)
 		{
 			usage(stderr);
 			fprintf(stderr, "ERROR: input file is not provided\n");
 			exit(1);
 		}
+	if (stream && state_file_path != NULL)
+		{
+			usage(stderr);
+			fprintf(stderr, "ERROR: --stream can not be combined with --incremental\n");
+			exit(1);
+		}
+	if (socket_path != NULL && (stream || state_file_path != NULL || cache_file_path != NULL))
+		{
+			usage(stderr);
+			fprintf(stderr, "ERROR: --serve can not be combined with --stream, --incremental or --cache\n");
+			exit(1);
+		}
+	if (watch && (stream || state_file_path != NULL || cache_file_path != NULL || socket_path != NULL || strcmp(input_file_path, "-") == 0))
+		{
+			usage(stderr);
+			fprintf(stderr, "ERROR: --watch needs an input file and can not be combined with --stream, --incremental, --cache or --serve\n");
+			exit(1);
+		}
+	if (cache_file_path != NULL && (stream || strcmp(input_file_path, "-") == 0))
+		{
+			usage(stderr);
+			fprintf(stderr, "ERROR: --cache needs an input file and can not be combined with --stream\n");
+			exit(1);
+		}
+	if (profile_top > 0 && (stream || cache_file_path != NULL || socket_path != NULL || watch))
+		{
+			usage(stderr);
+			fprintf(stderr, "ERROR: --profile can not be combined with --stream, --cache, --serve or --watch\n");
+			exit(1);
+		}
+
+	// the phases are always timed, it is a couple of clock reads each
+	Stats stats = {0};
+	stats.last = stats_clock();
+	if (trace_file_path != NULL)
+		{
+			trace_start();
+		}
+
+	// reusable buffer;
+	Expr_Buffer eb = {0};
+
+	/* Put table into memory */
+	Table table = {0};
+	Code_Buffer cb = {0};
+
+	// The cache remembers the size and modification time of the csv it was
+	// made from. They are taken before reading, so a csv changed while it
+	// is being read never matches the cache written afterwards.
+	Sheet_Cache cache = {0};
+	struct stat input_stat = {0};
+	bool cached = false;
+	if (cache_file_path != NULL)
+		{
+			if (stat(input_file_path, &input_stat) < 0)
+				{
+					fprintf(stderr, "ERROR: could not read file %s:%s \n", input_file_path, strerror(errno));
+					exit(1);
+				}
+			uint64_t begin = trace_begin();
+			cached = sheet_cache_load(cache_file_path, &input_stat, &cache, &table, &eb, &cb);
+			trace_end("cache load", begin, NULL, 0);
+		}
 
-	const char *input_file_path = argv[1];
-	size_t content_size = 0;
 	// ! Read File
-	char *content = slurp_file(input_file_path, &content_size);
-	// printf("\n %s \n", content);
-	// printf("file size:- %ld \n", content_size);
-	if (content == NULL)
+	Input_File content = {0};
+	uint64_t begin_read = trace_begin();
+	if (!cached && !input_file_open(input_file_path, &content))
 		{
 			fprintf(stderr, "ERROR: could not read file %s:%s \n", input_file_path, strerror(errno));
 			exit(1);
 		}
+	if (!cached)
+		{
+			trace_end(content.mapped ? "map" : "slurp", begin_read, "bytes", content.size);
+		}
 
 	String_View input = {
-		.count = content_size,
-		.data = content,
+		.count = content.size,
+		.data = content.data,
 	};
+	stats.input_size = cached ? (size_t) input_stat.st_size : content.size;
+	stats_lap(&stats, STATS_PHASE_READ);
 
-	// reusable buffer;
-	Expr_Buffer eb = {0};
+	Output out = {
+		.fd = STDOUT_FILENO,
+		.precision = precision,
+	};
 
-	/** Get Dimensions */
-	size_t row;
-	size_t col;
-	estimate_table_size(input, &row, &col);
-	/* Put table into memory */
-	Table table = table_alloc(row, col);
-	/* Add data into table  */
-	parse_table_from_content(&table, input, &eb);
+	// Formulas that only look back let the table be printed a block of
+	// rows at a time, anything else needs the whole table in memory. So
+	// do formulas looking back over half of the table, the blocks would
+	// hold most of it anyway.
+	if (stream)
+		{
+			uint64_t begin = trace_begin();
+			Stream_Plan plan = stream_plan_from_content(input, content.mapped);
+			trace_end("stream plan", begin, "rows", plan.rows);
+			stats_lap(&stats, STATS_PHASE_STREAM_PLAN);
+			if (!plan.forward && plan.window < plan.rows / 2)
+				{
+					stream_table(input, content.mapped, &plan, &out);
+					stats_lap(&stats, STATS_PHASE_STREAM);
+					if (stats_enabled)
+						{
+							fprint_stats(stderr, &stats, NULL, NULL, stats_json);
+						}
+					if (trace_file_path != NULL)
+						{
+							trace_save(trace_file_path);
+						}
+					output_free(&out);
+					input_file_close(&content);
+					return 0;
+				}
+		}
+
+	if (!cached)
+		{
+			parse_table_from_content_parallel(&table, input, &eb, &cb, (size_t) jobs);
+		}
+
+	// what the table was parsed from, before the input goes away
+	Line_Hashes lines = {0};
+	if (watch)
+		{
+			line_hashes_compute(&lines, input);
+		}
+
+	// A slurped input is mostly slack left by the growth of its buffer,
+	// keep only the text cells of it
+	Arena text_arena = {0};
+	size_t input_size = stats.input_size;
+	if (!cached && !content.mapped)
+		{
+			table_own_text(&table, &text_arena);
+			input_file_close(&content);
+		}
+	stats_lap(&stats, cached ? STATS_PHASE_READ : STATS_PHASE_PARSE);
+
+	if (alloc_stats)
+		{
+			Alloc_Stats table_stats = {0};
+			table_stats.chunks = 1;
+			size_t cell_size = sizeof(uint8_t) + sizeof(double) + sizeof(uint32_t);
+			table_stats.bytes_used = cell_size * table.slots_count
+				+ sizeof(Cell_Expr) * table.exprs.count + sizeof(Cell_Text) * table.texts.count
+				+ sizeof(size_t) * table.row_offsets.count;
+			table_stats.bytes_reserved = cell_size * table.slots_capacity
+				+ sizeof(Cell_Expr) * table.exprs.capacity + sizeof(Cell_Text) * table.texts.capacity
+				+ sizeof(size_t) * table.row_offsets.capacity
+				+ 2 * sizeof(uint64_t) * ((table.slots_count + STATUS_WORD_BITS - 1) / STATUS_WORD_BITS);
+			Alloc_Stats operands_stats = {0};
+			operands_stats.chunks = 1;
+			operands_stats.bytes_used = sizeof(Expr_Index) * eb.operands.count;
+			operands_stats.bytes_reserved = sizeof(Expr_Index) * eb.operands.capacity;
+			Alloc_Stats code_stats = {0};
+			code_stats.chunks = 1;
+			code_stats.bytes_used = sizeof(Inst) * cb.count + sizeof(Aggregate_Ref) * cb.aggregates.count;
+			code_stats.bytes_reserved = sizeof(Inst) * cb.capacity + sizeof(Aggregate_Ref) * cb.aggregates.capacity;
+
+			fprintf(stderr, "Allocations for %zu bytes of input (%zu expressions, %s %zux%zu table):\n",
+					input_size, eb.count, table_is_dense(&table) ? "dense" : "sparse", table.rows, table.cols);
+			fprint_alloc_stats(stderr, "table", table_stats, input_size);
+			fprint_alloc_stats(stderr, "expressions", expr_buffer_stats(&eb), input_size);
+			fprint_alloc_stats(stderr, "operands", operands_stats, input_size);
+			fprint_alloc_stats(stderr, "code", code_stats, input_size);
+			fprint_alloc_stats(stderr, "text", text_arena.stats, input_size);
+		}
+
+	Eval_Memo memo = {0};
+	eval_memo_init(&memo, cb.memo_count);
+	Eval_Context eval_ctx = {0};
+	eval_ctx.memo = &memo;
+	Eval_Profile profile = {0};
+	if (profile_top > 0)
+		{
+			eval_profile_init(&profile, table.slots_count);
+			eval_ctx.profile = &profile;
+		}
+
+	uint64_t *hashes = NULL;
+	if (state_file_path != NULL)
+		{
+			uint64_t begin = trace_begin();
+			hashes = malloc(sizeof(uint64_t) * (table_cells_count(&table) + 1));
+			assert(hashes != NULL);
+			for (size_t row = 0; row < table.rows; ++row)
+				{
+					for (size_t col = 0; col < table_row_width(&table, row); ++col)
+						{
+							hashes[table_slot(&table, row, col)] = table_cell_hash(&table, &eb, &eval_ctx, row, col);
+						}
+				}
+
+			Eval_State state = {0};
+			if (eval_state_load(state_file_path, &state))
+				{
+					table_apply_eval_state(&table, &cb, &state, hashes);
+					eval_state_free(&state);
+				}
+			trace_end("incremental", begin, NULL, 0);
+			stats_lap(&stats, STATS_PHASE_INCREMENTAL);
+		}
+
+	// whole columns of shifted formulas over numbers go first, unless
+	// every cell is profiled on its way through table_eval_cell
+	Formula_Runs runs = {0};
+	if (!cached && profile_top == 0)
+		{
+			uint64_t begin = trace_begin();
+			table_find_runs(&table, &cb, &runs);
+			trace_end("find runs", begin, "runs", runs.count);
+			begin = trace_begin();
+			size_t count = table_eval_runs(&table, &cb, &runs);
+			trace_end("eval runs", begin, "cells", count);
+			stats_lap(&stats, STATS_PHASE_RUNS);
+		}
+
+	// With a single thread the lazy row-major walk below evaluates
+	// everything without building the graph first. So it does for
+	// --profile.
+	Dep_Graph graph = {0};
+	if (jobs > 1 && !cached && profile_top == 0)
+		{
+			uint64_t begin = trace_begin();
+			if (!dep_graph_build(&graph, &table, &cb, &eval_ctx))
+				{
+					exit(1);
+				}
+			trace_end("graph", begin, "levels", graph.levels_count);
+			stats_lap(&stats, STATS_PHASE_GRAPH);
+			stats.levels_count = graph.levels_count;
+			stats.levels_known = true;
+			Thread_Pool pool = {0};
+			thread_pool_init(&pool, (size_t) jobs);
+			table_eval_levels(&table, &cb, &graph, &pool, &memo);
+			thread_pool_free(&pool);
+			stats_lap(&stats, STATS_PHASE_LEVELS);
+		}
 	
+	uint64_t begin_eval = trace_begin();
 	for(size_t row = 0; row < table.rows; ++row){
-		for(size_t col = 0; col < table.cols; ++col){
+		for(size_t col = 0; col < table_row_width(&table, row); ++col){
 			//printf("%s (%f)|",cell_kind_as_cstr(table_cell_at(&table, row, col)->kind),table_cell_at(&table,row,col)->as.number);
 			// printf("CELL(%zu, %zu): ", row, col);
-			Cell *cell = table_cell_at(&table, row, col);
-			table_eval_cell(&table, cell, &eb);
-
-		 
-			//		switch(cell->kind){
-			//	case CELL_KIND_TEXT:
-			//	printf("TEXT(\""SV_Fmt"\")\n",SV_Arg(cell->as.text));
-			//	break;
-			//case CELL_KIND_NUMBER:
-			//	printf("NUMBER(%lf)\n", cell->as.number);
-			//break;
-			//case CELL_KIND_EXPR:
-			//	printf("EXPR:\n");
-			//	dump_expr(stdout, cell->as.expr.ast, 1);
-			//	break;
-			//}
-
-			switch (cell->kind){
-			case CELL_KIND_TEXT:
-				printf(SV_Fmt, SV_Arg(cell->as.text));
-				break;
-			case CELL_KIND_NUMBER:
-				printf("%lf", cell->as.number);
-				break;
-			case CELL_KIND_EXPR:
-				printf("%lf",cell->as.expr.value);
-				break;
-									
-			}
-
-			if(col < table.cols - 1){
-				printf("|");
-			}
-			//		2:48
+			table_eval_cell(&table, &cb, &eval_ctx, row, col);
 		}
-		printf("\n");
 	}
+	trace_end("eval", begin_eval, "rows", table.rows);
+	stats_lap(&stats, STATS_PHASE_EVAL);
+	stats.max_eval_depth = eval_ctx.max_depth;
+	if (socket_path == NULL)
+		{
+			uint64_t begin = trace_begin();
+			for (size_t row = 0; row < table.rows; ++row)
+				{
+					output_write_table_row(&out, &table, row);
+				}
+			output_flush(&out);
+			trace_end("print", begin, "rows", table.rows);
+			stats_lap(&stats, STATS_PHASE_PRINT);
+		}
+
+	if (socket_path != NULL)
+		{
+			Server server = {0};
+			server_init(&server, &table, &eb, &cb, &eval_ctx, &memo);
+			server.response.precision = precision;
+			serve(&server, socket_path);
+			server_free(&server);
+		}
+	if (watch)
+		{
+			Server server = {0};
+			server_init(&server, &table, &eb, &cb, &eval_ctx, &memo);
+			watch_file(input_file_path, &server, &lines, &out, (size_t) jobs);
+		}
+	if (socket_path != NULL || watch)
+		{
+			stats_lap(&stats, STATS_PHASE_SERVE);
+		}
+
+	uint64_t begin_save = trace_begin();
+	if (state_file_path != NULL)
+		{
+			eval_state_save(state_file_path, &table, &cb, &eval_ctx, hashes);
+			free(hashes);
+		}
+	if (cache_file_path != NULL && !cached)
+		{
+			sheet_cache_save(cache_file_path, &input_stat, &table, &eb, &cb);
+		}
+	if (state_file_path != NULL || (cache_file_path != NULL && !cached))
+		{
+			trace_end("save", begin_save, NULL, 0);
+			stats_lap(&stats, STATS_PHASE_SAVE);
+		}
+	if (profile_top > 0)
+		{
+			fprint_profile(stderr, &table, &eb, &profile, (size_t) profile_top);
+			eval_profile_free(&profile);
+		}
+	if (stats_enabled)
+		{
+			// the lazy walk needs no graph, it is only built to measure
+			// the longest chain of dependencies for the report
+			if (!stats.levels_known)
+				{
+					Dep_Graph chain = {0};
+					if (dep_graph_build(&chain, &table, &cb, &eval_ctx))
+						{
+							stats.levels_count = chain.levels_count;
+							stats.levels_known = true;
+						}
+					dep_graph_free(&chain);
+					stats_lap(&stats, STATS_PHASE_GRAPH);
+				}
+			fprint_stats(stderr, &stats, &table, &eb, stats_json);
+		}
+	if (trace_file_path != NULL)
+		{
+			trace_save(trace_file_path);
+		}
+	dep_graph_free(&graph);
+	free(runs.items);
+	free(lines.items);
 
 
-	free(content);
-	free(table.cells);
-	free(eb.items);
+	input_file_close(&content);
+	arena_free(&text_arena);
+	if (cached)
+		{
+			sheet_cache_release(&cache, &table, &eb, &cb);
+		}
+	else
+		{
+			table_free(&table);
+			expr_buffer_free(&eb);
+			code_buffer_free(&cb);
+		}
+	eval_memo_free(&memo);
+	output_free(&out);
+	eval_context_free(&eval_ctx);
 	return 0;
 }
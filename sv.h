@@ -66,6 +66,7 @@ SVDEF String_View sv_chop_left(String_View *sv, size_t n);
 SVDEF String_View sv_chop_right(String_View *sv, size_t n);
 SVDEF String_View sv_chop_left_while(String_View *sv, bool (*predicate)(char x));
 SVDEF bool sv_index_of(String_View sv, char c, size_t *index);
+SVDEF size_t sv_index_of_any2(String_View sv, char a, char b, size_t *offsets, size_t capacity);
 SVDEF bool sv_eq(String_View a, String_View b);
 SVDEF bool sv_eq_ignorecase(String_View a, String_View b);
 SVDEF bool sv_starts_with(String_View sv, String_View prefix);
@@ -77,6 +78,118 @@ uint64_t sv_chop_u64(String_View *sv);
 
 #ifdef SV_IMPLEMENTATION
 
+// The delimiter scanning below uses SSE2/AVX2 on x86_64 when compiled
+// with GCC or Clang. AVX2 is picked at runtime, so the same binary still
+// runs on older CPUs. Define SV_NO_SIMD to force the scalar loops.
+#if !defined(SV_NO_SIMD) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SV_SIMD_X86
+#include <immintrin.h>
+#endif
+
+static size_t sv__find_byte_scalar(const char *data, size_t count, char c)
+{
+    size_t i = 0;
+    while (i < count && data[i] != c) {
+        i += 1;
+    }
+    return i;
+}
+
+static size_t sv__find_any2_scalar(const char *data, size_t count, char a, char b,
+                                   size_t base, size_t *offsets, size_t capacity)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < count && n < capacity; ++i) {
+        if (data[i] == a || data[i] == b) {
+            offsets[n++] = base + i;
+        }
+    }
+    return n;
+}
+
+#ifdef SV_SIMD_X86
+static size_t sv__find_byte_sse2(const char *data, size_t count, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return i + (size_t) __builtin_ctz(mask);
+        }
+    }
+    return i + sv__find_byte_scalar(data + i, count - i, c);
+}
+
+__attribute__((target("avx2")))
+static size_t sv__find_byte_avx2(const char *data, size_t count, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (data + i));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return i + (size_t) __builtin_ctz(mask);
+        }
+    }
+    return i + sv__find_byte_sse2(data + i, count - i, c);
+}
+
+static size_t sv__find_any2_sse2(const char *data, size_t count, char a, char b,
+                                 size_t *offsets, size_t capacity)
+{
+    const __m128i needle_a = _mm_set1_epi8(a);
+    const __m128i needle_b = _mm_set1_epi8(b);
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 16 <= count && n < capacity; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+        unsigned mask = (unsigned) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, needle_a), _mm_cmpeq_epi8(chunk, needle_b)));
+        while (mask && n < capacity) {
+            offsets[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return n + sv__find_any2_scalar(data + i, count - i, a, b, i, offsets + n, capacity - n);
+}
+
+__attribute__((target("avx2")))
+static size_t sv__find_any2_avx2(const char *data, size_t count, char a, char b,
+                                 size_t *offsets, size_t capacity)
+{
+    const __m256i needle_a = _mm256_set1_epi8(a);
+    const __m256i needle_b = _mm256_set1_epi8(b);
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 32 <= count && n < capacity; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (data + i));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, needle_a), _mm256_cmpeq_epi8(chunk, needle_b)));
+        while (mask && n < capacity) {
+            offsets[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return n + sv__find_any2_scalar(data + i, count - i, a, b, i, offsets + n, capacity - n);
+}
+#endif // SV_SIMD_X86
+
+// Returns the index of the first `c` in data or `count` if there is none
+static size_t sv__find_byte(const char *data, size_t count, char c)
+{
+#ifdef SV_SIMD_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return sv__find_byte_avx2(data, count, c);
+    }
+    return sv__find_byte_sse2(data, count, c);
+#else
+    return sv__find_byte_scalar(data, count, c);
+#endif
+}
+
 SVDEF String_View sv_from_parts(const char *data, size_t count)
 {
     String_View sv;
@@ -144,10 +257,7 @@ SVDEF String_View sv_chop_right(String_View *sv, size_t n)
 
 SVDEF bool sv_index_of(String_View sv, char c, size_t *index)
 {
-    size_t i = 0;
-    while (i < sv.count && sv.data[i] != c) {
-        i += 1;
-    }
+    size_t i = sv__find_byte(sv.data, sv.count, c);
 
     if (i < sv.count) {
         if (index) {
@@ -159,12 +269,25 @@ SVDEF bool sv_index_of(String_View sv, char c, size_t *index)
     }
 }
 
-SVDEF bool sv_try_chop_by_delim(String_View *sv, char delim, String_View *chunk)
+// Bulk version of sv_index_of for two delimiters at once. Stores the
+// offsets of every `a` or `b` in sv into offsets, stopping once capacity
+// of them were found, and returns how many were stored. When the result
+// equals capacity there may be more to find past the last offset.
+SVDEF size_t sv_index_of_any2(String_View sv, char a, char b, size_t *offsets, size_t capacity)
 {
-    size_t i = 0;
-    while (i < sv->count && sv->data[i] != delim) {
-        i += 1;
+#ifdef SV_SIMD_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return sv__find_any2_avx2(sv.data, sv.count, a, b, offsets, capacity);
     }
+    return sv__find_any2_sse2(sv.data, sv.count, a, b, offsets, capacity);
+#else
+    return sv__find_any2_scalar(sv.data, sv.count, a, b, 0, offsets, capacity);
+#endif
+}
+
+SVDEF bool sv_try_chop_by_delim(String_View *sv, char delim, String_View *chunk)
+{
+    size_t i = sv__find_byte(sv->data, sv->count, delim);
 
     String_View result = sv_from_parts(sv->data, i);
 
@@ -182,10 +305,7 @@ SVDEF bool sv_try_chop_by_delim(String_View *sv, char delim, String_View *chunk)
 
 SVDEF String_View sv_chop_by_delim(String_View *sv, char delim)
 {
-    size_t i = 0;
-    while (i < sv->count && sv->data[i] != delim) {
-        i += 1;
-    }
+    size_t i = sv__find_byte(sv->data, sv->count, delim);
 
     String_View result = sv_from_parts(sv->data, i);
 